@@ -57,61 +57,67 @@ bool valid_codec(uint8_t c)
 ret_t
 heuristic_rtp(struct sk_buff *skb, ret_t ret, bool steer)
 {
-	sk_function_t fun = get_next_function(skb);
+	const struct pfq_dissect *d;
 
         if (is_skip(ret) || is_drop(ret))
-                return pfq_call(get_next_function(skb), skb, ret);
+                return ret;
 
-	if (eth_hdr(skb)->h_proto == __constant_htons(ETH_P_IP))
+	d = pfq_skb_dissect(skb);
+	if (has_ipv4(d))
 	{
-		struct iphdr _iph;
-    		const struct iphdr *ip;
-
 		struct headers _hdr;
 		const struct headers *hdr;
 
                 uint16_t source,dest;
 
-		ip = skb_header_pointer(skb, skb->mac_len, sizeof(_iph), &_iph);
- 		if (ip == NULL)
-        		return pfq_call(fun, skb, drop());
-
-		if (ip->protocol != IPPROTO_UDP)
-        		return pfq_call(fun, skb, drop());
+		if (d->l4_proto != IPPROTO_UDP || !has_flow(d))
+        		return drop();
 
-		hdr = skb_header_pointer(skb, skb->mac_len + (ip->ihl<<2), sizeof(_hdr), &_hdr);
+		hdr = skb_header_pointer(skb, d->l4_off, sizeof(_hdr), &_hdr);
 		if (hdr == NULL)
-        		return pfq_call(fun, skb, drop());
+        		return drop();
 
 		/* version => 2 */
 
 		if (!((ntohs(hdr->un.rtp.rh_flags) & 0xc000) == 0x8000))
-        		return pfq_call(fun, skb, drop());
+        		return drop();
 
 		dest   = ntohs(hdr->udp.dest);
 		source = ntohs(hdr->udp.source);
 
 		if (dest < 1024 || source < 1024)
-        		return pfq_call(fun, skb, drop());
+        		return drop();
 
 		if ((dest & 1) && (source & 1))  // rtcp
 		{
                 	if (hdr->un.rtcp.rh_type != 200)  // SR
-        			return pfq_call(fun, skb, drop());
+        			return drop();
 		}
 		else if (!((dest & 1) || (source & 1)))
 		{
                 	uint8_t pt = hdr->un.rtp.rh_pt;
                  	if (!valid_codec(pt))
-        			return pfq_call(fun, skb, drop());
+        			return drop();
+		}
+
+		if (steer)
+		{
+			/* rtp and rtcp (even/odd ports) of a session go together */
+
+			struct pfq_steer_context c = steer_context(skb);
+
+			if (c.hash == Q_HASH_LEGACY)
+				return stop(steering(Q_CLASS_DEFAULT, d->addr.ip4.saddr ^ d->addr.ip4.daddr ^ ((uint32_t)(hdr->udp.source & 0xfffe) << 16) ^ (hdr->udp.dest & 0xfffe)));
+
+			return stop(steering(Q_CLASS_DEFAULT, pfq_hash_flow(c.hash, d->addr.ip4.saddr, d->addr.ip4.daddr,
+									    hdr->udp.source & htons(0xfffe), hdr->udp.dest & htons(0xfffe), c.seed)));
 		}
 
-		return steer ? steering(Q_CLASS_DEFAULT, ip->saddr ^ ip->daddr ^ ((uint32_t)(hdr->udp.source & 0xfffe) << 16) ^ (hdr->udp.dest & 0xfffe)) :
-		               pfq_call(fun, skb, ret);
+		return ret;
 
 	}
 
-        return pfq_call(fun, skb, drop());
+        return drop();
 }
 
 
@@ -130,7 +136,7 @@ steering_rtp(struct sk_buff *skb, ret_t ret)
 
 struct sk_function_descr hooks[] = {
 	{ "rtp",       filter_rtp },
-	{ "steer-rtp", steering_rtp },
+	{ "steer-rtp", steering_rtp, 0, NULL, NULL, sizeof(struct pfq_steer_context) },
 	{ NULL, NULL}};
 
 
@@ -25,8 +25,10 @@
 #define _PF_Q_FUN_H_
 
 #include <linux/pf_q.h>
+#include <linux/pf_q-hash.h>
 
 #include <linux/skbuff.h>
+#include <linux/percpu.h>
 #include <linux/ip.h>
 #include <linux/icmp.h>
 #include <linux/ipv6.h>
@@ -35,11 +37,19 @@
 
 
 struct sk_function_descr;
+struct pfq_dissect;
+struct pfq_percpu_context;
 
 extern int pfq_register_functions  (const char *module, struct sk_function_descr *fun);
 
 extern int pfq_unregister_functions(const char *module, struct sk_function_descr *fun);
 
+extern void __pfq_dissect_skb(struct sk_buff *skb, struct pfq_dissect *d);
+
+extern int  __pfq_dissect_tunnel(struct sk_buff *skb, const struct pfq_dissect *outer, struct pfq_dissect *inner, int depth);
+
+extern int  __pfq_tunnel_type(struct sk_buff *skb, const struct pfq_dissect *d);
+
 
 enum action
 {
@@ -49,6 +59,8 @@ enum action
     action_dispatch  = 0x04,
     action_steal     = 0x08,
     action_skip      = 0x10,
+    action_stop      = 0x20,
+    action_balance   = 0x40,
     action_to_kernel = 0x80,
 };
 
@@ -97,15 +109,66 @@ is_skip(ret_t ret)
     return ret.type & action_skip;
 }
 
+static inline bool
+is_stop(ret_t ret)
+{
+    return ret.type & action_stop;
+}
 
+static inline bool
+is_balance(ret_t ret)
+{
+    return ret.type & action_balance;
+}
+
+
+
+/* functions of a group are evaluated in sequence: each one receives the
+ * result of the previous one and returns its own. The evaluation ends after
+ * the last function or as soon as a function returns a stop()'ed result.
+ */
 
 typedef ret_t (*sk_function_t)(struct sk_buff *, ret_t);
 
 
+/* batch functions are evaluated once per stage on the whole prefetch queue:
+ * skbs is the queue, mask selects the packets still running the computation
+ * and ret holds their results (on input, the results of the previous stage).
+ * Functions without a batch version are run per-skb by the core.
+ */
+
+typedef void (*sk_batch_function_t)(struct sk_buff **skbs, unsigned long mask, ret_t *ret);
+
+
+#define batch_for_each(skb, n, mask, skbs) \
+        for(n = __builtin_ctzl(mask); mask && ((skb = (skbs)[n]), true); \
+            mask &= mask - 1, n = __builtin_ctzl(mask))
+
+
+/* merge a per-cpu replica (ctx) into the aggregated view (acc) */
+
+typedef void (*sk_merge_t)(void *acc, const void *ctx, size_t size);
+
+
+/* a function may declare a per-cpu context of percpu_size bytes: a zeroed
+ * replica is allocated for each cpu when the function is bound to a group,
+ * it is accessed lock-free with get_cpu_context() and read from user space
+ * (Q_SO_GET_GROUP_CONTEXT) as the merge of all the replicas.
+ * A NULL merge sums the replicas as arrays of unsigned long.
+ *
+ * A function that reads the context set from user space (Q_SO_GROUP_CONTEXT)
+ * declares its size in context_size: contexts of a different size are
+ * rejected when set, so that the function can read it without checks.
+ */
+
 struct sk_function_descr
 {
     const char *      name;
     sk_function_t     function;
+    size_t            percpu_size;
+    sk_merge_t        merge;
+    sk_batch_function_t batch;              /* optional batch version of function */
+    size_t            context_size;         /* size of the user context (0: none) */
 };
 
 
@@ -114,18 +177,95 @@ struct fun_context
     atomic_long_t   function;
     atomic_long_t   context;
     spinlock_t      lock;
+
+    sk_batch_function_t         batch;      /* (group_sem) */
+    size_t                      context_size; /* expected size of the context (group_sem) */
+    struct pfq_percpu_context * percpu;     /* per-cpu replicas (group_sem) */
+};
+
+
+/* a function of a sealed computation, with its contexts resolved */
+
+struct pfq_functional
+{
+    sk_function_t   function;
+    sk_batch_function_t batch;
+    void *          context;
+    void __percpu * percpu;
+    spinlock_t *    lock;
+};
+
+
+/* header dissection: performed once per packet (on first use) and shared
+ * by all the functions of all the groups the packet is delivered to.
+ */
+
+enum dissect_flags
+{
+    dissect_valid    = 0x01,        /* dissection already performed */
+    dissect_ipv4     = 0x02,        /* IPv4 header available */
+    dissect_ipv6     = 0x04,        /* IPv6 header available */
+    dissect_l4       = 0x08,        /* transport header available (l4_proto) */
+    dissect_vlan     = 0x10,        /* vlan tags (accelerated or in-band) */
+    dissect_mpls     = 0x20,        /* mpls label stack */
+    dissect_frag     = 0x40,        /* ip fragment (frag_id): transport header in the first one only */
+};
+
+
+/* tunnels recognized by the dissection (see __pfq_dissect_tunnel) */
+
+enum tunnel_type
+{
+    tunnel_none  = 0,
+    tunnel_ipip,                    /* IPv4/IPv6 in IPv4/IPv6 */
+    tunnel_gre,
+    tunnel_vxlan,
+    tunnel_gtp,                     /* GTP-U */
+};
+
+
+struct pfq_dissect
+{
+    uint16_t    flags;
+
+    __be16      l3_proto;           /* ethertype */
+    uint16_t    l3_off;             /* offset of the network header */
+    uint16_t    l4_off;             /* offset of the transport header */
+    uint8_t     l4_proto;           /* IP protocol (or IPv6 next header) */
+
+    union
+    {
+        struct {
+            __be32  saddr;
+            __be32  daddr;
+        } ip4;
+
+        struct {
+            struct in6_addr saddr;
+            struct in6_addr daddr;
+        } ip6;
+
+    } addr;
+
+    __be16      sport;              /* tcp/udp ports (0 otherwise) */
+    __be16      dport;
+
+    uint8_t     vlan_cnt;           /* number of vlan tags (802.1Q/802.1ad) */
+    uint16_t    vlan[2];            /* vid of the outer and of the innermost tag */
+    uint32_t    mpls;               /* top label of the mpls stack */
+    uint32_t    frag_id;            /* identification of the fragmented datagram */
 };
 
 
 struct pfq_annotation
 {
-    unsigned long group_mask;
+    const unsigned long * group_mask;       /* devmap groups bitmap */
 
     unsigned long state;
 
-    struct fun_context * fun_ctx;
+    struct pfq_functional * functional;     /* function currently running */
 
-    int index;      /* call index */
+    struct pfq_dissect * dissect;
 
     char direct_skb;
 
@@ -141,47 +281,165 @@ pfq_skb_annotation(struct sk_buff *skb)
 }
 
 
-/* utility functions */
+/* header dissection: lazily performed on first access */
+
+static inline
+const struct pfq_dissect * pfq_skb_dissect(struct sk_buff *skb)
+{
+    struct pfq_dissect *d = pfq_skb_annotation(skb)->dissect;
+    if (unlikely(!(d->flags & dissect_valid)))
+        __pfq_dissect_skb(skb, d);
+    return d;
+}
+
+
+/* dissect the headers of a batch up front: the data of all the packets is
+ * prefetched first, so that the misses overlap instead of being paid one
+ * skb at a time by the functions.
+ */
+
+static inline
+void batch_dissect(struct sk_buff **skbs, unsigned long mask)
+{
+    struct sk_buff *skb; unsigned long m = mask, n;
+
+    batch_for_each(skb, n, m, skbs)
+        __builtin_prefetch(skb->data, 0, 1);
+
+    batch_for_each(skb, n, mask, skbs)
+        pfq_skb_dissect(skb);
+}
+
+
+/* batch version of a per-skb function, on a dissected batch */
+
+#define DEFINE_BATCH_FUNCTION(fun) \
+static void fun##_batch(struct sk_buff **skbs, unsigned long mask, ret_t *ret) \
+{ \
+    struct sk_buff *skb; unsigned long n; \
+    batch_dissect(skbs, mask); \
+    batch_for_each(skb, n, mask, skbs) \
+        ret[n] = fun(skb, ret[n]); \
+}
+
 
 static inline
-ret_t pfq_call(sk_function_t fun, struct sk_buff *skb, ret_t ret)
+bool has_ipv4(const struct pfq_dissect *d)
 {
-    pfq_skb_annotation(skb)->index++;
-    return fun ? fun(skb, ret) : ret;
+    return d->flags & dissect_ipv4;
 }
 
 
 static inline
-sk_function_t
-get_next_function(struct sk_buff *skb)
+bool has_ipv6(const struct pfq_dissect *d)
 {
-    int index = pfq_skb_annotation(skb)->index;
-    return (sk_function_t) atomic_long_read(& pfq_skb_annotation(skb)->fun_ctx[index+1].function);
+    return d->flags & dissect_ipv6;
 }
 
 
+static inline
+bool has_frag(const struct pfq_dissect *d)
+{
+    return d->flags & dissect_frag;
+}
+
+
+/* transport protocol of the packet: the header is available, or the packet
+ * is a fragment of a datagram of that protocol.
+ */
+
+static inline
+bool has_l4(const struct pfq_dissect *d, uint8_t proto)
+{
+    return (d->flags & (dissect_l4|dissect_frag)) && d->l4_proto == proto;
+}
+
+
+static inline
+bool is_flow(const struct pfq_dissect *d)
+{
+    return has_l4(d, IPPROTO_UDP) || has_l4(d, IPPROTO_TCP);
+}
+
+
+static inline
+bool has_vlan(const struct pfq_dissect *d)
+{
+    return d->flags & dissect_vlan;
+}
+
+
+static inline
+bool has_mpls(const struct pfq_dissect *d)
+{
+    return d->flags & dissect_mpls;
+}
+
+
+/* ports available: udp/tcp header present */
+
+static inline
+bool has_flow(const struct pfq_dissect *d)
+{
+    return (d->flags & dissect_l4) && (d->l4_proto == IPPROTO_UDP || d->l4_proto == IPPROTO_TCP);
+}
+
+
+/* utility functions */
+
 static inline
 void * get_unsafe_context(struct sk_buff *skb)
 {
-    int index = pfq_skb_annotation(skb)->index;
-    return (void *)atomic_long_read(&pfq_skb_annotation(skb)->fun_ctx[index].context);
+    return pfq_skb_annotation(skb)->functional->context;
 }
 
 
 static inline
 void * get_context(struct sk_buff *skb)
 {
-    int index = pfq_skb_annotation(skb)->index;
-    spin_lock(&pfq_skb_annotation(skb)->fun_ctx[index].lock);
-    return (void *)atomic_long_read(&pfq_skb_annotation(skb)->fun_ctx[index].context);
+    struct pfq_functional *f = pfq_skb_annotation(skb)->functional;
+    spin_lock(f->lock);
+    return f->context;
 }
 
 
 static inline
 void put_context(struct sk_buff *skb)
 {
-    int index = pfq_skb_annotation(skb)->index;
-    spin_unlock(&pfq_skb_annotation(skb)->fun_ctx[index].lock);
+    spin_unlock(pfq_skb_annotation(skb)->functional->lock);
+}
+
+
+/* per-cpu context: lock-free, the replica of the running cpu */
+
+static inline
+void * get_cpu_context(struct sk_buff *skb)
+{
+    return this_cpu_ptr(pfq_skb_annotation(skb)->functional->percpu);
+}
+
+
+/* hash configuration of the steering functions (context, if any: its size
+ * is checked when set)
+ */
+
+static inline
+struct pfq_steer_context steer_context(struct sk_buff *skb)
+{
+    const struct pfq_steer_context *c = get_unsafe_context(skb);
+    struct pfq_steer_context def = { Q_HASH_LEGACY, 0 };
+    return c ? *c : def;
+}
+
+
+/* hash configuration and depth of the tunnel steering functions */
+
+static inline
+struct pfq_tunnel_context tunnel_context(struct sk_buff *skb)
+{
+    const struct pfq_tunnel_context *c = get_unsafe_context(skb);
+    struct pfq_tunnel_context def = { Q_HASH_LEGACY, 0, 1 };
+    return c ? *c : def;
 }
 
 
@@ -237,12 +495,26 @@ ret_t steering(unsigned int cl, unsigned int hash)
 }
 
 
-/* stolen packet: the skb is stolen by the steering function. (i.e. forwarded) */
+/* balance skb: for this group, dispatch the skb to the least loaded socket of the given classes.
+ * A non-zero hash keeps the packets of a flow on the socket chosen for its first packet.
+ */
+
+static inline
+ret_t balance(unsigned int cl, unsigned int hash)
+{
+    ret_t ret = { hash ^ (hash >> 8), action_dispatch|action_balance, cl };
+    return ret;
+}
+
+
+/* stolen packet: the skb is stolen by the steering function. (i.e. forwarded)
+ * The computation ends here, as the skb is no longer owned by PFQ.
+ */
 
 static inline
 ret_t stolen(void)
 {
-    ret_t ret = { 0, action_steal, 0 };
+    ret_t ret = { 0, action_steal|action_stop, 0 };
     return ret;
 }
 
@@ -267,6 +539,16 @@ ret_t to_kernel(ret_t ret)
 }
 
 
+/* stop: end the computation for this group (the following functions are not evaluated) */
+
+static inline
+ret_t stop(ret_t ret)
+{
+    ret.type |= action_stop;
+    return ret;
+}
+
+
 static inline
 ret_t clear_skip(ret_t ret)
 {
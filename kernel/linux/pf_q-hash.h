@@ -0,0 +1,201 @@
+/***************************************************************
+ *
+ * (C) 2011-13 Nicola Bonelli <nicola.bonelli@cnit.it>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ ****************************************************************/
+
+
+#ifndef _PF_Q_HASH_H_
+#define _PF_Q_HASH_H_
+
+/* symmetric hash functions for steering: h(src, dst) == h(dst, src).
+ * The header is shared with user space, so that tools can reproduce the
+ * distribution of the kernel.
+ */
+
+#ifdef __KERNEL__
+#include <linux/types.h>
+#include <linux/kernel.h>
+#include <asm/byteorder.h>
+#else
+#include <stdint.h>
+#include <arpa/inet.h>
+#endif
+
+#include <linux/pf_q.h>
+
+
+/* jhash (lookup3 final mix, same as the kernel jhash_3words) */
+
+#define PFQ_JHASH_INITVAL       0xdeadbeef
+
+static inline uint32_t
+pfq_rol32(uint32_t w, unsigned int s)
+{
+        return (w << s) | (w >> ((32 - s) & 31));
+}
+
+
+static inline uint32_t
+pfq_jhash_3words(uint32_t a, uint32_t b, uint32_t c, uint32_t seed)
+{
+        a += PFQ_JHASH_INITVAL;
+        b += PFQ_JHASH_INITVAL;
+        c += seed;
+
+        c ^= b; c -= pfq_rol32(b, 14);
+        a ^= c; a -= pfq_rol32(c, 11);
+        b ^= a; b -= pfq_rol32(a, 25);
+        c ^= b; c -= pfq_rol32(b, 16);
+        a ^= c; a -= pfq_rol32(c, 4);
+        b ^= a; b -= pfq_rol32(a, 14);
+        c ^= b; c -= pfq_rol32(b, 24);
+
+        return c;
+}
+
+
+/* Toeplitz with the symmetric key 0x6d5a6d5a...: the key has a period of 16
+ * bits, so the hash of the input is the hash of its 16-bit words xor'ed
+ * together (in network byte order).
+ */
+
+#define PFQ_TOEPLITZ_KEY        0x6d5a6d5a
+
+static inline uint32_t
+pfq_toeplitz16(uint16_t x)
+{
+        uint32_t h = 0;
+        int b;
+
+        for(b = 0; x; b++, x <<= 1)
+        {
+                if (x & 0x8000)
+                        h ^= pfq_rol32(PFQ_TOEPLITZ_KEY, b);
+        }
+        return h;
+}
+
+
+static inline uint16_t
+pfq_fold16(uint32_t w)
+{
+        return (uint16_t)(w ^ (w >> 16));
+}
+
+
+/* hash of a pair of endpoints (addresses, vlan ids...) */
+
+static inline uint32_t
+pfq_hash_2words(int type, uint32_t a, uint32_t b, uint32_t seed)
+{
+        switch(type)
+        {
+        case Q_HASH_JHASH:
+                return a < b ? pfq_jhash_3words(a, b, 0, seed) : pfq_jhash_3words(b, a, 0, seed);
+        case Q_HASH_TOEPLITZ:
+                return pfq_toeplitz16(ntohs(pfq_fold16(a ^ b)));
+        default:
+                return a ^ b;
+        }
+}
+
+
+/* hash of a transport flow: addresses and ports as found in the packet */
+
+static inline uint32_t
+pfq_hash_flow(int type, uint32_t saddr, uint32_t daddr, uint16_t sport, uint16_t dport, uint32_t seed)
+{
+        switch(type)
+        {
+        case Q_HASH_JHASH:
+                if (saddr > daddr || (saddr == daddr && sport > dport))
+                        return pfq_jhash_3words(daddr, saddr, ((uint32_t)dport << 16) | sport, seed);
+                return pfq_jhash_3words(saddr, daddr, ((uint32_t)sport << 16) | dport, seed);
+        case Q_HASH_TOEPLITZ:
+                return pfq_toeplitz16(ntohs(pfq_fold16(saddr ^ daddr) ^ sport ^ dport));
+        default:
+                return saddr ^ daddr ^ sport ^ dport;
+        }
+}
+
+
+/* hash of a pair of ipv6 addresses (4 words each) */
+
+static inline uint32_t
+pfq_hash_ip6(int type, const uint32_t *saddr, const uint32_t *daddr, uint32_t seed)
+{
+        const uint32_t *a = saddr, *b = daddr;
+        uint32_t h;
+        int n;
+
+        switch(type)
+        {
+        case Q_HASH_JHASH:
+                for(n = 0; n < 4 && saddr[n] == daddr[n]; n++)
+                        ;
+                if (n < 4 && saddr[n] > daddr[n]) {
+                        a = daddr;
+                        b = saddr;
+                }
+                h = pfq_jhash_3words(a[0], a[1], a[2], seed);
+                h = pfq_jhash_3words(a[3], b[0], b[1], h);
+                return pfq_jhash_3words(b[2], b[3], 0, h);
+
+        case Q_HASH_TOEPLITZ:
+                return pfq_toeplitz16(ntohs(pfq_fold16(a[0] ^ a[1] ^ a[2] ^ a[3] ^ b[0] ^ b[1] ^ b[2] ^ b[3])));
+        default:
+                return a[0] ^ a[1] ^ a[2] ^ a[3] ^ b[0] ^ b[1] ^ b[2] ^ b[3];
+        }
+}
+
+
+/* hash of an ipv6 transport flow: addresses and ports as found in the packet */
+
+static inline uint32_t
+pfq_hash_flow6(int type, const uint32_t *saddr, const uint32_t *daddr, uint16_t sport, uint16_t dport, uint32_t seed)
+{
+        const uint32_t *a = saddr, *b = daddr;
+        uint16_t pa = sport, pb = dport;
+        uint32_t h;
+        int n;
+
+        switch(type)
+        {
+        case Q_HASH_JHASH:
+                for(n = 0; n < 4 && saddr[n] == daddr[n]; n++)
+                        ;
+                if ((n < 4 && saddr[n] > daddr[n]) || (n == 4 && sport > dport)) {
+                        a = daddr;  pa = dport;
+                        b = saddr;  pb = sport;
+                }
+                h = pfq_jhash_3words(a[0], a[1], a[2], seed);
+                h = pfq_jhash_3words(a[3], b[0], b[1], h);
+                return pfq_jhash_3words(b[2], b[3], ((uint32_t)pa << 16) | pb, h);
+
+        case Q_HASH_TOEPLITZ:
+                return pfq_toeplitz16(ntohs(pfq_fold16(a[0] ^ a[1] ^ a[2] ^ a[3] ^ b[0] ^ b[1] ^ b[2] ^ b[3]) ^ sport ^ dport));
+        default:
+                return a[0] ^ a[1] ^ a[2] ^ a[3] ^ b[0] ^ b[1] ^ b[2] ^ b[3] ^ sport ^ dport;
+        }
+}
+
+
+#endif /* _PF_Q_HASH_H_ */
@@ -32,10 +32,6 @@
 
 #define Q_VERSION               "2.0"
 
-#define Q_MAX_CPU               64
-#define Q_MAX_ID                64
-#define Q_MAX_GROUP             64
-
 #define Q_MAX_DEVICE            256
 #define Q_MAX_DEVICE_MASK       (Q_MAX_DEVICE-1)
 #define Q_MAX_HW_QUEUE          256
@@ -55,6 +51,12 @@
 
 #define PF_Q    27          /* packet q domain */
 
+#define Q_MAX_CPU               256
+#define Q_MAX_ID                256
+#define Q_MAX_GROUP             256
+
+#define Q_GROUP_MASK_WORDS      ((Q_MAX_GROUP + (sizeof(unsigned long) << 3) - 1) / (sizeof(unsigned long) << 3))
+
 
 struct pfq_hdr
 {
@@ -94,22 +96,53 @@ struct pfq_hdr
 
 
 /*
-    +-----------------+------------------+          +------------------+
-    | pfq_queue_descr | pfq_hdr | packet | ...      | pfq_hdr | packet | ...
-    +-----------------+------------------+          +------------------+
-                      +                             +
-                      | <------+ queue 1  +-------> |  <----+ queue 2 +-------->
-                      +                             +
+    +-------------------+     +---------------------+------------------+          +------------------+
+    | pfq_queue_descr 0 | ... | pfq_queue_descr R-1 | pfq_hdr | packet | ...      | pfq_hdr | packet | ...
+    +-------------------+     +---------------------+------------------+          +------------------+
+                                                    +                             +
+                                                    | <---+ ring 0, queue 1 +---> |  <-+ ring 0, queue 2 +-> ... ring R-1
+                                                    +                             +
+
+    The queue is split in R rings (Q_SO_SET_RINGS, 1 by default), each one
+    a double buffer with its own descriptor: the producers running on cpu c
+    fill the ring c % R, so that the cpus do not share the same descriptor.
+    poll_wait is meaningful in the first descriptor only.
  */
 
 
+#define Q_CACHELINE_SIZE           64
+
 struct pfq_queue_descr
 {
     volatile unsigned int   data;
     volatile int            poll_wait;
 
-} __attribute__((aligned(8)));
+} __attribute__((aligned(Q_CACHELINE_SIZE)));   /* one cache line per ring */
+
+#define Q_MAX_RINGS                16
+
 
+/* layout of the slots (Q_SO_SET_LAYOUT):
+ *
+ * Q_LAYOUT_CACHELINE: the slot size is rounded to a cache line, so that
+ * every slot (and then every batch of a producer) starts on a cache line
+ * boundary and the producers of adjacent slots never share a line.
+ * The libraries read the slot size from the kernel (Q_SO_GET_SLOT_SIZE).
+ *
+ * Q_LAYOUT_VARLEN: a slot takes pfq_hdr + caplen bytes, rounded to the
+ * alignment of the layout; the next slot starts MPDB_VARLEN_STRIDE(caplen)
+ * bytes after the header (read it once the slot is committed). The buffers
+ * keep the size slots * slot_size, and MPDB_QUEUE_LEN counts alignment units
+ * rather than packets. A committed slot with len 0 holds no packet (dropped
+ * by the kernel after its units were reserved): step over it.
+ */
+
+#define Q_LAYOUT_DEFAULT           0
+#define Q_LAYOUT_CACHELINE         1
+#define Q_LAYOUT_VARLEN            2
+
+#define MPDB_QUEUE_SLOT_ALIGN(layout)       (((layout) & Q_LAYOUT_CACHELINE) ? Q_CACHELINE_SIZE : 8)
+#define MPDB_VARLEN_STRIDE(caplen, align)   ((sizeof(struct pfq_hdr) + (caplen) + (align) - 1) & ~((size_t)(align) - 1))
 
 #define MPDB_QUEUE_SLOT_SIZE(x)    ALIGN(sizeof(struct pfq_hdr) + x, 8)
 #define MPDB_QUEUE_INDEX(data)     (((data) & 0xff000000U) >> 24)
@@ -133,18 +166,37 @@ struct pfq_queue_descr
 #define Q_SO_GROUP_FPROG            13      /* Berkeley packet filter */
 #define Q_SO_GROUP_VLAN_FILT_TOGGLE 14      /* enable/disable VLAN filters */
 #define Q_SO_GROUP_VLAN_FILT        15      /* enable/disable VLAN ID filters */
+#define Q_SO_GROUP_RETA             16      /* set/reset the indirection table of steering */
+#define Q_SO_GROUP_WEIGHT           17      /* struct pfq_group_weight: steering weight of the socket */
+#define Q_SO_GROUP_ELEPHANT         18      /* struct pfq_group_elephant: handling of elephant flows */
+#define Q_SO_SET_RINGS              19      /* size_t: number of rings of the queue (1..Q_MAX_RINGS), each of Q_SO_SET_SLOTS slots */
 
 #define Q_SO_GET_ID                 20
 #define Q_SO_GET_STATUS             21      /* 1 = enabled, 0 = disabled */
 #define Q_SO_GET_STATS              23
 #define Q_SO_GET_TSTAMP             24
-#define Q_SO_GET_QUEUE_MEM          25      /* size of the whole dbmp queue (bytes) */
+#define Q_SO_GET_QUEUE_MEM          25      /* size of the whole dbmp queue (bytes), the size it needs when disabled */
 #define Q_SO_GET_CAPLEN             26
 #define Q_SO_GET_SLOTS              27
 #define Q_SO_GET_OFFSET             28
-#define Q_SO_GET_GROUPS             29
+#define Q_SO_GET_GROUPS             29      /* unsigned long (first word) or unsigned long[Q_GROUP_MASK_WORDS] */
 #define Q_SO_GET_GROUP_STATS        30
 #define Q_SO_GET_GROUP_CONTEXT      31
+#define Q_SO_GET_GROUP_FPROG_MODE   32      /* int: gid (in), Q_FPROG_* (out) */
+#define Q_SO_GET_BATCH_STATS        33      /* struct pfq_batch_stats (all cpus) */
+#define Q_SO_GET_BATCH_LEN          34      /* int[n <= Q_MAX_CPU]: current batch length of each cpu */
+#define Q_SO_GET_GROUP_RETA         35      /* struct pfq_group_reta: size is updated with the table size */
+#define Q_SO_GET_GROUP_WEIGHT       36      /* struct pfq_group_weight: gid (in), weight (out) */
+#define Q_SO_GET_FLOW_STATS         37      /* struct pfq_flow_stats (all cpus) */
+#define Q_SO_GET_RINGS              38
+#define Q_SO_SET_LAYOUT             39      /* int: Q_LAYOUT_* flags (setsockopt) */
+#define Q_SO_GET_LAYOUT             40
+#define Q_SO_GET_SLOT_SIZE          41      /* size_t: size of the slots of the current layout */
+#define Q_SO_SET_HUGEPAGES          42      /* struct pfq_hugepages: memory of the queue (setsockopt) */
+#define Q_SO_SET_NUMA_NODE          43      /* int: node of the queue memory, Q_NUMA_ANY or Q_NUMA_LOCAL (setsockopt) */
+#define Q_SO_GET_NUMA_NODE          44      /* int: node of the queue memory (the requested one when disabled) */
+#define Q_SO_GET_GROUP_NODES        45      /* struct pfq_group_nodes: size is updated with the number of queues */
+#define Q_SO_GET_GROUP_ELEPHANT     46      /* struct pfq_group_elephant: gid (in), policy and pps (out) */
 
 /* general defines */
 
@@ -175,6 +227,49 @@ struct pfq_vlan_toggle
 };
 
 
+/* hugepage backed queue (Q_SO_SET_HUGEPAGES, before Q_SO_TOGGLE_QUEUE):
+ * the memory is mapped by the process from hugetlbfs (MAP_HUGETLB, 2 MB or
+ * 1 GB pages) and pinned by the kernel while the queue is enabled, so that
+ * the consumer walks the queue through huge page mappings. size must be at
+ * least Q_SO_GET_QUEUE_MEM; addr = NULL restores the vmalloc'ed queue. The
+ * socket cannot be mmap'ed in this mode.
+ */
+
+struct pfq_hugepages
+{
+    void *  addr;
+    size_t  size;
+};
+
+#define Q_HUGEPAGE_2M       (1UL << 21)
+#define Q_HUGEPAGE_1G       (1UL << 30)
+
+
+/* numa: the queue is allocated on the given node (Q_SO_SET_NUMA_NODE,
+ * before Q_SO_TOGGLE_QUEUE), on the node of the thread that enables it
+ * (Q_NUMA_LOCAL) or wherever the allocator lands (Q_NUMA_ANY, default).
+ * Q_SO_GET_GROUP_NODES reports the node of the devices of the hardware
+ * queues bound to a group.
+ */
+
+#define Q_NUMA_ANY          -1
+#define Q_NUMA_LOCAL        -2
+
+struct pfq_queue_node
+{
+    int if_index;
+    int hw_queue;
+    int node;
+};
+
+struct pfq_group_nodes
+{
+    int gid;
+    int size;
+    struct pfq_queue_node * queue;
+};
+
+
 /* struct used for binding */
 
 
@@ -233,6 +328,119 @@ struct pfq_group_context
 };
 
 
+/* context of the steer-* functions (optional): hash family and seed.
+ * All the hashes are symmetric (both directions of a flow are steered to
+ * the same socket).
+ */
+
+#define Q_HASH_LEGACY           0       /* xor of the fields (default) */
+#define Q_HASH_JHASH            1       /* jhash of the ordered endpoints */
+#define Q_HASH_TOEPLITZ         2       /* Toeplitz, symmetric key 0x6d5a */
+
+struct pfq_steer_context
+{
+    int          hash;
+    unsigned int seed;
+};
+
+
+/* context of the tunnel steering functions: hashes the inner headers of up
+ * to depth nested tunnels (IP-in-IP, GRE, VXLAN, GTP-U).
+ * A pfq_steer_context is not accepted in its place (the size must match).
+ */
+
+#define Q_TUNNEL_MAX_DEPTH      4
+
+struct pfq_tunnel_context
+{
+    int          hash;              /* Q_HASH_* */
+    unsigned int seed;
+    int          depth;             /* 1..Q_TUNNEL_MAX_DEPTH */
+};
+
+
+/* context of the "counter" function (Q_SO_GET_GROUP_CONTEXT) */
+
+struct pfq_counter
+{
+    unsigned long packets;
+    unsigned long bytes;
+};
+
+
+/* sampling functions: 1-in-ratio packets pass ("sample") or 1-in-ratio
+ * flows ("sample-flow"). The ratio is set with the context of the function
+ * (Q_SO_GROUP_CONTEXT), the counters are read back with Q_SO_GET_GROUP_CONTEXT.
+ */
+
+struct pfq_sample_context
+{
+    unsigned int ratio;             /* 0 or 1: every packet passes */
+    unsigned int seed;
+};
+
+struct pfq_sample_stats
+{
+    unsigned long packets;
+    unsigned long sampled;
+};
+
+
+/* weight of a socket in the steering of a group (1 on join): a socket
+ * with weight w receives w shares of the flows steered to the group.
+ */
+
+#define Q_MAX_WEIGHT            16
+
+struct pfq_group_weight
+{
+    int gid;
+    int weight;
+};
+
+
+/* flow table of balanced steering: flows stick to the socket chosen for
+ * their first packet. A flow exceeding pps packets per second is an
+ * elephant and is handled according to the policy of the group.
+ */
+
+#define Q_ELEPHANT_PIN          0       /* elephants stay on their socket */
+#define Q_ELEPHANT_SPLIT        1       /* packets of elephants are spread over the eligible sockets */
+#define Q_ELEPHANT_REHOME       2       /* elephants move once to the least loaded socket */
+
+struct pfq_group_elephant
+{
+    int          gid;
+    int          policy;
+    unsigned int pps;                   /* 0 disables the detection */
+};
+
+struct pfq_flow_stats
+{
+    unsigned long flows;                /* active flows */
+    unsigned long insert;
+    unsigned long evict;                /* active flows replaced by new ones */
+    unsigned long expire;               /* idle flows replaced by new ones */
+    unsigned long elephant;             /* flows detected as elephants */
+};
+
+
+/* indirection table of steering: the hash of a packet selects a bucket,
+ * each bucket holds the id of a socket of the group. Packets of buckets
+ * whose socket is not eligible are steered among the eligible sockets.
+ * size is a power of 2 (up to Q_RETA_MAX), 0 removes the table.
+ */
+
+#define Q_RETA_MAX              512
+
+struct pfq_group_reta
+{
+    int   gid;
+    int   size;
+    int * sock;
+};
+
+
 /* pfq_fprog: per-group sock_fprog */
 
 struct pfq_fprog
@@ -241,6 +449,12 @@ struct pfq_fprog
     struct sock_fprog fcode;
 };
 
+/* execution mode of the group filter */
+
+#define Q_FPROG_NONE            0       /* no filter installed */
+#define Q_FPROG_INTERP          1       /* BPF interpreter */
+#define Q_FPROG_JIT             2       /* BPF JIT compiled */
+
 
 /* pfq statistics for socket and groups */
 
@@ -252,4 +466,13 @@ struct pfq_stats
 };
 
 
+/* prefetch batches (see the prefetch_len and flush_timeout parameters) */
+
+struct pfq_batch_stats
+{
+    unsigned long int batch;  /* full batches processed                  */
+    unsigned long int flush;  /* partial batches flushed on timeout      */
+};
+
+
 #endif /* _PF_Q_H_ */
@@ -35,4 +35,11 @@
 	for(; n = mask & -mask, mask ; mask^=n)
 
 
+/* iterate over the set bits of a multi-word bitmap: n is the bit index */
+
+#define pfq_bitmap_foreach(map, nwords, w, word, n) \
+	for(w = 0; w < (nwords); w++) \
+		for(word = (map)[w]; word && (n = (w) * BITS_PER_LONG + pfq_ctz(word), true); word &= word - 1)
+
+
 #endif /* _PF_Q_BITS_H_ */
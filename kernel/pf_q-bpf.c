@@ -23,11 +23,76 @@
  ****************************************************************/
 
 #include <linux/kernel.h>
+#include <linux/version.h>
 #include <linux/module.h>
 #include <linux/filter.h>
 #include <linux/slab.h>
 #include <linux/uaccess.h>
+#include <linux/rcupdate.h>
 
+#include <linux/pf_q.h>
+
+#include <pf_q-bpf.h>
+
+
+/* since 3.3 the kernel exposes unattached filters, which are compiled by the
+ * BPF JIT (when enabled); older kernels are limited to the interpreter.
+ *
+ * In both cases filters are released after the RCU grace period.
+ */
+
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(3,3,0))
+#define PFQ_BPF_UNATTACHED
+#endif
+
+
+#ifdef PFQ_BPF_UNATTACHED
+
+struct sk_filter *
+pfq_alloc_sk_filter(struct sock_fprog *fprog)
+{
+        struct sock_fprog kprog;
+        struct sk_filter *fp;
+        unsigned int fsize = sizeof(struct sock_filter) * fprog->len;
+        int err;
+
+        /* Make sure new filter is there and in the right amounts. */
+        if (fprog->filter == NULL)
+                return NULL;
+
+        kprog.len = fprog->len;
+        kprog.filter = kmalloc(fsize, GFP_KERNEL);
+        if (!kprog.filter)
+                return NULL;
+
+        if (copy_from_user(kprog.filter, fprog->filter, fsize)) {
+                kfree(kprog.filter);
+                return NULL;
+        }
+
+        /* check and compile (JIT) the program... */
+
+        err = sk_unattached_filter_create(&fp, &kprog);
+        kfree(kprog.filter);
+        if (err)
+                return NULL;
+
+        pr_devel("[PFQ] %s: %p (%s)\n", __FUNCTION__, fp,
+                 pfq_sk_filter_mode(fp) == Q_FPROG_JIT ? "jit" : "interpreter");
+
+        return fp;
+}
+
+
+void pfq_free_sk_filter(struct sk_filter *filter)
+{
+        pr_devel("[PFQ] %s: %p\n", __FUNCTION__, filter);
+
+        if (filter)
+                sk_unattached_filter_destroy(filter);
+}
+
+#else
 
 struct sk_filter *
 pfq_alloc_sk_filter(struct sock_fprog *fprog)
@@ -54,7 +119,6 @@ pfq_alloc_sk_filter(struct sock_fprog *fprog)
 	err = sk_chk_filter(fp->insns, fp->len);
 	if (err)
 	{
-		/* bpf_jit_free(fp); */
 		kfree(fp);
 		return NULL;
 	}
@@ -65,16 +129,29 @@ pfq_alloc_sk_filter(struct sock_fprog *fprog)
 }
 
 
+static void
+pfq_free_sk_filter_rcu(struct rcu_head *rcu)
+{
+        kfree(container_of(rcu, struct sk_filter, rcu));
+}
+
+
 void pfq_free_sk_filter(struct sk_filter *filter)
 {
         pr_devel("[PFQ] %s: %p\n", __FUNCTION__, filter);
 
         if (filter)
-	{
-		/* bpf_jit_free(fp); */
-		kfree(filter);
-	}
+		call_rcu(&filter->rcu, pfq_free_sk_filter_rcu);
 }
 
+#endif
+
 
+int pfq_sk_filter_mode(const struct sk_filter *filter)
+{
+        if (filter == NULL)
+                return Q_FPROG_NONE;
+
+        return filter->bpf_func == sk_run_filter ? Q_FPROG_INTERP : Q_FPROG_JIT;
+}
 
@@ -26,5 +26,7 @@
 
 struct sk_filter * pfq_alloc_sk_filter(struct sock_fprog *fprog);
 
-int pfq_free_sk_filter(struct sk_filter *filter);
+void pfq_free_sk_filter(struct sk_filter *filter);
+
+int  pfq_sk_filter_mode(const struct sk_filter *filter);
 
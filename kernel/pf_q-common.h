@@ -33,9 +33,6 @@
 #include <pf_q-sparse-counter.h>
 
 
-#define GRACE_PERIOD 10     /* msec */
-
-
 /* sparse_counter_t stats */
 
 typedef struct pfq_kstats
@@ -47,18 +44,52 @@ typedef struct pfq_kstats
 } pfq_kstat_t;
 
 
+static inline int
+pfq_kstats_init(pfq_kstat_t *s)
+{
+        if (sparse_counter_init(&s->recv) == 0) {
+                if (sparse_counter_init(&s->lost) == 0) {
+                        if (sparse_counter_init(&s->drop) == 0)
+                                return 0;
+                        sparse_counter_free(&s->lost);
+                }
+                sparse_counter_free(&s->recv);
+        }
+        return -ENOMEM;
+}
+
+
+static inline void
+pfq_kstats_free(pfq_kstat_t *s)
+{
+        sparse_counter_free(&s->recv);
+        sparse_counter_free(&s->lost);
+        sparse_counter_free(&s->drop);
+}
+
+
 struct pfq_opt
 {
         int                 id;
         int                 tstamp;
 
         void *              addr;
-        size_t              queue_mem;  /* > sizeof(pfq_queue_descr) + q_slots * sizeof(slots) * 2 */
+        size_t              queue_mem;  /* > (sizeof(pfq_queue_descr) + q_slots * sizeof(slots) * 2) * rings */
 
         size_t              slots;      /* number of slots per queue */
+        size_t              rings;      /* number of rings (see pfq_queue_descr) */
         size_t              caplen;
         size_t              offset;
         size_t              slot_size;
+        int                 layout;     /* Q_LAYOUT_* flags */
+
+        void __user *       user_addr;  /* hugepages of the process (Q_SO_SET_HUGEPAGES) */
+        size_t              user_size;
+        struct page **      pages;      /* pinned while the queue is enabled */
+        size_t              nr_pages;
+
+        int                 numa_node;  /* requested node: Q_NUMA_ANY, Q_NUMA_LOCAL or node */
+        int                 queue_node; /* node of the allocation (Q_NUMA_ANY for vmalloc_user) */
 
         wait_queue_head_t   waitqueue;
         pfq_kstat_t         stat;
@@ -25,6 +25,7 @@
 #include <linux/kernel.h>
 #include <linux/module.h>
 #include <linux/semaphore.h>
+#include <linux/netdevice.h>
 
 #include <pf_q-devmap.h>
 
@@ -34,7 +35,7 @@
 
 DEFINE_SEMAPHORE(devmap_sem);
 
-atomic_long_t pfq_devmap [Q_MAX_DEVICE][Q_MAX_HW_QUEUE];
+unsigned long pfq_devmap [Q_MAX_DEVICE][Q_MAX_HW_QUEUE][BITS_TO_LONGS(Q_MAX_GROUP)];
 
 atomic_t pfq_devmap_monitor [Q_MAX_DEVICE];
 
@@ -44,22 +45,73 @@ void pfq_devmap_monitor_update(void)
     int i,j;
     for(i=0; i < Q_MAX_DEVICE; ++i)
     {
-        unsigned long val = 0;
-        for(j=0; j < Q_MAX_HW_QUEUE; ++j)
+        int val = 0;
+        for(j=0; j < Q_MAX_HW_QUEUE && !val; ++j)
         {
-            val |= atomic_long_read(&pfq_devmap[i][j]);
+            val = !bitmap_empty(pfq_devmap[i][j], Q_MAX_GROUP);
         }
 
-        atomic_set(&pfq_devmap_monitor[i], val ? 1 : 0);
+        atomic_set(&pfq_devmap_monitor[i], val);
     }
 }
 
 
+/* numa node of the devices of the queues bound to the group: return the
+ * number of queues, the first size are stored in queue.
+ */
+
+int pfq_devmap_get_nodes(int gid, struct pfq_queue_node *queue, int size)
+{
+    int n = 0, i, q;
+
+    down(&devmap_sem);
+
+    for(i=1; i < Q_MAX_DEVICE; ++i)
+    {
+        struct net_device *dev;
+        int node, queues;
+
+        if (!atomic_read(&pfq_devmap_monitor[i]))
+            continue;
+
+        dev = dev_get_by_index(&init_net, i);
+        if (dev == NULL)
+            continue;
+
+        node = dev_to_node(&dev->dev);
+#ifdef CONFIG_RPS
+        queues = min_t(int, dev->real_num_rx_queues, Q_MAX_HW_QUEUE);
+#else
+        queues = 1;
+#endif
+        dev_put(dev);
+
+        for(q=0; q < queues; ++q)
+        {
+            if (!test_bit(gid, pfq_devmap[i][q]))
+                continue;
+
+            if (n < size)
+            {
+                queue[n].if_index = i;
+                queue[n].hw_queue = q;
+                queue[n].node     = node;
+            }
+            n++;
+        }
+    }
+
+    up(&devmap_sem);
+
+    return n;
+}
+
+
 int pfq_devmap_update(int action, int index, int queue, int gid)
 {
     int n = 0, i,q;
 
-    if (unlikely(gid >= 64 || gid < 0))
+    if (unlikely(gid >= Q_MAX_GROUP || gid < 0))
     {
         pr_devel("[PF_Q] devmap_update: bad gid(%u)\n",gid);
         return 0;
@@ -71,27 +123,20 @@ int pfq_devmap_update(int action, int index, int queue, int gid)
     {
         for(q=0; q < Q_MAX_HW_QUEUE; ++q)
         {
-            unsigned long tmp;
-
             if (!__pfq_devmap_equal(i, q, index, queue))
                 continue;
 
             /* map_set... */
             if (action == map_set)
             {
-                tmp = atomic_long_read(&pfq_devmap[i][q]);
-                tmp |= 1L << gid;
-                atomic_long_set(&pfq_devmap[i][q], tmp);
+                set_bit(gid, pfq_devmap[i][q]);
                 n++;
                 continue;
             }
 
             /* map_reset */
-            tmp = atomic_long_read(&pfq_devmap[i][q]);
-            if (tmp & (1L<<gid))
+            if (test_and_clear_bit(gid, pfq_devmap[i][q]))
             {
-                tmp &= ~(1L<<gid);
-                atomic_long_set(&pfq_devmap[i][q], tmp);
                 n++;
                 continue;
             }
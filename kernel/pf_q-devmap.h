@@ -26,6 +26,7 @@
 #define _PF_Q_DEVMAP_H_
 
 #include <linux/pf_q.h>
+#include <linux/bitmap.h>
 
 #include <pf_q-common.h>
 
@@ -33,7 +34,7 @@
 
 enum { map_reset, map_set };
 
-extern atomic_long_t pfq_devmap [Q_MAX_DEVICE][Q_MAX_HW_QUEUE];
+extern unsigned long pfq_devmap [Q_MAX_DEVICE][Q_MAX_HW_QUEUE][BITS_TO_LONGS(Q_MAX_GROUP)];   /* group bitmaps */
 extern atomic_t pfq_devmap_monitor [Q_MAX_DEVICE];
 
 /* called from u-context
@@ -41,6 +42,7 @@ extern atomic_t pfq_devmap_monitor [Q_MAX_DEVICE];
 
 extern int  pfq_devmap_update(int action, int index, int queue, int gid);
 extern void pfq_devmap_monitor_update(void);
+extern int  pfq_devmap_get_nodes(int gid, struct pfq_queue_node *queue, int size);
 
 
 static inline
@@ -60,9 +62,9 @@ int __pfq_devmap_equal(int i1, int q1, int i2, int q2)
 
 
 static inline
-unsigned long __pfq_devmap_get_groups(int d, int q)
+const unsigned long * __pfq_devmap_get_groups(int d, int q)
 {
-    return atomic_long_read(&pfq_devmap[d & Q_MAX_DEVICE_MASK][q & Q_MAX_HW_QUEUE_MASK]);
+    return pfq_devmap[d & Q_MAX_DEVICE_MASK][q & Q_MAX_HW_QUEUE_MASK];
 }
 
 
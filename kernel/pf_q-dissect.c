@@ -0,0 +1,540 @@
+/***************************************************************
+ *
+ * (C) 2011-13 Nicola Bonelli <nicola.bonelli@cnit.it>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ ****************************************************************/
+
+#include <linux/list.h>
+
+#include <linux/kernel.h>
+#include <linux/skbuff.h>
+#include <linux/ip.h>
+#include <linux/ipv6.h>
+#include <linux/tcp.h>
+#include <linux/udp.h>
+#include <linux/icmp.h>
+#include <linux/if_ether.h>
+#include <linux/if_vlan.h>
+
+#include <net/ipv6.h>
+
+#include <linux/pf_q-fun.h>
+
+
+/* parse the transport header at d->l4_off */
+
+static void
+__pfq_dissect_l4(struct sk_buff *skb, struct pfq_dissect *d)
+{
+        union
+        {
+                struct tcphdr  tcp;
+                struct udphdr  udp;
+                struct icmphdr icmp;
+        } _l4;
+
+        switch(d->l4_proto)
+        {
+        case IPPROTO_TCP: {
+                const struct tcphdr *tcp = skb_header_pointer(skb, d->l4_off, sizeof(struct tcphdr), &_l4);
+                if (tcp == NULL)
+                        return;
+                d->sport = tcp->source;
+                d->dport = tcp->dest;
+        } break;
+
+        case IPPROTO_UDP: {
+                const struct udphdr *udp = skb_header_pointer(skb, d->l4_off, sizeof(struct udphdr), &_l4);
+                if (udp == NULL)
+                        return;
+                d->sport = udp->source;
+                d->dport = udp->dest;
+        } break;
+
+        case IPPROTO_ICMP:
+        case IPPROTO_ICMPV6: {
+                if (skb_header_pointer(skb, d->l4_off, sizeof(struct icmphdr), &_l4) == NULL)
+                        return;
+        } break;
+
+        default:
+                return;
+        }
+
+        d->flags |= dissect_l4;
+}
+
+
+/* walk the ipv6 extension headers up to the transport header: returns false
+ * if it is not available (non-first fragment, ESP, truncated chain...)
+ */
+
+#define PFQ_IPV6_MAX_EXTHDR     8
+
+static bool
+__pfq_dissect_ipv6_exthdr(struct sk_buff *skb, struct pfq_dissect *d)
+{
+        int n;
+
+        for(n = 0; n < PFQ_IPV6_MAX_EXTHDR; n++)
+        {
+                switch(d->l4_proto)
+                {
+                case NEXTHDR_HOP:
+                case NEXTHDR_ROUTING:
+                case NEXTHDR_DEST: {
+                        struct ipv6_opt_hdr _hdr;
+                        const struct ipv6_opt_hdr *hdr = skb_header_pointer(skb, d->l4_off, sizeof(_hdr), &_hdr);
+                        if (hdr == NULL)
+                                return false;
+                        d->l4_proto = hdr->nexthdr;
+                        d->l4_off  += ipv6_optlen(hdr);
+                } break;
+
+                case NEXTHDR_AUTH: {
+                        struct ipv6_opt_hdr _hdr;
+                        const struct ipv6_opt_hdr *hdr = skb_header_pointer(skb, d->l4_off, sizeof(_hdr), &_hdr);
+                        if (hdr == NULL)
+                                return false;
+                        d->l4_proto = hdr->nexthdr;
+                        d->l4_off  += ipv6_authlen(hdr);
+                } break;
+
+                case NEXTHDR_FRAGMENT: {
+                        struct frag_hdr _fh;
+                        const struct frag_hdr *fh = skb_header_pointer(skb, d->l4_off, sizeof(_fh), &_fh);
+                        if (fh == NULL)
+                                return false;
+                        d->l4_proto = fh->nexthdr;
+                        d->l4_off  += sizeof(struct frag_hdr);
+                        if (fh->frag_off & htons(IP6_OFFSET | IP6_MF)) {  /* not an atomic fragment */
+                                d->flags  |= dissect_frag;
+                                d->frag_id = ntohl(fh->identification);
+                                if (fh->frag_off & htons(IP6_OFFSET))
+                                        return false;
+                        }
+                } break;
+
+                default:
+                        return true;
+                }
+        }
+
+        return false;
+}
+
+
+/* parse the network header at offset off, given its ethertype */
+
+static void
+__pfq_dissect_l3(struct sk_buff *skb, struct pfq_dissect *d, int off, __be16 proto)
+{
+        d->l3_proto = proto;
+        d->l3_off   = off;
+
+        switch(proto)
+        {
+        case __constant_htons(ETH_P_IP): {
+                struct iphdr _iph;
+                const struct iphdr *ip;
+
+                ip = skb_header_pointer(skb, off, sizeof(_iph), &_iph);
+                if (ip == NULL)
+                        return;
+
+                d->flags         |= dissect_ipv4;
+                d->addr.ip4.saddr = ip->saddr;
+                d->addr.ip4.daddr = ip->daddr;
+                d->l4_proto       = ip->protocol;
+                d->l4_off         = off + (ip->ihl<<2);
+
+                if (ip->frag_off & htons(IP_MF | IP_OFFSET)) {
+                        d->flags  |= dissect_frag;
+                        d->frag_id = ntohs(ip->id);
+                        if (ip->frag_off & htons(IP_OFFSET))
+                                return;
+                }
+        } break;
+
+        case __constant_htons(ETH_P_IPV6): {
+                struct ipv6hdr _ip6h;
+                const struct ipv6hdr *ip6;
+
+                ip6 = skb_header_pointer(skb, off, sizeof(_ip6h), &_ip6h);
+                if (ip6 == NULL)
+                        return;
+
+                d->flags         |= dissect_ipv6;
+                d->addr.ip6.saddr = ip6->saddr;
+                d->addr.ip6.daddr = ip6->daddr;
+                d->l4_proto       = ip6->nexthdr;
+                d->l4_off         = off + sizeof(struct ipv6hdr);
+
+                if (!__pfq_dissect_ipv6_exthdr(skb, d))
+                        return;
+        } break;
+
+        default:
+                return;
+        }
+
+        __pfq_dissect_l4(skb, d);
+}
+
+
+static void
+__pfq_dissect_init(struct pfq_dissect *d)
+{
+        d->flags    = dissect_valid;
+        d->l4_proto = 0;
+        d->l4_off   = 0;
+        d->sport    = 0;
+        d->dport    = 0;
+        d->vlan_cnt = 0;
+        d->mpls     = 0;
+        d->frag_id  = 0;
+}
+
+
+static void
+__pfq_dissect_vid(struct pfq_dissect *d, uint16_t vid)
+{
+        if (d->vlan_cnt == 0)
+                d->vlan[0] = vid;
+        d->vlan[1] = vid;
+        d->vlan_cnt++;
+        d->flags |= dissect_vlan;
+}
+
+
+/* walk the vlan tags (802.1Q, 802.1ad, QinQ) and the mpls label stack up to
+ * the network header: off and proto are updated accordingly.
+ */
+
+#define PFQ_MAX_VLAN            4
+#define PFQ_MAX_MPLS            8
+
+#define PFQ_MPLS_LABEL(x)       ((x) >> 12)
+#define PFQ_MPLS_BOS(x)         ((x) & 0x100)
+
+static bool
+__pfq_dissect_l2(struct sk_buff *skb, struct pfq_dissect *d, int *off, __be16 *proto)
+{
+        int n;
+
+        for(n = 0; n < PFQ_MAX_VLAN; n++)
+        {
+                struct vlan_hdr _vh;
+                const struct vlan_hdr *vh;
+
+                if (*proto != htons(ETH_P_8021Q) && *proto != htons(ETH_P_8021AD) && *proto != htons(ETH_P_QINQ1))
+                        break;
+
+                vh = skb_header_pointer(skb, *off, sizeof(_vh), &_vh);
+                if (vh == NULL)
+                        return false;
+
+                __pfq_dissect_vid(d, ntohs(vh->h_vlan_TCI) & VLAN_VID_MASK);
+
+                *proto = vh->h_vlan_encapsulated_proto;
+                *off  += VLAN_HLEN;
+        }
+
+        if (*proto == htons(ETH_P_MPLS_UC) || *proto == htons(ETH_P_MPLS_MC))
+        {
+                u8 _ver;
+                const u8 *ver;
+
+                for(n = 0; n < PFQ_MAX_MPLS; n++)
+                {
+                        __be32 _lse;
+                        const __be32 *lse = skb_header_pointer(skb, *off, sizeof(_lse), &_lse);
+                        u32 entry;
+
+                        if (lse == NULL)
+                                return false;
+
+                        entry = ntohl(*lse);
+                        if (n == 0) {
+                                d->mpls   = PFQ_MPLS_LABEL(entry);
+                                d->flags |= dissect_mpls;
+                        }
+
+                        *off += 4;
+                        if (PFQ_MPLS_BOS(entry))
+                                break;
+                }
+
+                if (n == PFQ_MAX_MPLS)
+                        return false;
+
+                /* no payload type in mpls: guessed from the ip version */
+
+                ver = skb_header_pointer(skb, *off, 1, &_ver);
+                if (ver == NULL)
+                        return false;
+
+                switch(*ver >> 4)
+                {
+                case 4:  *proto = htons(ETH_P_IP);   break;
+                case 6:  *proto = htons(ETH_P_IPV6); break;
+                default: return false;
+                }
+        }
+
+        return true;
+}
+
+
+void
+__pfq_dissect_skb(struct sk_buff *skb, struct pfq_dissect *d)
+{
+        __be16 proto = eth_hdr(skb)->h_proto;
+        int off = skb->mac_len;
+
+        __pfq_dissect_init(d);
+
+        if (skb->vlan_tci & VLAN_TAG_PRESENT)
+                __pfq_dissect_vid(d, skb->vlan_tci & VLAN_VID_MASK);
+
+        if (!__pfq_dissect_l2(skb, d, &off, &proto))
+                return;
+
+        __pfq_dissect_l3(skb, d, off, proto);
+}
+
+
+/* tunnels: the payload is located without modifying the skb */
+
+#define PFQ_VXLAN_PORT          4789
+#define PFQ_GTPU_PORT           2152
+
+#define PFQ_GRE_CSUM            0x8000
+#define PFQ_GRE_ROUTING         0x4000
+#define PFQ_GRE_KEY             0x2000
+#define PFQ_GRE_SEQ             0x1000
+#define PFQ_GRE_VERSION         0x0007
+
+#define PFQ_GTP_MAX_EXTHDR      8
+
+
+/* inner ethernet frame (VXLAN, GRE/TEB): one vlan tag is skipped */
+
+static bool
+__pfq_tunnel_eth(struct sk_buff *skb, int off, int *inner, __be16 *proto)
+{
+        struct ethhdr _eth;
+        const struct ethhdr *eth = skb_header_pointer(skb, off, sizeof(_eth), &_eth);
+
+        if (eth == NULL)
+                return false;
+
+        *proto = eth->h_proto;
+        off += ETH_HLEN;
+
+        if (*proto == htons(ETH_P_8021Q)) {
+                struct vlan_hdr _vh;
+                const struct vlan_hdr *vh = skb_header_pointer(skb, off, sizeof(_vh), &_vh);
+                if (vh == NULL)
+                        return false;
+                *proto = vh->h_vlan_encapsulated_proto;
+                off += VLAN_HLEN;
+        }
+
+        *inner = off;
+        return true;
+}
+
+
+static int
+__pfq_tunnel_gre(struct sk_buff *skb, int off, int *inner, __be16 *proto)
+{
+        __be16 _gre[2];
+        const __be16 *gre = skb_header_pointer(skb, off, sizeof(_gre), _gre);
+        u16 flags;
+        int len = 4;
+
+        if (gre == NULL)
+                return tunnel_none;
+
+        flags = ntohs(gre[0]);
+        if (flags & (PFQ_GRE_VERSION | PFQ_GRE_ROUTING))
+                return tunnel_none;
+
+        if (flags & PFQ_GRE_CSUM)
+                len += 4;
+        if (flags & PFQ_GRE_KEY)
+                len += 4;
+        if (flags & PFQ_GRE_SEQ)
+                len += 4;
+
+        if (gre[1] == htons(ETH_P_TEB))
+                return __pfq_tunnel_eth(skb, off + len, inner, proto) ? tunnel_gre : tunnel_none;
+
+        *proto = gre[1];
+        *inner = off + len;
+        return tunnel_gre;
+}
+
+
+/* GTP-U (v1, G-PDU): the optional fields and the extension headers are skipped */
+
+static int
+__pfq_tunnel_gtp(struct sk_buff *skb, int off, int *inner, __be16 *proto)
+{
+        u8 _gtp[8], _b;
+        const u8 *gtp = skb_header_pointer(skb, off, sizeof(_gtp), _gtp), *b;
+        int len = 8, n;
+
+        if (gtp == NULL || (gtp[0] >> 5) != 1 || !(gtp[0] & 0x10) || gtp[1] != 0xff)
+                return tunnel_none;
+
+        if (gtp[0] & 0x07)
+        {
+                u8 next;
+
+                len += 4;
+                if ((b = skb_header_pointer(skb, off + len - 1, 1, &_b)) == NULL)
+                        return tunnel_none;
+
+                next = (gtp[0] & 0x04) ? *b : 0;
+
+                for(n = 0; next && n < PFQ_GTP_MAX_EXTHDR; n++)
+                {
+                        if ((b = skb_header_pointer(skb, off + len, 1, &_b)) == NULL || *b == 0)
+                                return tunnel_none;
+                        len += *b * 4;
+                        if ((b = skb_header_pointer(skb, off + len - 1, 1, &_b)) == NULL)
+                                return tunnel_none;
+                        next = *b;
+                }
+
+                if (next)
+                        return tunnel_none;
+        }
+
+        if ((b = skb_header_pointer(skb, off + len, 1, &_b)) == NULL)
+                return tunnel_none;
+
+        switch(*b >> 4)
+        {
+        case 4:  *proto = htons(ETH_P_IP);   break;
+        case 6:  *proto = htons(ETH_P_IPV6); break;
+        default: return tunnel_none;
+        }
+
+        *inner = off + len;
+        return tunnel_gtp;
+}
+
+
+/* type of the tunnel carried by the dissected headers: on success, inner and
+ * proto are the offset and the ethertype of the encapsulated network header.
+ */
+
+static int
+__pfq_tunnel_payload(struct sk_buff *skb, const struct pfq_dissect *d, int *inner, __be16 *proto)
+{
+        if (!(d->flags & (dissect_ipv4|dissect_ipv6)) || (d->flags & dissect_frag))
+                return tunnel_none;
+
+        switch(d->l4_proto)
+        {
+        case IPPROTO_IPIP:
+                *inner = d->l4_off;
+                *proto = htons(ETH_P_IP);
+                return tunnel_ipip;
+
+        case IPPROTO_IPV6:
+                *inner = d->l4_off;
+                *proto = htons(ETH_P_IPV6);
+                return tunnel_ipip;
+
+        case IPPROTO_GRE:
+                return __pfq_tunnel_gre(skb, d->l4_off, inner, proto);
+
+        case IPPROTO_UDP:
+                if (!(d->flags & dissect_l4))
+                        return tunnel_none;
+
+                if (d->dport == htons(PFQ_VXLAN_PORT)) {
+                        u8 _flags;
+                        const u8 *flags = skb_header_pointer(skb, d->l4_off + 8, 1, &_flags);
+                        if (flags == NULL || !(*flags & 0x08))
+                                return tunnel_none;
+                        return __pfq_tunnel_eth(skb, d->l4_off + 16, inner, proto) ? tunnel_vxlan : tunnel_none;
+                }
+
+                if (d->dport == htons(PFQ_GTPU_PORT))
+                        return __pfq_tunnel_gtp(skb, d->l4_off + 8, inner, proto);
+
+                return tunnel_none;
+
+        default:
+                return tunnel_none;
+        }
+}
+
+
+int
+__pfq_tunnel_type(struct sk_buff *skb, const struct pfq_dissect *d)
+{
+        __be16 proto;
+        int inner;
+
+        return __pfq_tunnel_payload(skb, d, &inner, &proto);
+}
+
+
+/* decapsulate up to depth tunnels: inner holds the dissection of the
+ * innermost IP headers reached. Returns the number of tunnels crossed
+ * (inner is untouched if 0).
+ */
+
+int
+__pfq_dissect_tunnel(struct sk_buff *skb, const struct pfq_dissect *outer, struct pfq_dissect *inner, int depth)
+{
+        const struct pfq_dissect *d = outer;
+        int n;
+
+        depth = clamp_t(int, depth, 1, Q_TUNNEL_MAX_DEPTH);
+
+        for(n = 0; n < depth; n++)
+        {
+                struct pfq_dissect tmp;
+                __be16 proto;
+                int off;
+
+                if (__pfq_tunnel_payload(skb, d, &off, &proto) == tunnel_none)
+                        break;
+
+                __pfq_dissect_init(&tmp);
+                __pfq_dissect_l3(skb, &tmp, off, proto);
+
+                if (!(tmp.flags & (dissect_ipv4|dissect_ipv6)))
+                        break;
+
+                *inner = tmp;
+                d = inner;
+        }
+
+        return n;
+}
+
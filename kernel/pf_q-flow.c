@@ -0,0 +1,158 @@
+/***************************************************************
+ *
+ * (C) 2011-13 Nicola Bonelli <nicola.bonelli@cnit.it>
+ *             Andrea Di Pietro <andrea.dipietro@for.unipi.it>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ ****************************************************************/
+
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/percpu.h>
+
+#include <pf_q-flow.h>
+
+
+struct pfq_flow_table __percpu * pfq_flows;
+
+
+int
+pfq_flow_init(void)
+{
+        pfq_flows = alloc_percpu(struct pfq_flow_table);
+        return pfq_flows ? 0 : -ENOMEM;
+}
+
+
+void
+pfq_flow_free(void)
+{
+        free_percpu(pfq_flows);
+        pfq_flows = NULL;
+}
+
+
+/* lookup the flow of key: on a miss returns the slot to replace (an empty
+ * or expired one, otherwise the least recently used of the set).
+ */
+
+struct pfq_flow *
+pfq_flow_get(struct pfq_flow_table *table, u32 key, u32 now, bool *found)
+{
+        struct pfq_flow *set = table->flow[(key ^ (key >> 12)) & (PFQ_FLOW_SETS - 1)];
+        struct pfq_flow *victim = set;
+        int n;
+
+        for(n = 0; n < PFQ_FLOW_WAYS; n++)
+        {
+                struct pfq_flow *f = &set[n];
+
+                if (f->key == key && !pfq_flow_expired(f, now)) {
+                        f->last = now;
+                        *found = true;
+                        return f;
+                }
+
+                if (victim->key && (f->key == 0 || pfq_flow_expired(f, now) ||
+                                    (!pfq_flow_expired(victim, now) && now - f->last > now - victim->last)))
+                        victim = f;
+        }
+
+        *found = false;
+        return victim;
+}
+
+
+void
+pfq_flow_set(struct pfq_flow_table *table, struct pfq_flow *f, u32 key, int id, u32 now)
+{
+        if (f->key != key || pfq_flow_expired(f, now))
+        {
+                if (f->key) {
+                        if (pfq_flow_expired(f, now))
+                                table->expire++;
+                        else
+                                table->evict++;
+                }
+
+                table->insert++;
+
+                f->key     = key;
+                f->window  = now;
+                f->packets = 0;
+                f->flags   = 0;
+        }
+
+        f->id   = id;
+        f->last = now;
+}
+
+
+/* account a packet of the flow: a flow exceeding pps packets in a window
+ * becomes an elephant, and stays so until a window ends below the threshold.
+ */
+
+bool
+pfq_flow_elephant(struct pfq_flow_table *table, struct pfq_flow *f, u32 now, unsigned int pps)
+{
+        if (now - f->window >= PFQ_FLOW_WINDOW) {
+                if (f->packets <= pps)
+                        f->flags &= ~(PFQ_FLOW_ELEPHANT|PFQ_FLOW_REHOMED);
+                f->window  = now;
+                f->packets = 0;
+        }
+
+        if (++f->packets > pps && !(f->flags & PFQ_FLOW_ELEPHANT)) {
+                f->flags |= PFQ_FLOW_ELEPHANT;
+                table->elephant++;
+        }
+
+        return f->flags & PFQ_FLOW_ELEPHANT;
+}
+
+
+/* flow counters of all the cpus (active flows are counted on read) */
+
+void
+pfq_flow_get_stats(struct pfq_flow_stats *stats)
+{
+        u32 now = (u32)jiffies;
+        int cpu, s, w;
+
+        memset(stats, 0, sizeof(*stats));
+
+        for_each_possible_cpu(cpu)
+        {
+                struct pfq_flow_table *table = per_cpu_ptr(pfq_flows, cpu);
+
+                for(s = 0; s < PFQ_FLOW_SETS; s++)
+                        for(w = 0; w < PFQ_FLOW_WAYS; w++)
+                        {
+                                struct pfq_flow *f = &table->flow[s][w];
+                                if (f->key && !pfq_flow_expired(f, now))
+                                        stats->flows++;
+                        }
+
+                stats->insert   += table->insert;
+                stats->evict    += table->evict;
+                stats->expire   += table->expire;
+                stats->elephant += table->elephant;
+        }
+}
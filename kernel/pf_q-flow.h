@@ -0,0 +1,96 @@
+/***************************************************************
+ *
+ * (C) 2011-13 Nicola Bonelli <nicola.bonelli@cnit.it>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ ****************************************************************/
+
+
+#ifndef _PF_Q_FLOW_H_
+#define _PF_Q_FLOW_H_
+
+#include <linux/kernel.h>
+#include <linux/percpu.h>
+#include <linux/pf_q.h>
+
+
+/* per-cpu flow table: set-associative, bounded and accessed only by the
+ * owner cpu in softirq context (no locks). A flow is identified by the
+ * group and the 24-bit hash of its steering result. Idle flows expire
+ * after PFQ_FLOW_IDLE, full sets evict the least recently used flow.
+ */
+
+#define PFQ_FLOW_SETS           256                     /* power of 2 */
+#define PFQ_FLOW_WAYS           4
+#define PFQ_FLOW_IDLE           (HZ)                    /* idle flows expire */
+#define PFQ_FLOW_WINDOW         (HZ)                    /* rate window of elephant detection */
+
+#define PFQ_FLOW_ELEPHANT       0x1
+#define PFQ_FLOW_REHOMED        0x2
+
+
+struct pfq_flow
+{
+        u32     key;                    /* gid << 24 | hash (0: empty) */
+        u32     last;                   /* jiffies of the last packet */
+        u32     window;                 /* start of the current rate window */
+        u32     packets;                /* packets in the current window */
+        s16     id;                     /* socket of the flow */
+        u16     flags;
+};
+
+
+struct pfq_flow_table
+{
+        struct pfq_flow flow[PFQ_FLOW_SETS][PFQ_FLOW_WAYS];
+
+        unsigned long   insert;
+        unsigned long   evict;
+        unsigned long   expire;
+        unsigned long   elephant;
+};
+
+
+extern struct pfq_flow_table __percpu * pfq_flows;
+
+int  pfq_flow_init(void);
+void pfq_flow_free(void);
+
+struct pfq_flow * pfq_flow_get(struct pfq_flow_table *table, u32 key, u32 now, bool *found);
+void pfq_flow_set(struct pfq_flow_table *table, struct pfq_flow *f, u32 key, int id, u32 now);
+bool pfq_flow_elephant(struct pfq_flow_table *table, struct pfq_flow *f, u32 now, unsigned int pps);
+
+void pfq_flow_get_stats(struct pfq_flow_stats *stats);
+
+
+static inline
+u32 pfq_flow_key(int gid, unsigned int hash)
+{
+        return (u32)gid << 24 | (hash & 0xffffff);
+}
+
+
+static inline
+bool pfq_flow_expired(const struct pfq_flow *f, u32 now)
+{
+        return now - f->last >= PFQ_FLOW_IDLE;
+}
+
+
+#endif /* _PF_Q_FLOW_H_ */
@@ -39,157 +39,296 @@
  *      STEERING[n]     F(p) S(n)/D     SKIP(steer[n])  S(n)        DROP            hash(p)/D
  *
  *      STEAL           -               -               -           -               -
+ *
+ *      Steering functions, strict filters, legacy and sink end the computation
+ *      of the group (stop), the others pass their result to the next function.
  */
 
 
 ret_t
 steering_mac(struct sk_buff *skb, ret_t ret)
 {
+        struct pfq_steer_context c;
         uint16_t * a;
 
         if (is_skip(ret) || is_drop(ret))
-                return pfq_call(get_next_function(skb), skb, ret);
+                return ret;
 
+        c = steer_context(skb);
         a = (uint16_t *)eth_hdr(skb);
 
-	return steering(Q_CLASS_DEFAULT, a[0] ^ a[1] ^ a[2] ^ a[3] ^ a[4] ^ a[5] );
+        if (c.hash == Q_HASH_LEGACY)
+	        return stop(steering(Q_CLASS_DEFAULT, a[0] ^ a[1] ^ a[2] ^ a[3] ^ a[4] ^ a[5] ));
+
+	return stop(steering(Q_CLASS_DEFAULT, pfq_hash_2words(c.hash, ((uint32_t)a[0] << 16 | a[1]) ^ a[2],
+                                                                      ((uint32_t)a[3] << 16 | a[4]) ^ a[5], c.seed)));
 }
 
 
 ret_t
 steering_vlan_id(struct sk_buff *skb, ret_t ret)
 {
-        sk_function_t fun = get_next_function(skb);
+        struct pfq_steer_context c;
 
         if (is_skip(ret) || is_drop(ret))
-                return pfq_call(get_next_function(skb), skb, ret);
+                return ret;
+
+        c = steer_context(skb);
 
         if (skb->vlan_tci & VLAN_VID_MASK)
- 	        return steering(Q_CLASS_DEFAULT, skb->vlan_tci & VLAN_VID_MASK);
+ 	        return stop(steering(Q_CLASS_DEFAULT, pfq_hash_2words(c.hash, skb->vlan_tci & VLAN_VID_MASK, 0, c.seed)));
         else
-                return pfq_call(fun, skb, drop());
+                return drop();
 }
 
 
+/* vlan stacks (accelerated and in-band tags): outer vid, or the pair of
+ * outer and innermost vids (inner vids are scoped by the outer one)
+ */
+
 ret_t
-steering_ipv4(struct sk_buff *skb, ret_t ret)
+steering_vlan_outer(struct sk_buff *skb, ret_t ret)
+{
+        const struct pfq_dissect *d;
+        struct pfq_steer_context c;
+
+        if (is_skip(ret) || is_drop(ret))
+                return ret;
+
+        d = pfq_skb_dissect(skb);
+        if (has_vlan(d) && d->vlan[0]) {
+                c = steer_context(skb);
+                return stop(steering(Q_CLASS_DEFAULT, pfq_hash_2words(c.hash, d->vlan[0], 0, c.seed)));
+        }
+
+        return drop();
+}
+
+
+ret_t
+steering_vlan_inner(struct sk_buff *skb, ret_t ret)
 {
-        sk_function_t fun = get_next_function(skb);
+        const struct pfq_dissect *d;
+        struct pfq_steer_context c;
 
         if (is_skip(ret) || is_drop(ret))
-                return pfq_call(get_next_function(skb), skb, ret);
+                return ret;
 
-	if (eth_hdr(skb)->h_proto == __constant_htons(ETH_P_IP))
-	{
-		struct iphdr _iph;
-    		const struct iphdr *ip;
+        d = pfq_skb_dissect(skb);
+        if (has_vlan(d) && d->vlan[1]) {
+                c = steer_context(skb);
+                return stop(steering(Q_CLASS_DEFAULT, pfq_hash_2words(c.hash, (uint32_t)d->vlan[0] << 12 | d->vlan[1], 0, c.seed)));
+        }
+
+        return drop();
+}
+
+
+ret_t
+steering_mpls(struct sk_buff *skb, ret_t ret)
+{
+        const struct pfq_dissect *d;
+        struct pfq_steer_context c;
+
+        if (is_skip(ret) || is_drop(ret))
+                return ret;
+
+        d = pfq_skb_dissect(skb);
+        if (has_mpls(d)) {
+                c = steer_context(skb);
+                return stop(steering(Q_CLASS_DEFAULT, pfq_hash_2words(c.hash, d->mpls, 0, c.seed)));
+        }
+
+        return drop();
+}
+
+
+ret_t
+steering_ipv4(struct sk_buff *skb, ret_t ret)
+{
+        const struct pfq_dissect *d;
+        struct pfq_steer_context c;
 
-		ip = skb_header_pointer(skb, skb->mac_len, sizeof(_iph), &_iph);
- 		if (ip == NULL)
-                        return pfq_call(fun, skb, drop());
+        if (is_skip(ret) || is_drop(ret))
+                return ret;
 
-        	return steering(Q_CLASS_DEFAULT, ip->saddr ^ ip->daddr);
-	}
+        d = pfq_skb_dissect(skb);
+        if (has_ipv4(d)) {
+                c = steer_context(skb);
+                return stop(steering(Q_CLASS_DEFAULT, pfq_hash_2words(c.hash, d->addr.ip4.saddr, d->addr.ip4.daddr, c.seed)));
+        }
 
-        return pfq_call(fun, skb, drop());
+        return drop();
 }
 
 
 ret_t
 steering_flow(struct sk_buff *skb, ret_t ret)
 {
-        sk_function_t fun = get_next_function(skb);
+        const struct pfq_dissect *d;
+        struct pfq_steer_context c;
 
         if (is_skip(ret) || is_drop(ret))
-                return pfq_call(get_next_function(skb), skb, ret);
+                return ret;
 
-	if (eth_hdr(skb)->h_proto == __constant_htons(ETH_P_IP))
-	{
-		struct iphdr _iph;
-    		const struct iphdr *ip;
+        d = pfq_skb_dissect(skb);
+        if (!has_ipv4(d))
+                return drop();
 
-		struct udphdr _udp;
-		const struct udphdr *udp;
+        if (d->l4_proto != IPPROTO_UDP &&
+            d->l4_proto != IPPROTO_TCP)
+                return drop();
 
-		ip = skb_header_pointer(skb, skb->mac_len, sizeof(_iph), &_iph);
- 		if (ip == NULL)
-                        return pfq_call(fun, skb, drop());
+        c = steer_context(skb);
 
-		if (ip->protocol != IPPROTO_UDP &&
-		    ip->protocol != IPPROTO_TCP)
-                        return pfq_call(fun, skb, drop());
+        /* fragments of a datagram (ports in the first one only) stay together */
 
-		udp = skb_header_pointer(skb, skb->mac_len + (ip->ihl<<2), sizeof(_udp), &_udp);
-		if (udp == NULL)
-			return drop();  /* broken */
+        if (has_frag(d))
+                return stop(steering(Q_CLASS_DEFAULT, pfq_hash_flow(c.hash, d->addr.ip4.saddr, d->addr.ip4.daddr, d->frag_id, 0, c.seed)));
 
-        	return steering(Q_CLASS_DEFAULT, ip->saddr ^ ip->daddr ^ udp->source ^ udp->dest);
-	}
+        if (!has_flow(d))
+                return stop(drop());  /* broken */
 
-        return pfq_call(fun, skb, drop());
+        return stop(steering(Q_CLASS_DEFAULT, pfq_hash_flow(c.hash, d->addr.ip4.saddr, d->addr.ip4.daddr, d->sport, d->dport, c.seed)));
 }
 
 
 ret_t
 steering_ipv6(struct sk_buff *skb, ret_t ret)
 {
-        sk_function_t fun = get_next_function(skb);
+        const struct pfq_dissect *d;
+        struct pfq_steer_context c;
+
+        if (is_skip(ret) || is_drop(ret))
+                return ret;
+
+        d = pfq_skb_dissect(skb);
+        if (has_ipv6(d)) {
+                c = steer_context(skb);
+		return stop(steering(Q_CLASS_DEFAULT, pfq_hash_ip6(c.hash, d->addr.ip6.saddr.in6_u.u6_addr32,
+                                                                         d->addr.ip6.daddr.in6_u.u6_addr32, c.seed)));
+        }
+
+        return drop();
+}
+
+
+/* ipv6 5-tuple: addresses and ports past the extension headers */
+
+ret_t
+steering_flow6(struct sk_buff *skb, ret_t ret)
+{
+        const struct pfq_dissect *d;
+        struct pfq_steer_context c;
+
+        if (is_skip(ret) || is_drop(ret))
+                return ret;
+
+        d = pfq_skb_dissect(skb);
+        if (!has_ipv6(d))
+                return drop();
+
+        if (d->l4_proto != IPPROTO_UDP &&
+            d->l4_proto != IPPROTO_TCP)
+                return drop();
+
+        c = steer_context(skb);
+
+        if (has_frag(d))
+                return stop(steering(Q_CLASS_DEFAULT, pfq_hash_flow6(c.hash, d->addr.ip6.saddr.in6_u.u6_addr32, d->addr.ip6.daddr.in6_u.u6_addr32,
+                                                                             d->frag_id >> 16, d->frag_id & 0xffff, c.seed)));
+
+        if (!has_flow(d))
+                return stop(drop());  /* broken */
+
+        return stop(steering(Q_CLASS_DEFAULT, pfq_hash_flow6(c.hash, d->addr.ip6.saddr.in6_u.u6_addr32,
+                                                                     d->addr.ip6.daddr.in6_u.u6_addr32, d->sport, d->dport, c.seed)));
+}
+
+
+/* tunnels: steering on the inner 5-tuple (or on the inner addresses, for
+ * packets without ports and for fragments)
+ */
+
+ret_t
+steering_tunnel(struct sk_buff *skb, ret_t ret)
+{
+        const struct pfq_dissect *d;
+        struct pfq_dissect inner;
+        struct pfq_tunnel_context c;
 
         if (is_skip(ret) || is_drop(ret))
-                return pfq_call(get_next_function(skb), skb, ret);
+                return ret;
 
-	if (eth_hdr(skb)->h_proto == __constant_htons(ETH_P_IPV6))
-	{
-		struct ipv6hdr _ip6h;
-    		const struct ipv6hdr *ip6;
+        d = pfq_skb_dissect(skb);
+        c = tunnel_context(skb);
 
-		ip6 = skb_header_pointer(skb, skb->mac_len, sizeof(_ip6h), &_ip6h);
- 		if (ip6 == NULL)
-                        return pfq_call(fun, skb, drop());
+        if (__pfq_dissect_tunnel(skb, d, &inner, c.depth) == 0)
+                return drop();
+
+        if (has_ipv4(&inner)) {
+                if (has_flow(&inner) && !has_frag(&inner))
+                        return stop(steering(Q_CLASS_DEFAULT, pfq_hash_flow(c.hash, inner.addr.ip4.saddr, inner.addr.ip4.daddr,
+                                                                                    inner.sport, inner.dport, c.seed)));
+                return stop(steering(Q_CLASS_DEFAULT, pfq_hash_2words(c.hash, inner.addr.ip4.saddr, inner.addr.ip4.daddr, c.seed)));
+        }
 
-		return steering(Q_CLASS_DEFAULT,
-			ip6->saddr.in6_u.u6_addr32[0] ^
-			ip6->saddr.in6_u.u6_addr32[1] ^
-			ip6->saddr.in6_u.u6_addr32[2] ^
-			ip6->saddr.in6_u.u6_addr32[3] ^
-			ip6->daddr.in6_u.u6_addr32[0] ^
-			ip6->daddr.in6_u.u6_addr32[1] ^
-			ip6->daddr.in6_u.u6_addr32[2] ^
-			ip6->daddr.in6_u.u6_addr32[3] );
-	}
+        if (has_flow(&inner) && !has_frag(&inner))
+                return stop(steering(Q_CLASS_DEFAULT, pfq_hash_flow6(c.hash, inner.addr.ip6.saddr.in6_u.u6_addr32,
+                                                                             inner.addr.ip6.daddr.in6_u.u6_addr32,
+                                                                             inner.sport, inner.dport, c.seed)));
 
-        return pfq_call(fun, skb, drop());
+        return stop(steering(Q_CLASS_DEFAULT, pfq_hash_ip6(c.hash, inner.addr.ip6.saddr.in6_u.u6_addr32,
+                                                                   inner.addr.ip6.daddr.in6_u.u6_addr32, c.seed)));
 }
 
 
 ret_t
 fun_legacy(struct sk_buff *skb, ret_t ret)
 {
-        return to_kernel(drop());
+        return stop(to_kernel(drop()));
 }
 
 
+/* load-aware steering: new flows (or any packet for balance) go to the least loaded socket */
+
 ret_t
-fun_clone(struct sk_buff *skb, ret_t ret)
+fun_balance(struct sk_buff *skb, ret_t ret)
+{
+        if (is_skip(ret) || is_drop(ret))
+                return ret;
+
+        return balance(Q_CLASS_DEFAULT, 0);
+}
+
+
+ret_t
+balance_flow(struct sk_buff *skb, ret_t ret)
 {
-        sk_function_t fun = get_next_function(skb);
+        ret = steering_flow(skb, ret);
+        if (is_steering(ret))
+                ret.type |= action_balance;
+        return ret;
+}
+
 
+ret_t
+fun_clone(struct sk_buff *skb, ret_t ret)
+{
         if (is_skip(ret) || is_drop(ret))
-                return pfq_call(get_next_function(skb), skb, ret);
+                return ret;
 
-        return pfq_call(fun, skb, broadcast(Q_CLASS_DEFAULT));
+        return broadcast(Q_CLASS_DEFAULT);
 }
 
 
 ret_t
 fun_broadcast(struct sk_buff *skb, ret_t ret)
 {
-        sk_function_t fun = get_next_function(skb);
-
         if (is_skip(ret) || is_drop(ret))
-                return pfq_call(get_next_function(skb), skb, ret);
+                return ret;
 
-        return pfq_call(fun, skb, broadcast(Q_CLASS_ANY));
+        return broadcast(Q_CLASS_ANY);
 }
 
 
@@ -207,9 +346,7 @@ fun_sink(struct sk_buff *skb, ret_t ret)
 ret_t
 fun_id(struct sk_buff *skb, ret_t ret)
 {
-        sk_function_t fun = get_next_function(skb);
-
-        return pfq_call(fun, skb, ret);
+        return ret;
 }
 
 /* filters */
@@ -218,175 +355,191 @@ ret_t
 strict_vlan(struct sk_buff *skb, ret_t ret)
 {
         if (is_skip(ret))
-                return pfq_call(get_next_function(skb), skb, ret);
+                return ret;
         if (is_drop(ret))
-                return drop();
+                return stop(drop());
 
         if ((skb->vlan_tci & VLAN_VID_MASK) == 0)
-                return drop();
+                return stop(drop());
         else
-                return pfq_call(get_next_function(skb), skb, ret);
+                return ret;
 }
 
 
 ret_t
 strict_ipv4(struct sk_buff *skb, ret_t ret)
 {
+        const struct pfq_dissect *d;
+
         if (is_skip(ret))
-                return pfq_call(get_next_function(skb), skb, ret);
+                return ret;
         if (is_drop(ret))
-                return drop();
+                return stop(drop());
 
-	if (eth_hdr(skb)->h_proto == __constant_htons(ETH_P_IP))
-	{
-		struct iphdr _iph;
-    		const struct iphdr *ip;
+        d = pfq_skb_dissect(skb);
+        if (has_ipv4(d))
+                return ret;
 
-		ip = skb_header_pointer(skb, skb->mac_len, sizeof(_iph), &_iph);
- 		if (ip)
-                {
-                        return pfq_call(get_next_function(skb), skb, ret);
-                }
-        }
-
-        return drop();
+        return stop(drop());
 }
 
 
 ret_t
 strict_udp(struct sk_buff *skb, ret_t ret)
 {
+        const struct pfq_dissect *d;
+
         if (is_skip(ret))
-                return pfq_call(get_next_function(skb), skb, ret);
+                return ret;
         if (is_drop(ret))
-                return drop();
+                return stop(drop());
 
-	if (eth_hdr(skb)->h_proto == __constant_htons(ETH_P_IP))
-	{
-		struct iphdr _iph;
-    		const struct iphdr *ip;
+        d = pfq_skb_dissect(skb);
+        if (has_ipv4(d) && has_l4(d, IPPROTO_UDP))
+                return ret;
 
-		struct udphdr _udp;
-		const struct udphdr *udp;
+        return stop(drop());
+}
 
-		ip = skb_header_pointer(skb, skb->mac_len, sizeof(_iph), &_iph);
- 		if (ip == NULL)
- 			return drop();
 
-		if (ip->protocol != IPPROTO_UDP)
-			return drop();
+ret_t
+strict_tcp(struct sk_buff *skb, ret_t ret)
+{
+        const struct pfq_dissect *d;
 
-		udp = skb_header_pointer(skb, skb->mac_len + (ip->ihl<<2), sizeof(_udp), &_udp);
-		if (udp)
-		{
-                        return pfq_call(get_next_function(skb), skb, ret);
-                }
-	}
+        if (is_skip(ret))
+                return ret;
+        if (is_drop(ret))
+                return stop(drop());
 
-	return drop();
+        d = pfq_skb_dissect(skb);
+        if (has_ipv4(d) && has_l4(d, IPPROTO_TCP))
+                return ret;
+
+        return stop(drop());
 }
 
 
 ret_t
-strict_tcp(struct sk_buff *skb, ret_t ret)
+strict_icmp(struct sk_buff *skb, ret_t ret)
 {
+        const struct pfq_dissect *d;
+
         if (is_skip(ret))
-                return pfq_call(get_next_function(skb), skb, ret);
+                return ret;
         if (is_drop(ret))
-                return drop();
+                return stop(drop());
 
-	if (eth_hdr(skb)->h_proto == __constant_htons(ETH_P_IP))
-	{
-		struct iphdr _iph;
-    		const struct iphdr *ip;
+        d = pfq_skb_dissect(skb);
+        if (has_ipv4(d) && has_l4(d, IPPROTO_ICMP))
+                return ret;
 
-		struct tcphdr _tcp;
-		const struct tcphdr *tcp;
+        return stop(drop());
+}
 
-		ip = skb_header_pointer(skb, skb->mac_len, sizeof(_iph), &_iph);
- 		if (ip == NULL)
- 			return drop();
 
-		if (ip->protocol != IPPROTO_TCP)
-			return drop();
+ret_t
+strict_flow(struct sk_buff *skb, ret_t ret)
+{
+        const struct pfq_dissect *d;
+
+        if (is_skip(ret))
+                return ret;
+        if (is_drop(ret))
+                return stop(drop());
 
-		tcp = skb_header_pointer(skb, skb->mac_len + (ip->ihl<<2), sizeof(_tcp), &_tcp);
-		if (tcp)
-                {
-                        return pfq_call(get_next_function(skb), skb, ret);
-                }
-	}
+        d = pfq_skb_dissect(skb);
+        if (has_ipv4(d) && is_flow(d))
+                return ret;
 
-	return drop();
+        return stop(drop());
 }
 
 
 ret_t
-strict_icmp(struct sk_buff *skb, ret_t ret)
+strict_ipv6(struct sk_buff *skb, ret_t ret)
 {
+        const struct pfq_dissect *d;
+
         if (is_skip(ret))
-                return pfq_call(get_next_function(skb), skb, ret);
+                return ret;
         if (is_drop(ret))
-                return drop();
+                return stop(drop());
+
+        d = pfq_skb_dissect(skb);
+        if (has_ipv6(d))
+                return ret;
 
-	if (eth_hdr(skb)->h_proto == __constant_htons(ETH_P_IP))
-	{
-		struct iphdr _iph;
-    		const struct iphdr *ip;
+        return stop(drop());
+}
 
-		struct icmphdr _icmp;
-		const struct icmphdr *icmp;
 
-		ip = skb_header_pointer(skb, skb->mac_len, sizeof(_iph), &_iph);
- 		if (ip == NULL)
- 			return drop();
+ret_t
+strict_udp6(struct sk_buff *skb, ret_t ret)
+{
+        const struct pfq_dissect *d;
 
-		if (ip->protocol != IPPROTO_ICMP)
-			return drop();
+        if (is_skip(ret))
+                return ret;
+        if (is_drop(ret))
+                return stop(drop());
 
-		icmp = skb_header_pointer(skb, skb->mac_len + (ip->ihl<<2), sizeof(_icmp), &_icmp);
-		if (icmp)
-		{
-                        return pfq_call(get_next_function(skb), skb, ret);
-                }
-	}
+        d = pfq_skb_dissect(skb);
+        if (has_ipv6(d) && has_l4(d, IPPROTO_UDP))
+                return ret;
 
-	return drop();
+        return stop(drop());
 }
 
 
 ret_t
-strict_flow(struct sk_buff *skb, ret_t ret)
+strict_tcp6(struct sk_buff *skb, ret_t ret)
 {
+        const struct pfq_dissect *d;
+
         if (is_skip(ret))
-                return pfq_call(get_next_function(skb), skb, ret);
+                return ret;
         if (is_drop(ret))
-                return drop();
+                return stop(drop());
 
-	if (eth_hdr(skb)->h_proto == __constant_htons(ETH_P_IP))
-	{
-		struct iphdr _iph;
-    		const struct iphdr *ip;
+        d = pfq_skb_dissect(skb);
+        if (has_ipv6(d) && has_l4(d, IPPROTO_TCP))
+                return ret;
+
+        return stop(drop());
+}
 
-		struct udphdr _udp;
-		const struct udphdr *udp;
 
-		ip = skb_header_pointer(skb, skb->mac_len, sizeof(_iph), &_iph);
- 		if (ip == NULL)
- 			return drop();
+ret_t
+strict_flow6(struct sk_buff *skb, ret_t ret)
+{
+        const struct pfq_dissect *d;
 
-		if (ip->protocol != IPPROTO_UDP &&
-		    ip->protocol != IPPROTO_TCP)
-			return drop();
+        if (is_skip(ret))
+                return ret;
+        if (is_drop(ret))
+                return stop(drop());
 
-		udp = skb_header_pointer(skb, skb->mac_len + (ip->ihl<<2), sizeof(_udp), &_udp);
-		if (udp)
-		{
-                        return pfq_call(get_next_function(skb), skb, ret);
-                }
-	}
+        d = pfq_skb_dissect(skb);
+        if (has_ipv6(d) && is_flow(d))
+                return ret;
 
-	return drop();
+        return stop(drop());
+}
+
+
+ret_t
+strict_tunnel(struct sk_buff *skb, ret_t ret)
+{
+        if (is_skip(ret))
+                return ret;
+        if (is_drop(ret))
+                return stop(drop());
+
+        if (__pfq_tunnel_type(skb, pfq_skb_dissect(skb)) != tunnel_none)
+                return ret;
+
+        return stop(drop());
 }
 
 
@@ -394,194 +547,252 @@ ret_t
 filter_vlan(struct sk_buff *skb, ret_t ret)
 {
         if (is_skip(ret) || is_drop(ret))
-                return pfq_call(get_next_function(skb), skb, ret);
+                return ret;
 
         if ((skb->vlan_tci & VLAN_VID_MASK) == 0)
-                return pfq_call(get_next_function(skb), skb, drop());
+                return drop();
         else
-                return pfq_call(get_next_function(skb), skb, ret);
+                return ret;
 }
 
 
 ret_t
 filter_ipv4(struct sk_buff *skb, ret_t ret)
 {
-        sk_function_t fun;
+        const struct pfq_dissect *d;
 
         if (is_skip(ret) || is_drop(ret))
-                return pfq_call(get_next_function(skb), skb, ret);
+                return ret;
 
-        fun = get_next_function(skb);
+        d = pfq_skb_dissect(skb);
+        if (has_ipv4(d))
+                return ret;
 
-	if (eth_hdr(skb)->h_proto == __constant_htons(ETH_P_IP))
-	{
-		struct iphdr _iph;
-    		const struct iphdr *ip;
+	return drop();
+}
 
-		ip = skb_header_pointer(skb, skb->mac_len, sizeof(_iph), &_iph);
- 		if (ip)
-                {
-                        return pfq_call(fun, skb, ret);
-                }
-        }
 
-	return pfq_call(fun, skb, drop());
+ret_t
+filter_udp(struct sk_buff *skb, ret_t ret)
+{
+        const struct pfq_dissect *d;
+
+        if (is_skip(ret) || is_drop(ret))
+                return ret;
+
+        d = pfq_skb_dissect(skb);
+        if (has_ipv4(d) && has_l4(d, IPPROTO_UDP))
+                return ret;
+
+	return drop();
 }
 
 
 ret_t
-filter_udp(struct sk_buff *skb, ret_t ret)
+filter_tcp(struct sk_buff *skb, ret_t ret)
 {
-        sk_function_t fun;
+        const struct pfq_dissect *d;
 
         if (is_skip(ret) || is_drop(ret))
-                return pfq_call(get_next_function(skb), skb, ret);
+                return ret;
 
-        fun = get_next_function(skb);
+        d = pfq_skb_dissect(skb);
+        if (has_ipv4(d) && has_l4(d, IPPROTO_TCP))
+                return ret;
 
-	if (eth_hdr(skb)->h_proto == __constant_htons(ETH_P_IP))
-	{
-		struct iphdr _iph;
-    		const struct iphdr *ip;
+	return drop();
+}
 
-		struct udphdr _udp;
-		const struct udphdr *udp;
 
-		ip = skb_header_pointer(skb, skb->mac_len, sizeof(_iph), &_iph);
- 		if (ip == NULL)
-	                return pfq_call(fun, skb, drop());
+ret_t
+filter_icmp(struct sk_buff *skb, ret_t ret)
+{
+        const struct pfq_dissect *d;
 
-		if (ip->protocol != IPPROTO_UDP)
-	                return pfq_call(fun, skb, drop());
+        if (is_skip(ret) || is_drop(ret))
+                return ret;
 
-		udp = skb_header_pointer(skb, skb->mac_len + (ip->ihl<<2), sizeof(_udp), &_udp);
-		if (udp)
-		{
-                        return pfq_call(fun, skb, ret);
-                }
-	}
+        d = pfq_skb_dissect(skb);
+        if (has_ipv4(d) && has_l4(d, IPPROTO_ICMP))
+                return ret;
 
-	return pfq_call(fun, skb, drop());
+	return drop();
 }
 
 
 ret_t
-filter_tcp(struct sk_buff *skb, ret_t ret)
+filter_flow(struct sk_buff *skb, ret_t ret)
 {
-        sk_function_t fun;
+        const struct pfq_dissect *d;
 
         if (is_skip(ret) || is_drop(ret))
-                return pfq_call(get_next_function(skb), skb, ret);
+                return ret;
 
-        fun = get_next_function(skb);
+        d = pfq_skb_dissect(skb);
+        if (has_ipv4(d) && is_flow(d))
+                return ret;
 
-	if (eth_hdr(skb)->h_proto == __constant_htons(ETH_P_IP))
-	{
-		struct iphdr _iph;
-    		const struct iphdr *ip;
+	return drop();
+}
 
-		struct tcphdr _tcp;
-		const struct tcphdr *tcp;
 
-		ip = skb_header_pointer(skb, skb->mac_len, sizeof(_iph), &_iph);
- 		if (ip == NULL)
-	                return pfq_call(fun, skb, drop());
+ret_t
+filter_ipv6(struct sk_buff *skb, ret_t ret)
+{
+        const struct pfq_dissect *d;
 
-		if (ip->protocol != IPPROTO_TCP)
-	                return pfq_call(fun, skb, drop());
+        if (is_skip(ret) || is_drop(ret))
+                return ret;
 
-		tcp = skb_header_pointer(skb, skb->mac_len + (ip->ihl<<2), sizeof(_tcp), &_tcp);
-		if (tcp)
-                {
-                        return pfq_call(fun, skb, ret);
-                }
-	}
+        d = pfq_skb_dissect(skb);
+        if (has_ipv6(d))
+                return ret;
 
-	return pfq_call(fun, skb, drop());
+	return drop();
 }
 
 
 ret_t
-filter_icmp(struct sk_buff *skb, ret_t ret)
+filter_udp6(struct sk_buff *skb, ret_t ret)
+{
+        const struct pfq_dissect *d;
+
+        if (is_skip(ret) || is_drop(ret))
+                return ret;
+
+        d = pfq_skb_dissect(skb);
+        if (has_ipv6(d) && has_l4(d, IPPROTO_UDP))
+                return ret;
+
+	return drop();
+}
+
+
+ret_t
+filter_tcp6(struct sk_buff *skb, ret_t ret)
 {
-        sk_function_t fun;
+        const struct pfq_dissect *d;
 
         if (is_skip(ret) || is_drop(ret))
-                return pfq_call(get_next_function(skb), skb, ret);
+                return ret;
 
-        fun = get_next_function(skb);
+        d = pfq_skb_dissect(skb);
+        if (has_ipv6(d) && has_l4(d, IPPROTO_TCP))
+                return ret;
 
-	if (eth_hdr(skb)->h_proto == __constant_htons(ETH_P_IP))
-	{
-		struct iphdr _iph;
-    		const struct iphdr *ip;
+	return drop();
+}
 
-		struct icmphdr _icmp;
-		const struct icmphdr *icmp;
 
-		ip = skb_header_pointer(skb, skb->mac_len, sizeof(_iph), &_iph);
- 		if (ip == NULL)
-	                return pfq_call(fun, skb, drop());
+ret_t
+filter_flow6(struct sk_buff *skb, ret_t ret)
+{
+        const struct pfq_dissect *d;
 
-		if (ip->protocol != IPPROTO_ICMP)
-	                return pfq_call(fun, skb, drop());
+        if (is_skip(ret) || is_drop(ret))
+                return ret;
 
-		icmp = skb_header_pointer(skb, skb->mac_len + (ip->ihl<<2), sizeof(_icmp), &_icmp);
-		if (icmp)
-		{
-                        return pfq_call(fun, skb, ret);
-                }
-	}
+        d = pfq_skb_dissect(skb);
+        if (has_ipv6(d) && is_flow(d))
+                return ret;
 
-	return pfq_call(fun, skb, drop());
+	return drop();
 }
 
+
 ret_t
-filter_flow(struct sk_buff *skb, ret_t ret)
+filter_qinq(struct sk_buff *skb, ret_t ret)
+{
+        const struct pfq_dissect *d;
+
+        if (is_skip(ret) || is_drop(ret))
+                return ret;
+
+        d = pfq_skb_dissect(skb);
+        if (d->vlan_cnt > 1)
+                return ret;
+
+	return drop();
+}
+
+
+ret_t
+filter_mpls(struct sk_buff *skb, ret_t ret)
 {
-        sk_function_t fun;
+        const struct pfq_dissect *d;
 
         if (is_skip(ret) || is_drop(ret))
-                return pfq_call(get_next_function(skb), skb, ret);
+                return ret;
 
-        fun = get_next_function(skb);
+        d = pfq_skb_dissect(skb);
+        if (has_mpls(d))
+                return ret;
 
-	if (eth_hdr(skb)->h_proto == __constant_htons(ETH_P_IP))
-	{
-		struct iphdr _iph;
-    		const struct iphdr *ip;
+	return drop();
+}
 
-		struct udphdr _udp;
-		const struct udphdr *udp;
 
-		ip = skb_header_pointer(skb, skb->mac_len, sizeof(_iph), &_iph);
- 		if (ip == NULL)
- 			return pfq_call(fun, skb, drop());
+/* tunnel filters: outer encapsulation */
 
-		if (ip->protocol != IPPROTO_UDP &&
-		    ip->protocol != IPPROTO_TCP)
-			return pfq_call(fun, skb, drop());
+ret_t
+filter_tunnel(struct sk_buff *skb, ret_t ret)
+{
+        if (is_skip(ret) || is_drop(ret))
+                return ret;
 
-		udp = skb_header_pointer(skb, skb->mac_len + (ip->ihl<<2), sizeof(_udp), &_udp);
-		if (udp)
-		{
-                        return pfq_call(fun, skb, ret);
-                }
-	}
+        if (__pfq_tunnel_type(skb, pfq_skb_dissect(skb)) != tunnel_none)
+                return ret;
 
-	return pfq_call(fun, skb, drop());
+	return drop();
 }
 
 
 ret_t
-comb_neg(struct sk_buff *skb, ret_t ret)
+filter_gre(struct sk_buff *skb, ret_t ret)
 {
-        sk_function_t fun = get_next_function(skb);
+        if (is_skip(ret) || is_drop(ret))
+                return ret;
+
+        if (__pfq_tunnel_type(skb, pfq_skb_dissect(skb)) == tunnel_gre)
+                return ret;
 
+	return drop();
+}
+
+
+ret_t
+filter_vxlan(struct sk_buff *skb, ret_t ret)
+{
+        if (is_skip(ret) || is_drop(ret))
+                return ret;
+
+        if (__pfq_tunnel_type(skb, pfq_skb_dissect(skb)) == tunnel_vxlan)
+                return ret;
+
+	return drop();
+}
+
+
+ret_t
+filter_gtp(struct sk_buff *skb, ret_t ret)
+{
+        if (is_skip(ret) || is_drop(ret))
+                return ret;
+
+        if (__pfq_tunnel_type(skb, pfq_skb_dissect(skb)) == tunnel_gtp)
+                return ret;
+
+	return drop();
+}
+
+
+ret_t
+comb_neg(struct sk_buff *skb, ret_t ret)
+{
         if (is_skip(ret))
-                return pfq_call(get_next_function(skb), skb, ret);
+                return ret;
 
-        return pfq_call(fun, skb, is_drop(ret) ? pass() : drop());
+        return is_drop(ret) ? pass() : drop();
 }
 
 
@@ -589,22 +800,112 @@ comb_neg(struct sk_buff *skb, ret_t ret)
 ret_t
 comb_par(struct sk_buff *skb, ret_t ret)
 {
-        sk_function_t fun = get_next_function(skb);
-
         if (is_skip(ret))
-                return pfq_call(get_next_function(skb), skb, ret);
+                return ret;
 
         if (is_drop(ret))
-                return pfq_call(fun, skb, pass());
+                return pass();
         else
-                return pfq_call(fun, skb, skip(ret));
+                return skip(ret);
 }
 
 
 ret_t
 comb_pend(struct sk_buff *skb, ret_t ret)
 {
-        return pfq_call(get_next_function(skb), skb, clear_skip(ret));
+        return clear_skip(ret);
+}
+
+
+/* counter: packets and bytes seen at this stage of the computation
+ * (per-cpu context, merged on read)
+ */
+
+ret_t
+fun_counter(struct sk_buff *skb, ret_t ret)
+{
+        struct pfq_counter *c = get_cpu_context(skb);
+
+        c->packets++;
+        c->bytes += skb->len;
+
+        return ret;
+}
+
+
+/* sampling: the decision is a hash, so that it is reproducible for a given
+ * seed. Random sampling hashes the per-cpu packet count, flow sampling the
+ * symmetric 5-tuple (addresses only for fragments and for ip without ports,
+ * packets of other protocols are sampled randomly).
+ */
+
+static inline
+struct pfq_sample_context sample_context(struct sk_buff *skb)
+{
+        const struct pfq_sample_context *c = get_unsafe_context(skb);
+        struct pfq_sample_context def = { 1, 0 };
+        return c ? *c : def;
+}
+
+
+static inline
+ret_t sample_if(struct pfq_sample_stats *s, uint32_t hash, unsigned int ratio, ret_t ret)
+{
+        if (ratio > 1 && (hash % ratio) != 0)
+                return drop();
+
+        s->sampled++;
+        return ret;
+}
+
+
+ret_t
+fun_sample(struct sk_buff *skb, ret_t ret)
+{
+        struct pfq_sample_stats *s;
+        struct pfq_sample_context c;
+
+        if (is_skip(ret) || is_drop(ret))
+                return ret;
+
+        s = get_cpu_context(skb);
+        c = sample_context(skb);
+
+        s->packets++;
+
+        return sample_if(s, pfq_jhash_3words(s->packets, smp_processor_id(), 0, c.seed), c.ratio, ret);
+}
+
+
+ret_t
+sample_flow(struct sk_buff *skb, ret_t ret)
+{
+        const struct pfq_dissect *d;
+        struct pfq_sample_stats *s;
+        struct pfq_sample_context c;
+        uint32_t h;
+
+        if (is_skip(ret) || is_drop(ret))
+                return ret;
+
+        s = get_cpu_context(skb);
+        c = sample_context(skb);
+        d = pfq_skb_dissect(skb);
+
+        s->packets++;
+
+        if (has_ipv4(d))
+                h = has_flow(d) && !has_frag(d) ?
+                        pfq_hash_flow(Q_HASH_JHASH, d->addr.ip4.saddr, d->addr.ip4.daddr, d->sport, d->dport, c.seed) :
+                        pfq_hash_2words(Q_HASH_JHASH, d->addr.ip4.saddr, d->addr.ip4.daddr, c.seed);
+        else if (has_ipv6(d))
+                h = has_flow(d) && !has_frag(d) ?
+                        pfq_hash_flow6(Q_HASH_JHASH, d->addr.ip6.saddr.in6_u.u6_addr32, d->addr.ip6.daddr.in6_u.u6_addr32, d->sport, d->dport, c.seed) :
+                        pfq_hash_ip6(Q_HASH_JHASH, d->addr.ip6.saddr.in6_u.u6_addr32, d->addr.ip6.daddr.in6_u.u6_addr32, c.seed);
+        else
+                h = pfq_jhash_3words(s->packets, smp_processor_id(), 0, c.seed);
+
+        return sample_if(s, h, c.ratio, ret);
 }
 
 
@@ -616,8 +917,6 @@ struct pair { int a; int b; };
 ret_t
 dummy_state_context(struct sk_buff *skb, ret_t ret)
 {
-        sk_function_t fun = get_next_function(skb);
-
         struct pair *p = (struct pair *)get_unsafe_context(skb);
 
         if (printk_ratelimit())
@@ -625,36 +924,103 @@ dummy_state_context(struct sk_buff *skb, ret_t ret)
 
         set_state(skb, 42);
 
-        return pfq_call(fun, skb, ret);
+        return ret;
 }
 
+/* batch versions: headers of the whole batch are dissected first
+ * (functions that do not use the dissection, such as steer-mac and
+ * steer-vlan-id, are run per-skb)
+ */
+
+DEFINE_BATCH_FUNCTION(steering_vlan_outer)
+DEFINE_BATCH_FUNCTION(steering_vlan_inner)
+DEFINE_BATCH_FUNCTION(steering_mpls)
+DEFINE_BATCH_FUNCTION(steering_ipv4)
+DEFINE_BATCH_FUNCTION(steering_ipv6)
+DEFINE_BATCH_FUNCTION(steering_flow)
+DEFINE_BATCH_FUNCTION(steering_flow6)
+DEFINE_BATCH_FUNCTION(steering_tunnel)
+DEFINE_BATCH_FUNCTION(balance_flow)
+DEFINE_BATCH_FUNCTION(strict_ipv4)
+DEFINE_BATCH_FUNCTION(strict_udp)
+DEFINE_BATCH_FUNCTION(strict_tcp)
+DEFINE_BATCH_FUNCTION(strict_icmp)
+DEFINE_BATCH_FUNCTION(strict_flow)
+DEFINE_BATCH_FUNCTION(strict_ipv6)
+DEFINE_BATCH_FUNCTION(strict_udp6)
+DEFINE_BATCH_FUNCTION(strict_tcp6)
+DEFINE_BATCH_FUNCTION(strict_flow6)
+DEFINE_BATCH_FUNCTION(filter_ipv4)
+DEFINE_BATCH_FUNCTION(filter_udp)
+DEFINE_BATCH_FUNCTION(filter_tcp)
+DEFINE_BATCH_FUNCTION(filter_icmp)
+DEFINE_BATCH_FUNCTION(filter_flow)
+DEFINE_BATCH_FUNCTION(filter_ipv6)
+DEFINE_BATCH_FUNCTION(filter_udp6)
+DEFINE_BATCH_FUNCTION(filter_tcp6)
+DEFINE_BATCH_FUNCTION(filter_flow6)
+DEFINE_BATCH_FUNCTION(filter_qinq)
+DEFINE_BATCH_FUNCTION(filter_mpls)
+DEFINE_BATCH_FUNCTION(filter_tunnel)
+DEFINE_BATCH_FUNCTION(sample_flow)
+DEFINE_BATCH_FUNCTION(filter_gre)
+DEFINE_BATCH_FUNCTION(filter_vxlan)
+DEFINE_BATCH_FUNCTION(filter_gtp)
+DEFINE_BATCH_FUNCTION(strict_tunnel)
+
+
 struct sk_function_descr default_functions[] = {
-	{ "steer-mac",           steering_mac        },
-        { "steer-vlan-id",       steering_vlan_id    },
-        { "steer-ipv4",          steering_ipv4       },
-        { "steer-ipv6",          steering_ipv6       },
-        { "steer-flow",          steering_flow       },
+	{ "steer-mac",           steering_mac,        0, NULL, NULL, sizeof(struct pfq_steer_context) },
+        { "steer-vlan-id",       steering_vlan_id,    0, NULL, NULL, sizeof(struct pfq_steer_context) },
+        { "steer-vlan-outer",    steering_vlan_outer, 0, NULL, steering_vlan_outer_batch, sizeof(struct pfq_steer_context) },
+        { "steer-vlan-inner",    steering_vlan_inner, 0, NULL, steering_vlan_inner_batch, sizeof(struct pfq_steer_context) },
+        { "steer-mpls",          steering_mpls,       0, NULL, steering_mpls_batch, sizeof(struct pfq_steer_context) },
+        { "steer-ipv4",          steering_ipv4,       0, NULL, steering_ipv4_batch, sizeof(struct pfq_steer_context) },
+        { "steer-ipv6",          steering_ipv6,       0, NULL, steering_ipv6_batch, sizeof(struct pfq_steer_context) },
+        { "steer-flow",          steering_flow,       0, NULL, steering_flow_batch, sizeof(struct pfq_steer_context) },
+        { "steer-flow6",         steering_flow6,      0, NULL, steering_flow6_batch, sizeof(struct pfq_steer_context) },
+        { "steer-tunnel",        steering_tunnel,     0, NULL, steering_tunnel_batch, sizeof(struct pfq_tunnel_context) },
+        { "balance",             fun_balance         },
+        { "balance-flow",        balance_flow,        0, NULL, balance_flow_batch, sizeof(struct pfq_steer_context) },
         { "legacy",              fun_legacy          },
         { "clone",               fun_clone           },
         { "broadcast",           fun_broadcast       },
         { "sink",                fun_sink            },
         { "id",                  fun_id              },
         { "vlan",                filter_vlan         },
-        { "ipv4",                filter_ipv4         },
-        { "udp",                 filter_udp          },
-        { "tcp",                 filter_tcp          },
-        { "icmp",                filter_icmp         },
-        { "flow",                filter_flow         },
+        { "ipv4",                filter_ipv4,         0, NULL, filter_ipv4_batch },
+        { "udp",                 filter_udp,          0, NULL, filter_udp_batch },
+        { "tcp",                 filter_tcp,          0, NULL, filter_tcp_batch },
+        { "icmp",                filter_icmp,         0, NULL, filter_icmp_batch },
+        { "flow",                filter_flow,         0, NULL, filter_flow_batch },
+        { "ipv6",                filter_ipv6,         0, NULL, filter_ipv6_batch },
+        { "udp6",                filter_udp6,         0, NULL, filter_udp6_batch },
+        { "tcp6",                filter_tcp6,         0, NULL, filter_tcp6_batch },
+        { "flow6",               filter_flow6,        0, NULL, filter_flow6_batch },
+        { "qinq",                filter_qinq,         0, NULL, filter_qinq_batch },
+        { "mpls",                filter_mpls,         0, NULL, filter_mpls_batch },
+        { "tunnel",              filter_tunnel,       0, NULL, filter_tunnel_batch },
+        { "gre",                 filter_gre,          0, NULL, filter_gre_batch },
+        { "vxlan",               filter_vxlan,        0, NULL, filter_vxlan_batch },
+        { "gtp",                 filter_gtp,          0, NULL, filter_gtp_batch },
         { "strict-vlan",         strict_vlan         },
-        { "strict-ipv4",         strict_ipv4         },
-        { "strict-udp",          strict_udp          },
-        { "strict-tcp",          strict_tcp          },
-        { "strict-icmp",         strict_icmp         },
-        { "strict-flow",         strict_flow         },
+        { "strict-ipv4",         strict_ipv4,         0, NULL, strict_ipv4_batch },
+        { "strict-udp",          strict_udp,          0, NULL, strict_udp_batch },
+        { "strict-tcp",          strict_tcp,          0, NULL, strict_tcp_batch },
+        { "strict-icmp",         strict_icmp,         0, NULL, strict_icmp_batch },
+        { "strict-flow",         strict_flow,         0, NULL, strict_flow_batch },
+        { "strict-ipv6",         strict_ipv6,         0, NULL, strict_ipv6_batch },
+        { "strict-udp6",         strict_udp6,         0, NULL, strict_udp6_batch },
+        { "strict-tcp6",         strict_tcp6,         0, NULL, strict_tcp6_batch },
+        { "strict-flow6",        strict_flow6,        0, NULL, strict_flow6_batch },
+        { "strict-tunnel",       strict_tunnel,       0, NULL, strict_tunnel_batch },
         { "neg",                 comb_neg            },
         { "par",                 comb_par            },
         { "pend",                comb_pend           },
+        { "counter",             fun_counter,        sizeof(struct pfq_counter), NULL },
+        { "sample",              fun_sample,         sizeof(struct pfq_sample_stats), NULL, NULL, sizeof(struct pfq_sample_context) },
+        { "sample-flow",         sample_flow,        sizeof(struct pfq_sample_stats), NULL, sample_flow_batch, sizeof(struct pfq_sample_context) },
         /* ---------------------------------------- */
-        { "dummy-state",         dummy_state_context },
-        { NULL, NULL}};
+        { "dummy-state",         dummy_state_context, 0, NULL, NULL, sizeof(struct pair) },
+        { NULL, NULL, 0, NULL }};
 
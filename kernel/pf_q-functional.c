@@ -40,6 +40,10 @@ struct function_factory_elem
 	struct list_head 	function_list;
 	char 			name[Q_FUN_NAME_LEN];
 	sk_function_t 	function;
+	size_t			percpu_size;
+	sk_merge_t		merge;
+	sk_batch_function_t	batch;
+	size_t			context_size;
 };
 
 
@@ -58,7 +62,7 @@ pfq_register_functions(const char *module, struct sk_function_descr *fun)
 	int i = 0;
 	for(; fun[i].name != NULL; i++)
 	{
-		pfq_register_function(module, fun[i].name, fun[i].function);
+		pfq_register_function_descr(module, &fun[i]);
 	}
 	return 0;
 }
@@ -86,7 +90,7 @@ pfq_function_factory_init(void)
 	int i = 0;
 	for(; default_functions[i].name != NULL ; i++)
 	{
-        	pfq_register_function("[core]", default_functions[i].name, default_functions[i].function);
+        	pfq_register_function_descr("[core]", &default_functions[i]);
 	}
 
 	printk(KERN_INFO "[PFQ] function factory initialized.\n");
@@ -111,8 +115,8 @@ pfq_function_factory_free(void)
 }
 
 
-sk_function_t
-__pfq_get_function(const char *name)
+static struct function_factory_elem *
+__pfq_get_function_elem(const char *name)
 {
 	struct list_head *pos = NULL;
 	struct function_factory_elem *this;
@@ -121,12 +125,20 @@ __pfq_get_function(const char *name)
 	{
     		this = list_entry(pos, struct function_factory_elem, function_list);
         	if (!strcmp(this->name, name))
-			return this->function;
+			return this;
 	}
 	return NULL;
 }
 
 
+sk_function_t
+__pfq_get_function(const char *name)
+{
+	struct function_factory_elem *elem = __pfq_get_function_elem(name);
+	return elem ? elem->function : NULL;
+}
+
+
 sk_function_t
 pfq_get_function(const char *name)
 {
@@ -138,8 +150,29 @@ pfq_get_function(const char *name)
 }
 
 
+/* copy of the function descriptor (the name is not copied) */
+
+int
+pfq_get_function_descr(const char *name, struct sk_function_descr *descr)
+{
+	struct function_factory_elem *elem;
+	down(&function_sem);
+	elem = __pfq_get_function_elem(name);
+	if (elem) {
+		descr->name 	   = NULL;
+		descr->function    = elem->function;
+		descr->percpu_size = elem->percpu_size;
+		descr->merge 	   = elem->merge;
+		descr->batch 	   = elem->batch;
+		descr->context_size = elem->context_size;
+	}
+	up(&function_sem);
+	return elem ? 0 : -1;
+}
+
+
 int
-__pfq_register_function(const char *name, sk_function_t fun)
+__pfq_register_function(const char *name, const struct sk_function_descr *descr)
 {
 	struct function_factory_elem * elem;
 
@@ -156,7 +189,11 @@ __pfq_register_function(const char *name, sk_function_t fun)
 
 	INIT_LIST_HEAD(&elem->function_list);
 
-	elem->function = fun;
+	elem->function    = descr->function;
+	elem->percpu_size = descr->percpu_size;
+	elem->merge       = descr->merge;
+	elem->batch       = descr->batch;
+	elem->context_size = descr->context_size;
 
 	strncpy(elem->name, name, Q_FUN_NAME_LEN-1);
         elem->name[Q_FUN_NAME_LEN-1] = '\0';
@@ -167,18 +204,28 @@ __pfq_register_function(const char *name, sk_function_t fun)
 
 
 int
-pfq_register_function(const char *module, const char *name, sk_function_t fun)
+pfq_register_function_descr(const char *module, const struct sk_function_descr *descr)
 {
 	int r;
 	down(&function_sem);
-	r = __pfq_register_function(name, fun);
+	r = __pfq_register_function(descr->name, descr);
 	up(&function_sem);
 	if (r == 0)
-		printk(KERN_INFO "[PFQ]%s '%s' @%p function registered.\n", module, name, fun);
+		printk(KERN_INFO "[PFQ]%s '%s' @%p function registered%s%s.\n", module, descr->name, descr->function,
+		       descr->batch ? " (batch)" : "",
+		       descr->percpu_size ? " (per-cpu context)" : "");
 	return r;
 }
 
 
+int
+pfq_register_function(const char *module, const char *name, sk_function_t fun)
+{
+	struct sk_function_descr descr = { name, fun, 0, NULL, NULL, 0 };
+	return pfq_register_function_descr(module, &descr);
+}
+
+
 int
 __pfq_unregister_function(const char *name)
 {
@@ -209,10 +256,11 @@ pfq_unregister_function(const char *module, const char *name)
 
 	fun = __pfq_get_function(name);
 	if (fun == NULL) {
+		up(&function_sem);
         	return -1;
 	}
 
-	__pfq_dismiss_function(fun);
+	pfq_dismiss_function(fun);
         __pfq_unregister_function(name);
 
 	printk(KERN_INFO "[PFQ]%s '%s' function unregistered.\n", module, name);
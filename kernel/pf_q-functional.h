@@ -25,6 +25,7 @@
 #define _PF_Q_STEER_H_
 
 #include <linux/skbuff.h>
+#include <linux/rcupdate.h>
 #include <linux/pf_q.h>
 #include <linux/pf_q-fun.h>
 
@@ -34,10 +35,68 @@ extern void pfq_function_factory_free(void);
 
 
 extern int  pfq_register_function(const char *module, const char *name, sk_function_t fun);
+extern int  pfq_register_function_descr(const char *module, const struct sk_function_descr *descr);
 extern int  pfq_unregister_function(const char *module, const char *name);
 
 extern 		sk_function_t pfq_get_function(const char *name);
 
-sk_function_t pfq_get_function(const char *name);
+extern int  pfq_get_function_descr(const char *name, struct sk_function_descr *descr);
+
+
+/* sealed computation: the function chain of a group, flattened with
+ * function pointers and contexts pre-resolved (see __pfq_group_seal).
+ * It is published by means of RCU: pfq_run_batch must be called in a read-side
+ * critical section.
+ */
+
+struct pfq_computation
+{
+    struct rcu_head         rcu;
+    size_t                  size;
+    struct pfq_functional   fun[Q_FUN_MAX];
+};
+
+
+/* batch evaluation: each stage runs once on the packets of mask (the batch
+ * version of the function, if any, or the function per-skb). A packet leaves
+ * the batch as soon as its computation is stopped.
+ */
+
+static inline void
+pfq_run_batch(struct pfq_computation *comp, struct sk_buff **skbs, unsigned long mask, ret_t *ret)
+{
+        struct pfq_functional *fun = comp->fun, *end = comp->fun + comp->size;
+        struct sk_buff *skb;
+        unsigned long m, n;
+
+        for(; fun != end && mask; fun++)
+        {
+                m = mask;
+
+                if (fun->batch)
+                {
+                        batch_for_each(skb, n, m, skbs)
+                                pfq_skb_annotation(skb)->functional = fun;
+
+                        fun->batch(skbs, mask, ret);
+                }
+                else
+                {
+                        batch_for_each(skb, n, m, skbs)
+                        {
+                                pfq_skb_annotation(skb)->functional = fun;
+                                ret[n] = fun->function(skb, ret[n]);
+                        }
+                }
+
+                m = mask;
+
+                batch_for_each(skb, n, m, skbs)
+                {
+                        if (ret[n].type & action_stop)
+                                mask &= ~(1UL << n);
+                }
+        }
+}
 
 #endif /* _PF_Q_STEER_H_ */
@@ -25,6 +25,8 @@
 #include <linux/kernel.h>
 #include <linux/module.h>
 #include <linux/semaphore.h>
+#include <linux/slab.h>
+#include <linux/rcupdate.h>
 
 #include <pf_q-group.h>
 #include <pf_q-devmap.h>
@@ -35,6 +37,54 @@ DEFINE_SEMAPHORE(group_sem);
 
 struct pfq_group pfq_groups[Q_MAX_GROUP];
 
+int pfq_group_words = 1;
+
+
+/* group counters are per-cpu: allocated once for all the groups at module load */
+
+int
+pfq_groups_init(void)
+{
+        int n;
+
+        for(n = 0; n < Q_MAX_GROUP; n++)
+        {
+                if (pfq_kstats_init(&pfq_groups[n].stats) != 0) {
+                        while (n-- > 0)
+                                pfq_kstats_free(&pfq_groups[n].stats);
+                        return -ENOMEM;
+                }
+        }
+
+        return 0;
+}
+
+
+void
+pfq_groups_free(void)
+{
+        int n;
+
+        for(n = 0; n < Q_MAX_GROUP; n++)
+                pfq_kstats_free(&pfq_groups[n].stats);
+}
+
+
+/* writer side accessors (group_sem held) */
+
+static inline struct pfq_computation *
+__pfq_group_comp(int gid)
+{
+        return rcu_dereference_protected(pfq_groups[gid].comp, 1);
+}
+
+
+static inline struct sk_filter *
+__pfq_group_filter(int gid)
+{
+        return rcu_dereference_protected(pfq_groups[gid].filter, 1);
+}
+
 
 /* precondition: gid must be valid */
 
@@ -77,35 +127,47 @@ __pfq_group_ctor(int gid)
 
         for(i = 0; i < Q_CLASS_MAX; i++)
         {
-                atomic_long_set(&that->sock_mask[i], 0);
+                bitmap_zero(that->sock_mask[i], Q_MAX_ID);
         }
 
-        /* note the = is for setting the limit to the function composition:
-         * the last function pointer is always set to NULL
-         * */
-
-        for(i = 0; i <= Q_FUN_MAX; i++)
+        for(i = 0; i < Q_FUN_MAX; i++)
         {
                 atomic_long_set(&that->fun_ctx[i].function, 0L);
                 atomic_long_set(&that->fun_ctx[i].context,    0L);
                 spin_lock_init (&that->fun_ctx[i].lock);
+                that->fun_ctx[i].batch  = NULL;
+                that->fun_ctx[i].percpu = NULL;
+                that->fun_ctx[i].context_size = 0;
         }
 
-        atomic_long_set(&that->filter,   0L);
+        RCU_INIT_POINTER(that->comp,   NULL);
+        RCU_INIT_POINTER(that->filter, NULL);
+        RCU_INIT_POINTER(that->reta,   NULL);
 
-        sparse_set(&that->recv, 0);
-        sparse_set(&that->lost, 0);
-        sparse_set(&that->drop, 0);
+        that->elephant_policy = Q_ELEPHANT_PIN;
+        that->elephant_pps    = 0;
+        that->fprog_mode = Q_FPROG_NONE;
+
+        sparse_set(&that->stats.recv, 0);
+        sparse_set(&that->stats.lost, 0);
+        sparse_set(&that->stats.drop, 0);
+}
+
+
+static void
+__pfq_reta_free(struct pfq_reta *reta)
+{
+        if (reta)
+                kfree_rcu(reta, rcu);
 }
 
 
+/* precondition: group_sem held */
+
 static void
 __pfq_group_dtor(int gid)
 {
         struct pfq_group * that = &pfq_groups[gid];
-        void *context[Q_FUN_MAX];
-
-        struct sk_filter *filter;
         int i;
 
         /* remove this gid from demux matrix */
@@ -115,23 +177,31 @@ __pfq_group_dtor(int gid)
         that->pid = 0;
         that->policy = Q_GROUP_UNDEFINED;
 
-        for(i = 0; i < Q_FUN_MAX; i++)
-        {
-		atomic_long_set(&pfq_groups[gid].fun_ctx[i].function, 0L);
+        /* unpublish the computation and the filter: functions, contexts and
+         * filter are released after the RCU grace period
+         */
 
-		context[i] = (void *)atomic_long_xchg(&pfq_groups[gid].fun_ctx[i].context, 0L);
-        }
+        pfq_computation_free(__pfq_group_comp(gid));
+        RCU_INIT_POINTER(that->comp, NULL);
 
-        filter = (struct sk_filter *)atomic_long_xchg(&pfq_groups[gid].filter, 0L);
+        pfq_free_sk_filter(__pfq_group_filter(gid));
+        RCU_INIT_POINTER(that->filter, NULL);
+        that->fprog_mode = Q_FPROG_NONE;
 
-        msleep(GRACE_PERIOD);   /* sleeping is possible here: user-context */
+        __pfq_reta_free(rcu_dereference_protected(that->reta, 1));
+        RCU_INIT_POINTER(that->reta, NULL);
 
         for(i = 0; i < Q_FUN_MAX; i++)
         {
-                kfree(context[i]);
-        }
+		atomic_long_set(&that->fun_ctx[i].function, 0L);
 
-        pfq_free_sk_filter(filter);
+		pfq_context_free((void *)atomic_long_xchg(&that->fun_ctx[i].context, 0L));
+
+                pfq_percpu_context_free(that->fun_ctx[i].percpu);
+                that->fun_ctx[i].batch  = NULL;
+                that->fun_ctx[i].percpu = NULL;
+                that->fun_ctx[i].context_size = 0;
+        }
 
         that->vlan_filt = false;
 
@@ -139,10 +209,20 @@ __pfq_group_dtor(int gid)
 }
 
 
+/* update the number of words of group bitmaps in use (group_sem held) */
+
+static void
+__pfq_update_group_words(int gid)
+{
+        /* grows only: the receive path may still be scanning the old span */
+
+        pfq_group_words = max_t(int, pfq_group_words, BITS_TO_LONGS(gid+1));
+}
+
+
 static int
 __pfq_join_group(int gid, int id, unsigned long class_mask, int policy)
 {
-        unsigned long tmp = 0;
         unsigned long bit;
 
         if (!pfq_groups[gid].pid) {
@@ -154,17 +234,22 @@ __pfq_join_group(int gid, int id, unsigned long class_mask, int policy)
                 return -1;
         }
 
+        if (!__pfq_has_joined_group(gid, id)) {
+                pfq_groups[gid].weight[id] = 1;
+                pfq_groups[gid].weight_gen++;
+        }
+
         bitwise_foreach(class_mask, bit)
         {
                 int class = pfq_ctz(bit);
-                tmp = atomic_long_read(&pfq_groups[gid].sock_mask[class]);
-                tmp |= 1L << id;
-                atomic_long_set(&pfq_groups[gid].sock_mask[class], tmp);
+                set_bit(id, pfq_groups[gid].sock_mask[class]);
         }
 
         pfq_groups[gid].policy = pfq_groups[gid].policy == Q_GROUP_UNDEFINED ?  policy : pfq_groups[gid].policy;
         pfq_groups[gid].pid    = policy == Q_GROUP_RESTRICTED ? current->tgid : -1;
 
+        __pfq_update_group_words(gid);
+
         return 0;
 }
 
@@ -172,7 +257,6 @@ __pfq_join_group(int gid, int id, unsigned long class_mask, int policy)
 static int
 __pfq_leave_group(int gid, int id)
 {
-        unsigned long tmp;
         int i;
 
 	if (!pfq_groups[gid].pid)
@@ -180,9 +264,7 @@ __pfq_leave_group(int gid, int id)
 
         for(i = 0; i < Q_CLASS_MAX; ++i)
         {
-                tmp = atomic_long_read(&pfq_groups[gid].sock_mask[i]);
-                tmp &= ~(1L << id);
-                atomic_long_set(&pfq_groups[gid].sock_mask[i], tmp);
+                clear_bit(id, pfq_groups[gid].sock_mask[i]);
         }
 
         if (__pfq_group_is_empty(gid)) {
@@ -192,99 +274,446 @@ __pfq_leave_group(int gid, int id)
         return 0;
 }
 
-unsigned long
-__pfq_get_all_groups_mask(int gid)
+/* contexts are allocated with an rcu_head in front of the user data */
+
+void *
+pfq_context_alloc(size_t size)
 {
-        unsigned long mask = 0;
-        int i;
-        for(i = 0; i < Q_CLASS_MAX; ++i)
+        struct pfq_context *ctx = kmalloc(sizeof(struct pfq_context) + size, GFP_KERNEL);
+        if (ctx == NULL)
+                return NULL;
+        ctx->size = size;
+        return ctx->data;
+}
+
+
+void
+pfq_context_free(void *context)
+{
+        if (context)
+                kfree_rcu(container_of(context, struct pfq_context, data), rcu);
+}
+
+
+struct pfq_percpu_context *
+pfq_percpu_context_alloc(size_t size, sk_merge_t merge)
+{
+        struct pfq_percpu_context *ctx = kmalloc(sizeof(struct pfq_percpu_context), GFP_KERNEL);
+        if (ctx == NULL)
+                return NULL;
+
+        ctx->data = __alloc_percpu(size, __alignof__(unsigned long));
+        if (ctx->data == NULL) {
+                kfree(ctx);
+                return NULL;
+        }
+
+        ctx->size  = size;
+        ctx->merge = merge;
+        return ctx;
+}
+
+
+static void
+__pfq_percpu_context_free_rcu(struct rcu_head *head)
+{
+        struct pfq_percpu_context *ctx = container_of(head, struct pfq_percpu_context, rcu);
+        free_percpu(ctx->data);
+        kfree(ctx);
+}
+
+
+void
+pfq_percpu_context_free(struct pfq_percpu_context *ctx)
+{
+        if (ctx)
+                call_rcu(&ctx->rcu, __pfq_percpu_context_free_rcu);
+}
+
+
+/* default merge: the replicas are arrays of unsigned long counters */
+
+static void
+__pfq_percpu_context_sum(void *acc, const void *ctx, size_t size)
+{
+        unsigned long *a = acc;
+        const unsigned long *c = ctx;
+        size_t n;
+
+        for(n = 0; n < size / sizeof(unsigned long); n++)
+                a[n] += c[n];
+}
+
+
+void
+pfq_computation_free(struct pfq_computation *comp)
+{
+        if (comp)
+                kfree_rcu(comp, rcu);
+}
+
+
+/* flatten the function chain of the group (up to the first missing function)
+ * into a new computation and publish it. The previous one is released after
+ * the RCU grace period.
+ *
+ * precondition: group_sem held
+ */
+
+static int
+__pfq_group_seal(int gid)
+{
+        struct fun_context *fun_ctx = pfq_groups[gid].fun_ctx;
+        struct pfq_computation *comp = NULL, *old;
+        size_t n, size = 0;
+
+        while (size < Q_FUN_MAX && atomic_long_read(&fun_ctx[size].function))
+                size++;
+
+        if (size)
         {
-                mask |= atomic_long_read(&pfq_groups[gid].sock_mask[i]);
+                comp = kmalloc(sizeof(struct pfq_computation), GFP_KERNEL);
+                if (comp == NULL)
+                        return -ENOMEM;
+
+                for(n = 0; n < size; n++)
+                {
+                        comp->fun[n].function = (sk_function_t) atomic_long_read(&fun_ctx[n].function);
+                        comp->fun[n].batch    = fun_ctx[n].batch;
+                        comp->fun[n].context  = (void *) atomic_long_read(&fun_ctx[n].context);
+                        comp->fun[n].lock     = &fun_ctx[n].lock;
+                        comp->fun[n].percpu   = fun_ctx[n].percpu ? fun_ctx[n].percpu->data : NULL;
+                }
+
+                comp->size = size;
         }
-        return mask;
+
+        old = __pfq_group_comp(gid);
+        rcu_assign_pointer(pfq_groups[gid].comp, comp);
+        pfq_computation_free(old);
+        return 0;
 }
 
 
-int __pfq_set_group_function(int gid, sk_function_t fun, int level)
+static int
+__pfq_set_group_function(int gid, const struct sk_function_descr *descr, int level)
 {
+        struct pfq_percpu_context *percpu = NULL, *old;
+        sk_batch_function_t old_batch;
+        struct fun_context *fun_ctx;
+        size_t old_size;
+        void *context;
+        long prev;
+
         if (level < 0 || level >= Q_FUN_MAX)
                 return -EINVAL;
 
-        atomic_long_set(&pfq_groups[gid].fun_ctx[level].function, (long)fun);
+        fun_ctx = &pfq_groups[gid].fun_ctx[level];
 
-        msleep(GRACE_PERIOD);
+        /* the context already set must fit the new function */
 
+        context = (void *)atomic_long_read(&fun_ctx->context);
+        if (context && descr && descr->context_size &&
+            container_of(context, struct pfq_context, data)->size != descr->context_size)
+                return -EINVAL;
+
+        /* fresh (zeroed) per-cpu replicas, if the function declares them */
+
+        if (descr && descr->percpu_size) {
+                percpu = pfq_percpu_context_alloc(descr->percpu_size, descr->merge);
+                if (percpu == NULL)
+                        return -ENOMEM;
+        }
+
+        prev = atomic_long_xchg(&fun_ctx->function, (long)(descr ? descr->function : NULL));
+        old  = fun_ctx->percpu;
+        fun_ctx->percpu = percpu;
+        old_batch = fun_ctx->batch;
+        fun_ctx->batch = descr ? descr->batch : NULL;
+        old_size = fun_ctx->context_size;
+        fun_ctx->context_size = descr ? descr->context_size : 0;
+
+        if (__pfq_group_seal(gid) < 0) {
+                atomic_long_set(&fun_ctx->function, prev);
+                fun_ctx->percpu = old;
+                fun_ctx->batch  = old_batch;
+                fun_ctx->context_size = old_size;
+                if (percpu) {
+                        free_percpu(percpu->data);
+                        kfree(percpu);
+                }
+                return -ENOMEM;
+        }
+
+        pfq_percpu_context_free(old);
         return 0;
 }
 
 
-int __pfq_set_group_context(int gid, void *context, int level)
+int pfq_set_group_function(int gid, const struct sk_function_descr *descr, int level)
 {
+        int ret;
+        down(&group_sem);
+        ret = __pfq_set_group_function(gid, descr, level);
+        up(&group_sem);
+        return ret;
+}
+
+
+static int
+__pfq_set_group_context(int gid, void *context, size_t size, int level)
+{
+        size_t expected;
         void *old;
 
         if (level < 0 || level >= Q_FUN_MAX)
                 return -EINVAL;
 
+        /* the function reads the context as is: its size must match */
+
+        expected = pfq_groups[gid].fun_ctx[level].context_size;
+        if (context && expected && size != expected)
+                return -EINVAL;
+
         old = (void *)atomic_long_xchg(& pfq_groups[gid].fun_ctx[level].context, (long)context);
 
-        msleep(GRACE_PERIOD);
+        if (__pfq_group_seal(gid) < 0) {
+                atomic_long_set(&pfq_groups[gid].fun_ctx[level].context, (long)old);
+                return -ENOMEM;
+        }
+
+        pfq_context_free(old);
+        return 0;
+}
+
+
+int pfq_set_group_context(int gid, void *context, size_t size, int level)
+{
+        int ret;
+        down(&group_sem);
+        ret = __pfq_set_group_context(gid, context, size, level);
+        up(&group_sem);
+        return ret;
+}
 
-        kfree(old);
+
+/* merge the per-cpu replicas into the aggregated view (group_sem held) */
+
+static int
+__pfq_get_group_percpu_context(struct pfq_percpu_context *percpu, void *buff, int size)
+{
+        sk_merge_t merge = percpu->merge ? percpu->merge : __pfq_percpu_context_sum;
+        int cpu;
+
+        if (size != percpu->size)
+                return -EINVAL;
+
+        memset(buff, 0, size);
+
+        for_each_possible_cpu(cpu)
+        {
+                merge(buff, per_cpu_ptr(percpu->data, cpu), size);
+        }
 
         return 0;
 }
 
 
-int __pfq_get_group_context(int gid, int level, int size, void __user * dst)
+int pfq_get_group_context(int gid, int level, int size, void __user * dst)
 {
+        struct pfq_percpu_context *percpu;
+        void *src = NULL, *buff;
         int err = 0;
-        void *src;
 
-        if (level < 0 || level >= Q_FUN_MAX)
+        if (level < 0 || level >= Q_FUN_MAX || size <= 0)
                 return -EINVAL;
 
-        spin_lock_bh(&pfq_groups[gid].fun_ctx[level].lock);
+        buff = kmalloc(size, GFP_KERNEL);
+        if (buff == NULL)
+                return -ENOMEM;
+
+        down(&group_sem);
+
+        percpu = pfq_groups[gid].fun_ctx[level].percpu;
+        if (percpu)
+        {
+                /* lock-free replicas: merge-on-read */
+
+                err = __pfq_get_group_percpu_context(percpu, buff, size);
+                src = buff;
+        }
+        else
+        {
+                /* the context is updated by functions under its lock: snapshot it
+                 * before copying to user space (which may sleep)
+                 */
+
+                spin_lock_bh(&pfq_groups[gid].fun_ctx[level].lock);
 
-        src = (void *)atomic_long_read(&pfq_groups[gid].fun_ctx[level].context);
+                src = (void *)atomic_long_read(&pfq_groups[gid].fun_ctx[level].context);
+                if (src)
+                        memcpy(buff, src, size);
 
-        err = src ? copy_to_user(dst, src, size) : -EFAULT;
+                spin_unlock_bh(&pfq_groups[gid].fun_ctx[level].lock);
+        }
+
+        up(&group_sem);
 
-        spin_unlock_bh(&pfq_groups[gid].fun_ctx[level].lock);
+        if (err == 0 && (src == NULL || copy_to_user(dst, buff, size)))
+                err = -EFAULT;
 
+        kfree(buff);
         return err;
 }
 
 
-void __pfq_reset_group_functx(int gid)
+void pfq_reset_group_functx(int gid)
 {
         int i;
 
+        down(&group_sem);
+
+        /* unpublish the computation: contexts are released after the grace period */
+
+        pfq_computation_free(__pfq_group_comp(gid));
+        rcu_assign_pointer(pfq_groups[gid].comp, NULL);
+
         for(i = 0; i < Q_FUN_MAX; i++)
         {
-                void *old = (void *)atomic_long_xchg(& pfq_groups[gid].fun_ctx[i].context, 0L);
-
                 atomic_long_set(& pfq_groups[gid].fun_ctx[i].function, 0L);
 
-                msleep(GRACE_PERIOD);
+                pfq_context_free((void *)atomic_long_xchg(& pfq_groups[gid].fun_ctx[i].context, 0L));
+
+                pfq_percpu_context_free(pfq_groups[gid].fun_ctx[i].percpu);
+                pfq_groups[gid].fun_ctx[i].batch  = NULL;
+                pfq_groups[gid].fun_ctx[i].percpu = NULL;
+                pfq_groups[gid].fun_ctx[i].context_size = 0;
+        }
+
+        up(&group_sem);
+}
+
+
+struct pfq_reta *
+pfq_reta_alloc(unsigned int size)
+{
+        struct pfq_reta *reta;
+
+        reta = kmalloc(sizeof(struct pfq_reta) + size * sizeof(int), GFP_KERNEL);
+        if (reta)
+                reta->size = size;
+        return reta;
+}
+
+
+int pfq_set_group_weight(int gid, int id, int weight)
+{
+        if (weight < 1 || weight > Q_MAX_WEIGHT)
+                return -EINVAL;
+
+        down(&group_sem);
+
+        pfq_groups[gid].weight[id] = weight;
+        smp_wmb();
+        pfq_groups[gid].weight_gen++;
+
+        up(&group_sem);
+        return 0;
+}
+
+
+int pfq_set_group_elephant(int gid, int policy, unsigned int pps)
+{
+        if (policy < Q_ELEPHANT_PIN || policy > Q_ELEPHANT_REHOME)
+                return -EINVAL;
+
+        down(&group_sem);
+
+        pfq_groups[gid].elephant_policy = policy;
+        smp_wmb();
+        pfq_groups[gid].elephant_pps = pps;
+
+        up(&group_sem);
+        return 0;
+}
+
+
+void pfq_get_group_elephant(int gid, int *policy, unsigned int *pps)
+{
+        down(&group_sem);
+
+        *policy = pfq_groups[gid].elephant_policy;
+        *pps    = pfq_groups[gid].elephant_pps;
+
+        up(&group_sem);
+}
+
+
+/* publish a new indirection table (NULL removes it) */
+
+int pfq_set_group_reta(int gid, struct pfq_reta *reta)
+{
+        struct pfq_reta *old;
+
+        down(&group_sem);
+
+        old = rcu_dereference_protected(pfq_groups[gid].reta, 1);
+        rcu_assign_pointer(pfq_groups[gid].reta, reta);
+
+        up(&group_sem);
+
+        __pfq_reta_free(old);
+        return 0;
+}
+
+
+/* copy the indirection table (if size is large enough): returns its size */
+
+int pfq_get_group_reta(int gid, int *sock, int size)
+{
+        struct pfq_reta *reta;
+        int ret = 0;
+
+        down(&group_sem);
 
-                kfree(old);
+        reta = rcu_dereference_protected(pfq_groups[gid].reta, 1);
+        if (reta) {
+                ret = reta->size;
+                if (size >= ret)
+                        memcpy(sock, reta->sock, ret * sizeof(int));
         }
+
+        up(&group_sem);
+        return ret;
 }
 
 
-void __pfq_set_group_filter(int gid, struct sk_filter *filter)
+void pfq_set_group_filter(int gid, struct sk_filter *filter)
 {
-        struct sk_filter * old_filter = (void *)atomic_long_xchg(& pfq_groups[gid].filter, (long)filter);
+        struct sk_filter *old;
+
+        down(&group_sem);
+
+        old = __pfq_group_filter(gid);
+        rcu_assign_pointer(pfq_groups[gid].filter, filter);
+        pfq_groups[gid].fprog_mode = pfq_sk_filter_mode(filter);
 
-        msleep(GRACE_PERIOD);
+        up(&group_sem);
 
-        pfq_free_sk_filter(old_filter);
+        pfq_free_sk_filter(old);
 }
 
 
-void __pfq_dismiss_function(sk_function_t f)
+/* remove the function from all the groups: when this returns the function
+ * is no longer running on any cpu (the module can be safely unloaded).
+ */
+
+void pfq_dismiss_function(sk_function_t f)
 {
         int i, n;
+
+        down(&group_sem);
+
         for(n = 0; n < Q_MAX_GROUP; n++)
         {
                 for(i = 0; i < Q_FUN_MAX; i++)
@@ -292,13 +721,30 @@ void __pfq_dismiss_function(sk_function_t f)
                         sk_function_t fun = (sk_function_t)atomic_long_read(&pfq_groups[n].fun_ctx[i].function);
                         if (f == fun)
                         {
-                                __pfq_set_group_function(n, NULL, i);
-                                __pfq_set_group_context(n, NULL, i);
+                                if (__pfq_set_group_function(n, NULL, i) < 0)
+                                {
+                                        /* out of memory: unpublish the whole computation */
+
+                                        pfq_computation_free(__pfq_group_comp(n));
+                                        rcu_assign_pointer(pfq_groups[n].comp, NULL);
+                                        atomic_long_set(&pfq_groups[n].fun_ctx[i].function, 0L);
+
+                                        pfq_percpu_context_free(pfq_groups[n].fun_ctx[i].percpu);
+                                        pfq_groups[n].fun_ctx[i].batch  = NULL;
+                                        pfq_groups[n].fun_ctx[i].percpu = NULL;
+                                        pfq_groups[n].fun_ctx[i].context_size = 0;
+                                }
+
+                                __pfq_set_group_context(n, NULL, 0, i);
 
                                 printk(KERN_INFO "[PFQ] function @%p dismissed.\n", fun);
                         }
                 }
         }
+
+        up(&group_sem);
+
+        synchronize_rcu();
 }
 
 
@@ -320,7 +766,7 @@ pfq_join_free_group(int id, unsigned long class_mask, int policy)
 {
         int n = 0;
         down(&group_sem);
-        for(; n < Q_MAX_ID; n++)
+        for(; n < Q_MAX_GROUP; n++)
         {
                 if(!pfq_groups[n].pid)
                 {
@@ -350,7 +796,7 @@ pfq_leave_all_groups(int id)
 {
         int n = 0;
         down(&group_sem);
-        for(; n < Q_MAX_ID; n++)
+        for(; n < Q_MAX_GROUP; n++)
         {
                 __pfq_leave_group(n, id);
         }
@@ -358,22 +804,16 @@ pfq_leave_all_groups(int id)
 }
 
 
-unsigned long
-pfq_get_groups(int id)
+void
+pfq_get_groups(int id, unsigned long *mask)
 {
-        unsigned long ret = 0;
         int n = 0;
+        bitmap_zero(mask, Q_MAX_GROUP);
         down(&group_sem);
-        for(; n < Q_MAX_ID; n++)
+        for(; n < Q_MAX_GROUP; n++)
         {
-                unsigned long mask = __pfq_get_all_groups_mask(n);
-                if(mask & (1L << id))
-                {
-                        ret |= (1UL << n);
-                }
+                if (__pfq_has_joined_group(n, id))
+                        __set_bit(n, mask);
         }
         up(&group_sem);
-        return ret;
 }
-
-
@@ -29,6 +29,8 @@
 #include <linux/pf_q.h>
 #include <linux/filter.h>
 #include <linux/spinlock.h>
+#include <linux/rcupdate.h>
+#include <linux/bitmap.h>
 
 #include <linux/pf_q-fun.h>
 
@@ -43,38 +45,106 @@ struct pfq_group
     int policy;                             /* policy for the group */
     int pid;	                            /* process id for restricted/private group */
 
-	atomic_long_t sock_mask[Q_CLASS_MAX];   /* for class: Q_CLASS_DATA, Q_CLASS_CONTROL, etc... */
+	unsigned long sock_mask[Q_CLASS_MAX][BITS_TO_LONGS(Q_MAX_ID)];  /* for class: Q_CLASS_DATA, Q_CLASS_CONTROL, etc... */
 
-    struct fun_context fun_ctx[Q_FUN_MAX+1]; /* sk_function_t, void *context pair */
+    struct fun_context fun_ctx[Q_FUN_MAX];   /* sk_function_t, void *context pair */
 
-    atomic_long_t filter; 					/* struct sk_filter pointer */
+    struct pfq_computation __rcu *comp;     /* sealed fun_ctx (see pfq_run_batch) */
+
+    struct sk_filter __rcu *filter;         /* BPF filter */
+    int    fprog_mode;                      /* Q_FPROG_NONE, Q_FPROG_INTERP or Q_FPROG_JIT */
+
+    struct pfq_reta __rcu *reta;            /* indirection table of steering (optional) */
+
+    unsigned char weight[Q_MAX_ID];         /* steering weights of sockets (1..Q_MAX_WEIGHT) */
+    unsigned int  weight_gen;               /* bumped on every change of weights */
+
+    int          elephant_policy;           /* Q_ELEPHANT_PIN, Q_ELEPHANT_SPLIT or Q_ELEPHANT_REHOME */
+    unsigned int elephant_pps;              /* elephant threshold (0: disabled) */
 
     bool   vlan_filt;                       /* enable/disable vlan filtering */
     char   vid_filters[4096];               /* vlan filters */
 
-	sparse_counter_t recv;
-	sparse_counter_t lost;
-	sparse_counter_t drop;
+	pfq_kstat_t stats;                      /* per-cpu counters (see pfq_groups_init) */
 };
 
 
 extern struct pfq_group pfq_groups[Q_MAX_GROUP];
 
+/* number of words of group bitmaps in use: 1 as long as gid < BITS_PER_LONG */
+
+extern int pfq_group_words;
+
+int  pfq_groups_init(void);
+void pfq_groups_free(void);
+
 int  pfq_join_free_group(int id, unsigned long class_mask, int policy);
 int  pfq_join_group(int gid, int id, unsigned long class_mask, int policy);
 int  pfq_leave_group(int gid, int id);
 void pfq_leave_all_groups(int id);
 
-unsigned long pfq_get_groups(int id);
-unsigned long __pfq_get_all_groups_mask(int gid);
+void pfq_get_groups(int id, unsigned long *mask);
 
 bool __pfq_group_access(int gid, int id, int policy, bool join);
-int  __pfq_set_group_function(int gid, sk_function_t fun, int level);
-int  __pfq_set_group_context(int gid, void *context, int level);
-int  __pfq_get_group_context(int gid, int level, int size, void __user *context);
-void __pfq_reset_group_functx(int gid);
-void __pfq_set_group_filter(int gid, struct sk_filter *filter);
-void __pfq_dismiss_function(sk_function_t f);
+int  pfq_set_group_function(int gid, const struct sk_function_descr *descr, int level);
+int  pfq_set_group_context(int gid, void *context, size_t size, int level);
+int  pfq_get_group_context(int gid, int level, int size, void __user *context);
+void pfq_reset_group_functx(int gid);
+void pfq_set_group_filter(int gid, struct sk_filter *filter);
+void pfq_dismiss_function(sk_function_t f);
+
+
+/* function contexts: released after the RCU grace period */
+
+struct pfq_context
+{
+    struct rcu_head rcu;
+    size_t          size;
+    char            data[0] __attribute__((aligned(8)));
+};
+
+void * pfq_context_alloc(size_t size);
+void   pfq_context_free(void *context);
+
+/* per-cpu contexts: the replicas are released after the RCU grace period */
+
+struct pfq_percpu_context
+{
+    struct rcu_head rcu;
+    void __percpu * data;
+    size_t          size;
+    sk_merge_t      merge;
+};
+
+struct pfq_percpu_context * pfq_percpu_context_alloc(size_t size, sk_merge_t merge);
+void   pfq_percpu_context_free(struct pfq_percpu_context *ctx);
+
+void   pfq_computation_free(struct pfq_computation *comp);
+
+
+/* indirection table: released after the RCU grace period */
+
+struct pfq_reta
+{
+    struct rcu_head rcu;
+    unsigned int    size;                   /* power of 2 */
+    int             sock[0];
+};
+
+static inline bool
+pfq_reta_valid_size(int size)
+{
+        return size > 0 && size <= Q_RETA_MAX && (size & (size - 1)) == 0;
+}
+
+struct pfq_reta * pfq_reta_alloc(unsigned int size);   /* size must be valid */
+
+int  pfq_set_group_reta(int gid, struct pfq_reta *reta);
+int  pfq_get_group_reta(int gid, int *sock, int size);
+
+int  pfq_set_group_weight(int gid, int id, int weight);
+int  pfq_set_group_elephant(int gid, int policy, unsigned int pps);
+void pfq_get_group_elephant(int gid, int *policy, unsigned int *pps);
 
 
 static inline
@@ -111,14 +181,26 @@ void __pfq_set_group_vlan_filter(int gid, bool value, int vid)
 static inline
 bool __pfq_group_is_empty(int gid)
 {
-	return __pfq_get_all_groups_mask(gid) == 0;
+        int i;
+        for(i = 0; i < Q_CLASS_MAX; i++)
+        {
+                if (!bitmap_empty(pfq_groups[gid].sock_mask[i], Q_MAX_ID))
+                        return false;
+        }
+        return true;
 }
 
 
 static inline
 bool __pfq_has_joined_group(int gid, int id)
 {
-	return __pfq_get_all_groups_mask(gid) & (1L << id);
+        int i;
+        for(i = 0; i < Q_CLASS_MAX; i++)
+        {
+                if (test_bit(id, pfq_groups[gid].sock_mask[i]))
+                        return true;
+        }
+        return false;
 }
 
 #endif /* _PF_Q_GROUP_H_ */
@@ -26,17 +26,39 @@
 #define _PFQ_MEMORY_H_
 
 #include <linux/skbuff.h>
+#include <linux/hrtimer.h>
+#include <linux/interrupt.h>
+#include <linux/pf_q-fun.h>
+
+#include <pf_q-queue.h>
+#include <pf_q-flow.h>
 
 /* per-cpu data... */
 
 struct local_data
 {
-        unsigned long           eligible_mask;
-        unsigned long           sock_mask [Q_MAX_ID];
+        unsigned long           eligible_mask[BITS_TO_LONGS(Q_MAX_ID)];
+        unsigned char           sock_id [Q_MAX_ID * Q_MAX_WEIGHT];  /* weighted steering table (ids < 256) */
         int                     sock_cnt;
+        int                     sock_gid;                       /* group and weight generation of the table */
+        unsigned int            sock_gen;
+        struct pfq_flow_table * flows;                          /* flow table of this cpu (see pfq_balance) */
+        unsigned long           sock_queue [Q_MAX_ID];          /* per-socket batch bitmaps */
+        unsigned long           load_mask[BITS_TO_LONGS(Q_MAX_ID)]; /* sockets with a sampled load (see pfq_balance) */
+        unsigned int            load_len [Q_MAX_ID];            /* estimated occupancy of their queues */
+        unsigned int            load_cap [Q_MAX_ID];            /* capacity of their queues, times the weight */
         int 			        flowctrl;
         struct pfq_queue_skb    prefetch_queue;
+        struct pfq_dissect      dissect[PFQ_QUEUE_MAX_LEN];     /* per-packet header cache (see pfq_skb_dissect) */
+        ret_t                   ret[PFQ_QUEUE_MAX_LEN];         /* per-packet results of the batch computation */
         struct sk_buff_head     recycle_list;
+
+        struct hrtimer          flush_timer;                    /* bounds the latency of a partial batch */
+        struct tasklet_struct   flush_tasklet;
+        unsigned long           batch_cnt;                      /* full batches processed */
+        unsigned long           flush_cnt;                      /* partial batches flushed on timeout */
+        int                     batch_len;                      /* adaptive batch length (see pfq_batch_len) */
+        u64                     batch_start;                    /* arrival of the first packet of the batch */
 };
 
 
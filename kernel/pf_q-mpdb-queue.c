@@ -22,9 +22,108 @@
  *
  ****************************************************************/
 
+#include <linux/vmalloc.h>
+#include <linux/mm.h>
+#include <linux/hugetlb.h>
+#include <linux/sched.h>
+
 #include <pf_q-mpdb-queue.h>
 #include <linux/pf_q-fun.h>
 
+/* the memory of the process must be covered by hugetlb mappings */
+
+bool mpdb_queue_hugetlb(void __user *addr, size_t size)
+{
+	unsigned long start = (unsigned long)addr, end = start + size;
+	struct vm_area_struct *vma;
+	bool ret = true;
+
+	down_read(&current->mm->mmap_sem);
+
+	while (start < end)
+	{
+		vma = find_vma(current->mm, start);
+		if (vma == NULL || vma->vm_start > start || !is_vm_hugetlb_page(vma)) {
+			ret = false;
+			break;
+		}
+		start = vma->vm_end;
+	}
+
+	up_read(&current->mm->mmap_sem);
+	return ret;
+}
+
+
+/* pin the hugepages of the process and map them in the kernel */
+
+static void * mpdb_queue_pin(struct pfq_opt *pq, size_t queue_mem, size_t *tot_mem)
+{
+	size_t nr_pages = PAGE_ALIGN(queue_mem) >> PAGE_SHIFT;
+	struct page **pages;
+	void *addr;
+	int n, pinned;
+
+	if (pq->user_size < (nr_pages << PAGE_SHIFT)) {
+		pr_devel("[PFQ|%d] hugepages: %lu bytes, %lu required!\n", pq->id, pq->user_size, nr_pages << PAGE_SHIFT);
+		return NULL;
+	}
+
+	if (!mpdb_queue_hugetlb(pq->user_addr, nr_pages << PAGE_SHIFT)) {
+		printk(KERN_WARNING "[PFQ|%d] hugepages: the queue memory is not hugetlb backed!\n", pq->id);
+		return NULL;
+	}
+
+	pages = vmalloc(nr_pages * sizeof(struct page *));
+	if (pages == NULL)
+		return NULL;
+
+	pinned = get_user_pages_fast((unsigned long)pq->user_addr, nr_pages, 1, pages);
+
+	if (pinned != nr_pages) {
+		printk(KERN_WARNING "[PFQ|%d] hugepages: could not pin the queue (%d/%lu pages)!\n", pq->id, pinned, nr_pages);
+		goto err;
+	}
+
+	addr = vmap(pages, nr_pages, VM_MAP, PAGE_KERNEL);
+	if (addr == NULL)
+		goto err;
+
+	memset(addr, 0, nr_pages << PAGE_SHIFT);
+
+	pq->pages    = pages;
+	pq->nr_pages = nr_pages;
+	*tot_mem     = nr_pages << PAGE_SHIFT;
+
+	pr_devel("[PFQ|%d] queue caplen:%lu mem:%lu (hugepages)\n", pq->id, pq->caplen, *tot_mem);
+	return addr;
+err:
+	for(n = 0; n < pinned; n++)
+		put_page(pages[n]);
+	vfree(pages);
+	return NULL;
+}
+
+
+static void mpdb_queue_unpin(struct pfq_opt *pq)
+{
+	size_t n;
+
+	vunmap(pq->addr);
+
+	for(n = 0; n < pq->nr_pages; n++)
+	{
+		set_page_dirty_lock(pq->pages[n]);
+		put_page(pq->pages[n]);
+	}
+
+	vfree(pq->pages);
+
+	pq->pages    = NULL;
+	pq->nr_pages = 0;
+}
+
+
 void * mpdb_queue_alloc(struct pfq_opt *pq, size_t queue_mem, size_t *tot_mem)
 {
 	/* calculate the size of the buffer */
@@ -38,9 +137,22 @@ void * mpdb_queue_alloc(struct pfq_opt *pq, size_t queue_mem, size_t *tot_mem)
 	num_pages += (num_pages + (PAGE_SIZE-1)) & (PAGE_SIZE-1);
 	*tot_mem = num_pages*PAGE_SIZE;
 
+	if (pq->user_addr) {
+		addr = mpdb_queue_pin(pq, tm, tot_mem);
+		if (addr == NULL)
+			*tot_mem = 0;
+		return addr;
+	}
+
 	/* Memory is already zeroed */
 
-        addr = vmalloc_user(*tot_mem);
+	pq->queue_node = pq->numa_node == Q_NUMA_LOCAL ? numa_node_id() : pq->numa_node;
+
+	if (pq->queue_node == Q_NUMA_ANY)
+		addr = vmalloc_user(*tot_mem);
+	else
+		addr = vzalloc_node(*tot_mem, pq->queue_node);   /* not VM_USERMAP: see pfq_mmap */
+
 	if (addr == NULL)
 	{
 		printk(KERN_WARNING "[PFQ|%d] pfq_queue_alloc: out of memory!", pq->id);
@@ -48,16 +160,30 @@ void * mpdb_queue_alloc(struct pfq_opt *pq, size_t queue_mem, size_t *tot_mem)
 		return NULL;
 	}
 
-	pr_devel("[PFQ|%d] queue caplen:%lu mem:%lu\n", pq->id, pq->caplen, *tot_mem);
+	pr_devel("[PFQ|%d] queue caplen:%lu mem:%lu node:%d\n", pq->id, pq->caplen, *tot_mem, pq->queue_node);
 	return addr;
 }
 
 
+/* node of the queue memory (of the first page) */
+
+int mpdb_queue_node(struct pfq_opt *pq)
+{
+	if (!pq->addr)
+		return pq->numa_node;
+
+	return page_to_nid(pq->pages ? pq->pages[0] : vmalloc_to_page(pq->addr));
+}
+
+
 void mpdb_queue_free(struct pfq_opt *pq)
 {
 	if (pq->addr) {
 		pr_devel("[PFQ|%d] queue freed.\n", pq->id);
-		vfree(pq->addr);
+		if (pq->pages)
+			mpdb_queue_unpin(pq);
+		else
+			vfree(pq->addr);
 
 		pq->addr = NULL;
 		pq->queue_mem = 0;
@@ -80,108 +206,239 @@ void *pfq_memcpy(void *to, const void *from, size_t len)
 
 
 inline
-char *mpdb_slot_ptr(struct pfq_opt *pq, struct pfq_queue_descr *qd, int index, int slot)
+char *mpdb_buffer_ptr(struct pfq_opt *pq, int ring, int index)
 {
-	return (char *)(qd+1) + ((index&1) * pq->slots + slot) * pq->slot_size;
+	return (char *)mpdb_queue_descr(pq, pq->rings) + ((ring << 1) + (index&1)) * mpdb_queue_size(pq);
 }
 
 
-size_t mpdb_enqueue_batch(struct pfq_opt *pq, unsigned long bitqueue, int burst_len, struct pfq_queue_skb *skbs, int gid)
+inline
+char *mpdb_slot_ptr(struct pfq_opt *pq, int ring, int index, int slot)
+{
+	return mpdb_buffer_ptr(pq, ring, index) + slot * pq->slot_size;
+}
+
+
+static inline
+unsigned int mpdb_caplen(struct pfq_opt *pq, struct sk_buff *skb)
+{
+	return likely (skb->len > (int)pq->offset) ? min((int)skb->len - (int)pq->offset, (int)pq->caplen) : 0;
+}
+
+
+/* copy the packet, fill the header and commit the slot */
+
+static inline
+bool mpdb_commit_slot(struct pfq_opt *pq, char *this_slot, struct sk_buff *skb, unsigned int bytes, int gid, int q_index)
+{
+	volatile struct pfq_hdr *hdr = (struct pfq_hdr *)this_slot;
+	char                    *pkt = (char *)(hdr+1);
+
+	struct timespec ts;
+
+	/* copy bytes of packet */
+
+	if (likely(bytes))
+	{
+		/* packets might still come from a regular sniffer */
+
+		if (
+#ifdef PFQ_USE_SKB_LINEARIZE
+		   	unlikely(skb_is_nonlinear(skb))
+#else
+	           	skb_is_nonlinear(skb)
+#endif
+		   )
+	      	{
+			if (skb_copy_bits(skb, (int)pq->offset, pkt, bytes) != 0)
+			{
+				printk(KERN_WARNING "[PFQ] BUG! skb_copy_bits failed (bytes=%u, skb_len=%d mac_len=%d q_offset=%lu)!\n",
+						    bytes, skb->len, skb->mac_len, pq->offset);
+				return false;
+			}
+		}
+		else
+		{
+			pfq_memcpy(pkt, skb->data + pq->offset, bytes);
+		}
+	}
+
+        /* copy state from pfq_annotation */
+
+        hdr->data = pfq_skb_annotation(skb)->state;
+
+	/* setup the header */
+
+	if (pq->tstamp != 0)
+	{
+		skb_get_timestampns(skb, &ts);
+		hdr->tstamp.tv.sec  = (uint32_t)ts.tv_sec;
+		hdr->tstamp.tv.nsec = (uint32_t)ts.tv_nsec;
+	}
+
+	hdr->if_index    = skb->dev->ifindex & 0xff;
+	hdr->gid         = gid;
+
+	hdr->len         = (uint16_t)skb->len;
+	hdr->caplen 	 = (uint16_t)bytes;
+	hdr->un.vlan_tci = skb->vlan_tci & ~VLAN_TAG_PRESENT;
+	hdr->hw_queue    = (uint8_t)(skb_get_rx_queue(skb) & 0xff);
+
+	/* commit the slot (release semantic) */
+
+	smp_wmb();
+
+	hdr->commit = (uint8_t)q_index;
+	return true;
+}
+
+
+/* Q_LAYOUT_VARLEN: the units reserved for a packet that could not be copied
+ * are committed anyway, so that the consumer steps over them: caplen keeps
+ * the stride, len 0 marks the packet as dropped.
+ */
+
+static inline
+void mpdb_commit_drop(char *this_slot, struct sk_buff *skb, unsigned int bytes, int gid, int q_index)
 {
-	struct pfq_queue_descr *queue_descr = (struct pfq_queue_descr *)pq->addr;
-	int data, q_len, q_index;
+	volatile struct pfq_hdr *hdr = (struct pfq_hdr *)this_slot;
+
+	hdr->data        = 0;
+	hdr->tstamp.tv64 = 0;
+	hdr->if_index    = skb->dev->ifindex & 0xff;
+	hdr->gid         = gid;
+	hdr->len         = 0;
+	hdr->caplen      = (uint16_t)bytes;
+	hdr->un.vlan_tci = 0;
+	hdr->hw_queue    = 0;
+
+	smp_wmb();
+
+	hdr->commit = (uint8_t)q_index;
+}
+
+
+/* Q_LAYOUT_VARLEN: the batch reserves the units of the packets that fit in
+ * the buffer (compare and swap), so that the consumer never waits for a
+ * unit that is not going to be filled.
+ */
+
+static
+size_t mpdb_enqueue_varlen(struct pfq_opt *pq, struct pfq_queue_descr *queue_descr, int ring,
+			   unsigned long bitqueue, struct pfq_queue_skb *skbs, int gid)
+{
+	const size_t align = MPDB_QUEUE_SLOT_ALIGN(pq->layout);
+	const size_t capacity = mpdb_queue_capacity(pq);
+	int data, q_len, q_index, need, used;
+	unsigned long mask;
 	struct sk_buff *skb;
 	size_t sent = 0;
 	unsigned int n;
 	char *this_slot;
 
-	data = atomic_read((atomic_t *)&queue_descr->data);
+	do
+	{
+		data  = atomic_read((atomic_t *)&queue_descr->data);
+		q_len = MPDB_QUEUE_LEN(data);
+		need  = 0;
+		mask  = bitqueue;
 
-        if (unlikely(MPDB_QUEUE_LEN(data) > pq->slots))
-		return 0;
+		queue_for_each_bitmask(skb, mask, n, skbs)
+		{
+			int units = MPDB_VARLEN_STRIDE(mpdb_caplen(pq, skb), align) / align;
+			if (q_len + need + units > capacity)
+				break;
+			need += units;
+		}
 
-	data = atomic_add_return(burst_len, (atomic_t *)&queue_descr->data);
+		if (unlikely(need == 0))
+		{
+			if (mpdb_queue_descr(pq, 0)->poll_wait)
+				wake_up_interruptible(&pq->waitqueue);
+			return 0;
+		}
+	}
+	while (atomic_cmpxchg((atomic_t *)&queue_descr->data, data, data + need) != data);
 
-	q_len     = MPDB_QUEUE_LEN(data) - burst_len;
 	q_index   = MPDB_QUEUE_INDEX(data);
-        this_slot = mpdb_slot_ptr(pq, queue_descr, q_index, q_len);
+	this_slot = mpdb_buffer_ptr(pq, ring, q_index) + q_len * align;
 
-	queue_for_each_bitmask(skb, bitqueue, n, skbs)
+	for(used = 0, mask = bitqueue; used < need; )
 	{
-		unsigned int bytes = likely (skb->len > (int)pq->offset) ? min((int)skb->len - (int)pq->offset, (int)pq->caplen) : 0;
+		unsigned int bytes;
 
-		size_t slot_index = q_len + sent;
+		n     = pfq_ctz(mask);
+		skb   = skbs->queue[n];
+		mask ^= 1UL << n;
+		bytes = mpdb_caplen(pq, skb);
 
-		volatile struct pfq_hdr *hdr = (struct pfq_hdr *)this_slot;
-		char                    *pkt = (char *)(hdr+1);
+		if (likely(mpdb_commit_slot(pq, this_slot, skb, bytes, gid, q_index)))
+			sent++;
+		else
+			mpdb_commit_drop(this_slot, skb, bytes, gid, q_index);
 
-		struct timespec ts;
+		used      += MPDB_VARLEN_STRIDE(bytes, align) / align;
+		this_slot += MPDB_VARLEN_STRIDE(bytes, align);
+	}
 
-		if (unlikely(slot_index > pq->slots))
-		{
-			if ( queue_descr->poll_wait ) {
-				wake_up_interruptible(&pq->waitqueue);
-			}
-			return sent;
-		}
+	/* wake up the consumer when the buffer crosses the watermark */
 
-		/* copy bytes of packet */
+	if (q_len < (capacity >> 1) && (q_len + need) >= (capacity >> 1) &&
+	    mpdb_queue_descr(pq, 0)->poll_wait)
+	{
+		wake_up_interruptible(&pq->waitqueue);
+	}
 
-		if (likely(bytes))
-		{
-			/* packets might still come from a regular sniffer */
+	return sent;
+}
 
-			if (
-#ifdef PFQ_USE_SKB_LINEARIZE
-			   	unlikely(skb_is_nonlinear(skb))
-#else
-		           	skb_is_nonlinear(skb)
-#endif
-			   )
-		      	{
-				if (skb_copy_bits(skb, (int)pq->offset, pkt, bytes) != 0)
-				{
-					printk(KERN_WARNING "[PFQ] BUG! skb_copy_bits failed (bytes=%u, skb_len=%d mac_len=%d q_offset=%lu)!\n",
-							    bytes, skb->len, skb->mac_len, pq->offset);
-					return 0;
-				}
-			}
-			else
-			{
-				pfq_memcpy(pkt, skb->data + pq->offset, bytes);
-			}
-		}
 
-                /* copy state from pfq_annotation */
+size_t mpdb_enqueue_batch(struct pfq_opt *pq, unsigned long bitqueue, int burst_len, struct pfq_queue_skb *skbs, int gid)
+{
+	struct pfq_queue_descr *queue_descr;
+	int data, q_len, q_index, ring;
+	struct sk_buff *skb;
+	size_t sent = 0;
+	unsigned int n;
+	char *this_slot;
+
+	/* every cpu reserves the slots in its own ring */
 
-                hdr->data = pfq_skb_annotation(skb)->state;
+	ring = likely(pq->rings == 1) ? 0 : smp_processor_id() % pq->rings;
+	queue_descr = mpdb_queue_descr(pq, ring);
 
-		/* setup the header */
+	if (pq->layout & Q_LAYOUT_VARLEN)
+		return mpdb_enqueue_varlen(pq, queue_descr, ring, bitqueue, skbs, gid);
 
-		if (pq->tstamp != 0)
-		{
-			skb_get_timestampns(skb, &ts);
-			hdr->tstamp.tv.sec  = (uint32_t)ts.tv_sec;
-			hdr->tstamp.tv.nsec = (uint32_t)ts.tv_nsec;
-		}
+	data = atomic_read((atomic_t *)&queue_descr->data);
 
-		hdr->if_index    = skb->dev->ifindex & 0xff;
-		hdr->gid         = gid;
+        if (unlikely(MPDB_QUEUE_LEN(data) > pq->slots))
+		return 0;
+
+	data = atomic_add_return(burst_len, (atomic_t *)&queue_descr->data);
 
-		hdr->len         = (uint16_t)skb->len;
-		hdr->caplen 	 = (uint16_t)bytes;
-		hdr->un.vlan_tci = skb->vlan_tci & ~VLAN_TAG_PRESENT;
-		hdr->hw_queue    = (uint8_t)(skb_get_rx_queue(skb) & 0xff);
+	q_len     = MPDB_QUEUE_LEN(data) - burst_len;
+	q_index   = MPDB_QUEUE_INDEX(data);
+        this_slot = mpdb_slot_ptr(pq, ring, q_index, q_len);
 
-		/* commit the slot (release semantic) */
+	queue_for_each_bitmask(skb, bitqueue, n, skbs)
+	{
+		size_t slot_index = q_len + sent;
 
-		smp_wmb();
+		if (unlikely(slot_index >= pq->slots))
+		{
+			if ( mpdb_queue_descr(pq, 0)->poll_wait ) {
+				wake_up_interruptible(&pq->waitqueue);
+			}
+			return sent;
+		}
 
-		hdr->commit = (uint8_t)q_index;
+		if (!mpdb_commit_slot(pq, this_slot, skb, mpdb_caplen(pq, skb), gid, q_index))
+			return 0;
 
 		if (unlikely((slot_index & 16383) == 0) &&
 			     (slot_index >= (pq->slots >> 1)) &&
-			     queue_descr->poll_wait)
+			     mpdb_queue_descr(pq, 0)->poll_wait)
 		{
 		        wake_up_interruptible(&pq->waitqueue);
 		}
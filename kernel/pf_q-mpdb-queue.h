@@ -37,21 +37,52 @@ extern bool   mpdb_enqueue(struct pfq_opt *pq, struct sk_buff *skb);
 extern size_t mpdb_enqueue_batch(struct pfq_opt *pq, unsigned long queue_mask, int len, struct pfq_queue_skb *skbs, int gid);
 extern void * mpdb_queue_alloc(struct pfq_opt *pq, size_t queue_mem, size_t * tot_mem);
 extern void   mpdb_queue_free(struct pfq_opt *pq);
+extern int    mpdb_queue_node(struct pfq_opt *pq);
+extern bool   mpdb_queue_hugetlb(void __user *addr, size_t size);
 
 
+static inline
+struct pfq_queue_descr *mpdb_queue_descr(struct pfq_opt *p, int ring)
+{
+    return (struct pfq_queue_descr *)p->addr + ring;
+}
+
+
+/* packets in the queue (all rings) */
+
 static inline
 size_t mpdb_queue_len(struct pfq_opt *p)
 {
-    struct pfq_queue_descr *qd = (struct pfq_queue_descr *)p->addr;
-    return MPDB_QUEUE_LEN(qd->data);
+    size_t n, len = 0;
+    for(n = 0; n < p->rings; n++)
+        len += MPDB_QUEUE_LEN(mpdb_queue_descr(p, n)->data);
+    return len;
+}
+
+
+/* packets in the fullest ring (poll watermark) */
+
+static inline
+size_t mpdb_queue_max_len(struct pfq_opt *p)
+{
+    size_t n, len = 0;
+    for(n = 0; n < p->rings; n++)
+        len = max_t(size_t, len, MPDB_QUEUE_LEN(mpdb_queue_descr(p, n)->data));
+    return len;
 }
 
 
 static inline
-int mpdb_queue_index(struct pfq_opt *p)
+int mpdb_queue_index(struct pfq_opt *p, int ring)
 {
-    struct pfq_queue_descr *qd = (struct pfq_queue_descr *)p->addr;
-    return MPDB_QUEUE_INDEX(qd->data) & 1;
+    return MPDB_QUEUE_INDEX(mpdb_queue_descr(p, ring)->data) & 1;
+}
+
+
+static inline
+size_t mpdb_slot_size(struct pfq_opt *pq)
+{
+    return MPDB_VARLEN_STRIDE(pq->caplen, MPDB_QUEUE_SLOT_ALIGN(pq->layout));
 }
 
 
@@ -62,10 +93,22 @@ size_t mpdb_queue_size(struct pfq_opt *pq)
 }
 
 
+/* length of a buffer, in the unit of MPDB_QUEUE_LEN: slots, or alignment
+ * units with Q_LAYOUT_VARLEN */
+
+static inline
+size_t mpdb_queue_capacity(struct pfq_opt *pq)
+{
+    if (pq->layout & Q_LAYOUT_VARLEN)
+        return mpdb_queue_size(pq) / MPDB_QUEUE_SLOT_ALIGN(pq->layout);
+    return pq->slots;
+}
+
+
 static inline
 size_t mpdb_queue_tot_mem(struct pfq_opt *pq)
 {
-    return sizeof(struct pfq_queue_descr) + mpdb_queue_size(pq) * 2;
+    return (sizeof(struct pfq_queue_descr) + mpdb_queue_size(pq) * 2) * pq->rings;
 }
 
 #endif /* _MPDB_QUEUE_H_ */
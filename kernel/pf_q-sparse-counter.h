@@ -25,80 +25,97 @@
 #ifndef _SPARSE_COUNTER_H_
 #define _SPARSE_COUNTER_H_
 
-#include <linux/smp.h> /* get_cpu */
+#include <linux/percpu.h>
+#include <linux/errno.h>
 
-#define MAX_CPU_CTX     64
+/* per-cpu counter: one long per possible cpu, packed in the per-cpu areas */
 
-typedef struct { long value; } __attribute__((aligned(128))) __counter_t;
+typedef struct { long __percpu *value; } sparse_counter_t;
 
-typedef struct { __counter_t ctx[MAX_CPU_CTX]; } sparse_counter_t;
 
+static inline
+int sparse_counter_init(sparse_counter_t *sc)
+{
+    sc->value = alloc_percpu(long);
+    return sc->value ? 0 : -ENOMEM;
+}
+
+static inline
+void sparse_counter_free(sparse_counter_t *sc)
+{
+    free_percpu(sc->value);
+    sc->value = NULL;
+}
+
+
+/* preemption (or softirq) must be disabled by the caller */
 
 static inline
-void __sparse_inc(sparse_counter_t *sc, int cpu)
+void __sparse_inc(sparse_counter_t *sc)
 {
-    sc->ctx[cpu].value++;
+    __this_cpu_inc(*sc->value);
 }
 
 static inline
-void __sparse_dec(sparse_counter_t *sc, int cpu)
+void __sparse_dec(sparse_counter_t *sc)
 {
-    sc->ctx[cpu].value--;
+    __this_cpu_dec(*sc->value);
 }
 
 static inline
-void __sparse_add(sparse_counter_t *sc, int cpu, long n)
+void __sparse_add(sparse_counter_t *sc, long n)
 {
-    sc->ctx[cpu].value += n;
+    __this_cpu_add(*sc->value, n);
 }
 
 static inline
-void __sparse_sub(sparse_counter_t *sc, int cpu, long n)
+void __sparse_sub(sparse_counter_t *sc, long n)
 {
-    sc->ctx[cpu].value -= n;
+    __this_cpu_sub(*sc->value, n);
 }
 
 
 static inline
 void sparse_inc(sparse_counter_t *sc)
 {
-    sc->ctx[get_cpu() % MAX_CPU_CTX].value++;
+    this_cpu_inc(*sc->value);
 }
 
 static inline
 void sparse_dec(sparse_counter_t *sc)
 {
-    sc->ctx[get_cpu() % MAX_CPU_CTX].value--;
+    this_cpu_dec(*sc->value);
 }
 
 static inline
 void sparse_add(sparse_counter_t *sc, long n)
 {
-    sc->ctx[get_cpu() % MAX_CPU_CTX].value += n;
+    this_cpu_add(*sc->value, n);
 }
 
 static inline
 void sparse_sub(sparse_counter_t *sc, long n)
 {
-    sc->ctx[get_cpu() % MAX_CPU_CTX].value -= n;
+    this_cpu_sub(*sc->value, n);
 }
 
 
 static inline
 void sparse_set(sparse_counter_t *sc, long n)
 {
-    unsigned int i, me = get_cpu();
-    for(i = 0; i < MAX_CPU_CTX; i++) {
-        ((volatile __counter_t *)&sc->ctx[i])->value = (i == me ? n : 0);
+    int cpu;
+    for_each_possible_cpu(cpu) {
+        *per_cpu_ptr(sc->value, cpu) = 0;
     }
+    this_cpu_add(*sc->value, n);
 }
 
 static inline
 long sparse_read(sparse_counter_t *sc)
 {
-    long ret = 0; int i;
-    for(i=0; i < MAX_CPU_CTX; i++) {
-        ret += ((volatile __counter_t *)&sc->ctx[i])->value;
+    long ret = 0; int cpu;
+    for_each_possible_cpu(cpu) {
+        ret += ACCESS_ONCE(*per_cpu_ptr(sc->value, cpu));
     }
     return ret;
 }
@@ -38,6 +38,7 @@
 #include <linux/etherdevice.h>
 
 #include <linux/percpu.h>
+#include <linux/vmalloc.h>
 
 #include <net/sock.h>
 #ifdef CONFIG_INET
@@ -56,6 +57,7 @@
 #include <pf_q-memory.h>
 
 #include <pf_q-mpdb-queue.h>
+#include <pf_q-flow.h>
 
 struct net_proto_family  pfq_family_ops;
 struct packet_type       pfq_prot_hook;
@@ -73,6 +75,9 @@ static int cap_len      = 1514;
 static int prefetch_len = 1;
 static int flow_control = 0;
 static int vl_untag     = 0;
+static int flush_timeout = 100;  // usec
+static int prefetch_min = 1;
+static int prefetch_max = 0;     // 0 = adaptive batch disabled (prefetch_len)
 
 int recycle_len  = 1024;
 
@@ -94,6 +99,9 @@ module_param(prefetch_len,    int, 0644);
 module_param(recycle_len,     int, 0644);
 module_param(flow_control,    int, 0644);
 module_param(vl_untag,        int, 0644);
+module_param(flush_timeout,   int, 0644);
+module_param(prefetch_min,    int, 0644);
+module_param(prefetch_max,    int, 0644);
 
 MODULE_PARM_DESC(direct_capture," Direct capture packets: (0 default)");
 MODULE_PARM_DESC(capture_incoming," Sniff incoming packets: (1 default)");
@@ -106,11 +114,18 @@ MODULE_PARM_DESC(prefetch_len,  " Prefetch queue length");
 MODULE_PARM_DESC(recycle_len,   " Recycle skb list (default=1024)");
 MODULE_PARM_DESC(flow_control,  " Flow control value (default=0)");
 MODULE_PARM_DESC(vl_untag,      " Enable vlan untagging (default=0)");
+MODULE_PARM_DESC(flush_timeout, " Max delay of a partial prefetch batch, usec (default=100, 0 = disabled)");
+MODULE_PARM_DESC(prefetch_min,  " Adaptive prefetch: min batch length (default=1)");
+MODULE_PARM_DESC(prefetch_max,  " Adaptive prefetch: max batch length (default=0, adaptive batch disabled)");
 
 /* vector of pointers to pfq_opt */
 
 atomic_long_t pfq_vector[Q_MAX_ID];
 
+/* number of words spanned by the allocated ids (grows only) */
+
+int pfq_id_words = 1;
+
 /* timestamp toggle */
 
 atomic_t timestamp_toggle;
@@ -135,7 +150,14 @@ int pfq_get_free_id(struct pfq_opt * pq)
         for(; n < Q_MAX_ID; n++)
         {
                 if (!atomic_long_cmpxchg(pfq_vector + n, 0, (long)pq))
+                {
+                        int old, words = BITS_TO_LONGS(n+1);
+
+                        while ((old = ACCESS_ONCE(pfq_id_words)) < words)
+                                cmpxchg(&pfq_id_words, old, words);
+
                         return n;
+                }
         }
         return -1;
 }
@@ -183,11 +205,11 @@ bool pfq_copy_to_user_skbs(struct pfq_opt *pq, int cpu, unsigned long sock_queue
                 len  = (int)hweight64(sock_queue);
                 sent = mpdb_enqueue_batch(pq, sock_queue, len, skbs, gid);
 
-        	__sparse_add(&pq->stat.recv, cpu, sent);
+        	__sparse_add(&pq->stat.recv, sent);
 
 		if (len > sent)
 		{
-			__sparse_add(&pq->stat.lost, cpu, len - sent);
+			__sparse_add(&pq->stat.lost, len - sent);
 			return false;
 		}
         }
@@ -229,12 +251,13 @@ __pfq_netdev_alloc_skb(struct net_device *dev, unsigned int length, gfp_t gfp)
 /* send this packet to selected sockets */
 
 inline
-void pfq_sock_mask_to_queue(unsigned long j, unsigned long mask, unsigned long *sock_queue)
+void pfq_sock_mask_to_queue(unsigned long j, const unsigned long *mask, int words, unsigned long *sock_queue)
 {
-	unsigned long bit;
-       	bitwise_foreach(mask, bit)
+	unsigned long word;
+        int w, index;
+
+       	pfq_bitmap_foreach(mask, words, w, word, index)
 	{
-	        int index = pfq_ctz(bit);
                 sock_queue[index] |= 1UL << j;
         }
 }
@@ -319,124 +342,222 @@ unsigned int pfq_fold(unsigned int a, unsigned int b)
 }
 
 
+/* weighted steering table of the eligible sockets: ids are interleaved
+ * round by round, each one appearing as many times as its weight.
+ */
 
-int
-pfq_receive(struct napi_struct *napi, struct sk_buff *skb, int direct)
+static void
+pfq_steer_table(struct local_data *local_cache, int gid, const unsigned long *eligible_mask, int id_words, unsigned int gen)
 {
-        struct local_data * local_cache = __this_cpu_ptr(cpu_data);
-        struct pfq_queue_skb * prefetch_queue = &local_cache->prefetch_queue;
-        unsigned long group_mask, socket_mask;
-        unsigned long sock_queue[sizeof(unsigned long) << 3];
-        struct pfq_annotation *cb;
-        long unsigned n, bit, lb;
-        int cpu;
-
-#ifdef PFQ_USE_FLOW_CONTROL
+        unsigned long eword;
+        int ew, id, round, cnt = 0;
 
-	/* flow control */
+        memcpy(local_cache->eligible_mask, eligible_mask, id_words * sizeof(unsigned long));
 
-	if (local_cache->flowctrl &&
-	    local_cache->flowctrl--)
-	{
-                if (direct)
-                        pfq_kfree_skb_recycle(skb, &local_cache->recycle_list);
-                else
-                        kfree_skb(skb);
+        for(round = 0; round < Q_MAX_WEIGHT; round++)
+        {
+                int prev = cnt;
 
-		return 0;
-	}
-#endif
+                pfq_bitmap_foreach(eligible_mask, id_words, ew, eword, id)
+                {
+                        if (pfq_groups[gid].weight[id] > round)
+                                local_cache->sock_id[cnt++] = id;
+                }
 
-        /* if vlan header is present, remove it */
-        if (vl_untag && skb->protocol == cpu_to_be16(ETH_P_8021Q)) {
-                skb = vlan_untag(skb);
-                if (unlikely(!skb))
-                        return -1;
+                if (cnt == prev)
+                        break;
         }
 
-        /* reset mac len */
+        local_cache->sock_cnt = cnt;
+        local_cache->sock_gid = gid;
+        local_cache->sock_gen = gen;
+}
 
-        skb_reset_mac_len(skb);
 
-        /* push the mac header: reset skb->data to the beginning of the packet */
+/* least loaded eligible socket: occupancy of the current MPDB buffer,
+ * relative to the number of slots and to the weight of the socket.
+ * Loads are sampled once per group and batch (*sampled), the first time a
+ * socket is eligible; then the estimate of the chosen socket grows with the
+ * packets sent to it, so that the new flows of a batch spread.
+ */
 
-        if (likely(skb->pkt_type != PACKET_OUTGOING))
+static int
+pfq_least_loaded(struct local_data *local_cache, int gid, const unsigned long *eligible_mask, int id_words, bool *sampled)
+{
+        unsigned long eword;
+        int ew, id, best = -1;
+
+        if (!*sampled) {
+                memset(local_cache->load_mask, 0, id_words * sizeof(unsigned long));
+                *sampled = true;
+        }
+
+        pfq_bitmap_foreach(eligible_mask, id_words, ew, eword, id)
         {
-            skb_push(skb, skb->mac_len);
+                if (unlikely(!test_bit(id, local_cache->load_mask)))
+                {
+                        struct pfq_opt *pq = pfq_get_opt(id);
+
+                        __set_bit(id, local_cache->load_mask);
+                        local_cache->load_len[id] = 0;
+                        local_cache->load_cap[id] = 0;
+
+                        if (likely(pq && pq->active)) {
+                                smp_rmb();
+                                local_cache->load_len[id] = mpdb_queue_len(pq);
+                                local_cache->load_cap[id] = mpdb_queue_capacity(pq) * pq->rings * max_t(int, pfq_groups[gid].weight[id], 1);
+                        }
+                }
+
+                if (local_cache->load_cap[id] == 0)
+                        continue;
+
+                if (best < 0 || (u64)local_cache->load_len[id]   * local_cache->load_cap[best] <
+                                (u64)local_cache->load_len[best] * local_cache->load_cap[id])
+                        best = id;
         }
 
-	/* if required, timestamp this packet now */
+        if (best >= 0)
+                local_cache->load_len[best]++;
 
-        if (atomic_read(&timestamp_toggle) && skb->tstamp.tv64 == 0) {
-                __net_timestamp(skb);
+        return best;
+}
+
+
+/* load-aware steering: packets go to the least loaded eligible socket.
+ * Flows (hash != 0) stick to the socket chosen for their first packet
+ * (see pf_q-flow.c) until it leaves the group or the flow expires;
+ * elephant flows follow the policy of the group.
+ */
+
+static int
+pfq_balance(struct local_data *local_cache, int gid, unsigned int hash, const unsigned long *eligible_mask, int id_words, bool *sampled)
+{
+        struct pfq_flow_table *table = local_cache->flows;
+        struct pfq_flow *f;
+        u32 key, now;
+        bool found;
+        int id;
+
+        if (hash == 0)
+                return pfq_least_loaded(local_cache, gid, eligible_mask, id_words, sampled);
+
+        key = pfq_flow_key(gid, hash);
+        now = (u32)jiffies;
+        f = pfq_flow_get(table, key, now, &found);
+
+        if (found && test_bit(f->id, eligible_mask))
+        {
+                unsigned int pps = ACCESS_ONCE(pfq_groups[gid].elephant_pps);
+
+                if (pps == 0 || !pfq_flow_elephant(table, f, now, pps))
+                        return f->id;
+
+                switch(pfq_groups[gid].elephant_policy)
+                {
+                case Q_ELEPHANT_SPLIT:
+                        return local_cache->sock_id[pfq_fold(f->packets, local_cache->sock_cnt)];
+
+                case Q_ELEPHANT_REHOME:
+                        if (!(f->flags & PFQ_FLOW_REHOMED)) {
+                                id = pfq_least_loaded(local_cache, gid, eligible_mask, id_words, sampled);
+                                if (id >= 0) {
+                                        f->id = id;
+                                        f->flags |= PFQ_FLOW_REHOMED;
+                                }
+                        }
+                        return f->id;
+
+                default:
+                        return f->id;
+                }
         }
 
-	/* enqueue the packet to the prefetch queue */
+        id = pfq_least_loaded(local_cache, gid, eligible_mask, id_words, sampled);
 
-        cb = pfq_skb_annotation(skb);
+        if (id >= 0 && test_bit(id, eligible_mask))
+                pfq_flow_set(table, f, key, id, now);
 
-        cb->direct_skb      = direct;
-        cb->stolen_skb      = false;
-        cb->send_to_kernel  = false;
+        return id;
+}
 
-        /* enqueue this skb ... */
 
-        pfq_queue_skb_push(prefetch_queue, skb);
+/* process the prefetch queue of this cpu (softirq context) */
 
-        if (pfq_queue_skb_size(prefetch_queue) < prefetch_len) {
-                return 0;
-	}
+static int
+pfq_receive_batch(struct napi_struct *napi, struct local_data *local_cache)
+{
+        struct pfq_queue_skb * prefetch_queue = &local_cache->prefetch_queue;
+        unsigned long group_mask[BITS_TO_LONGS(Q_MAX_GROUP)];
+        unsigned long socket_mask[BITS_TO_LONGS(Q_MAX_ID)];
+        unsigned long *sock_queue = local_cache->sock_queue;
+        unsigned long word, sword;
+        int group_words, id_words, w, sw, gid, i;
+        struct pfq_annotation *cb;
+        struct sk_buff *skb;
+        long unsigned n;
+        int cpu;
 
 	/* initialize data */
 
-        memset(sock_queue, 0, sizeof(sock_queue));
+        group_words = ACCESS_ONCE(pfq_group_words);
+        id_words    = ACCESS_ONCE(pfq_id_words);
+
+        memset(group_mask, 0, group_words * sizeof(unsigned long));
 
-	cpu = get_cpu();
+	cpu = smp_processor_id();
 
 #ifdef PFQ_STEERING_PROFILE
 	cycles_t a = get_cycles();
 #endif
 
-        group_mask = 0;
-
         queue_for_each(skb, n, prefetch_queue)
         {
                 struct pfq_annotation *cb = pfq_skb_annotation(skb);
-		unsigned long local_group_mask = __pfq_devmap_get_groups(skb->dev->ifindex, skb_get_rx_queue(skb));
 
-		group_mask |= local_group_mask;
+		cb->group_mask = __pfq_devmap_get_groups(skb->dev->ifindex, skb_get_rx_queue(skb));
 
-		cb->group_mask = local_group_mask;
+                for(w = 0; w < group_words; w++)
+                        group_mask[w] |= cb->group_mask[w];
 	}
 
-        bitwise_foreach(group_mask, bit)
+        /* group computations, filters and sockets are protected by RCU */
+
+        rcu_read_lock();
+
+        pfq_bitmap_foreach(group_mask, group_words, w, word, gid)
         {
-		int gid = pfq_ctz(bit);
+                struct sk_filter *bpf = rcu_dereference(pfq_groups[gid].filter);
 
-                struct sk_filter *bpf = (struct sk_filter *)atomic_long_read(&pfq_groups[gid].filter);
+                struct pfq_computation *comp = rcu_dereference(pfq_groups[gid].comp);
+
+                struct pfq_reta *reta = rcu_dereference(pfq_groups[gid].reta);
+
+                bool sampled = false;  /* socket loads of the group, not sampled yet */
 
                 bool vlan_filter_enabled = __pfq_vlan_filters_enabled(gid);
 
-                socket_mask = 0;
+                unsigned long batch_mask = 0, run_mask;
+                ret_t *ret = local_cache->ret;
+
+                memset(socket_mask, 0, id_words * sizeof(unsigned long));
+
+                /* select the packets of this group (bpf and vlan filters) */
 
         	queue_for_each(skb, n, prefetch_queue)
 		{
                 	struct pfq_annotation *cb = pfq_skb_annotation(skb);
 
-			unsigned long sock_mask = 0;
-
-			ret_t ret;
-
-			if (unlikely((cb->group_mask & bit) == 0))
+			if (unlikely(!test_bit(gid, cb->group_mask)))
                          	continue;
 
                         /* increment recv counter for this group */
 
-                        __sparse_inc(&pfq_groups[gid].recv, cpu);
+                        __sparse_inc(&pfq_groups[gid].stats.recv);
 
                         /* check bpf filter */
 
-                        if (bpf && !sk_run_filter(skb, bpf->insns))
+                        if (bpf && !SK_RUN_FILTER(bpf, skb))
                         {
                                 continue;
                         }
@@ -449,85 +570,107 @@ pfq_receive(struct napi_struct *napi, struct sk_buff *skb, int direct)
                                         continue;
                         }
 
+                        cb->state = 0;
+                        ret[n] = pass();
 
-                        /* retrieve the function for this group */
+                        batch_mask |= 1UL << n;
+                }
 
-			if (atomic_long_read(&pfq_groups[gid].fun_ctx[0].function))
-                        {
-                                /* continuation-passing style evaluation */
+                /* run the sealed computation of this group on the whole batch */
 
-                                sk_function_t fun = (sk_function_t) atomic_long_read(&pfq_groups[gid].fun_ctx[0].function);
+                if (comp)
+                        pfq_run_batch(comp, prefetch_queue->queue, batch_mask, ret);
 
-                                /* reset state, index call and fun_ctx ptr */
+                run_mask = batch_mask;
+
+                queue_for_each_bitmask(skb, run_mask, n, prefetch_queue)
+		{
+                	struct pfq_annotation *cb = pfq_skb_annotation(skb);
 
-                                cb->index  =  -1;
-                                cb->state  =  0;
-                                cb->fun_ctx =  pfq_groups[gid].fun_ctx;
+			unsigned long sock_mask[BITS_TO_LONGS(Q_MAX_ID)];
 
-                                ret = pfq_call(fun, skb, pass());
+                        memset(sock_mask, 0, id_words * sizeof(unsigned long));
 
-                                if (ret.type & action_steal)
+			if (comp)
+                        {
+                                if (ret[n].type & action_steal)
                                 {
                                         cb->stolen_skb = true;
                                         continue;
                                 }
 
-                                if (ret.type & action_to_kernel)
+                                if (ret[n].type & action_to_kernel)
                                 {
                                         cb->send_to_kernel = true;
                                 }
 
-                                if (likely((ret.type && ret.type & action_drop) == 0))
+                                if (likely((ret[n].type && ret[n].type & action_drop) == 0))
                                 {
-                                        unsigned long eligible_mask = 0;
-                                        unsigned long cbit;
+                                        unsigned long eligible_mask[BITS_TO_LONGS(Q_MAX_ID)];
+                                        unsigned long cbit, cmask = ret[n].class;
+
+                                        memset(eligible_mask, 0, id_words * sizeof(unsigned long));
 
-                                        bitwise_foreach(ret.class, cbit)
+                                        bitwise_foreach(cmask, cbit)
                                         {
                                                 int cindex = pfq_ctz(cbit);
-                                                eligible_mask |= atomic_long_read(&pfq_groups[gid].sock_mask[cindex]);
+                                                for(i = 0; i < id_words; i++)
+                                                        eligible_mask[i] |= pfq_groups[gid].sock_mask[cindex][i];
                                         }
 
-                                        if (unlikely(ret.type & action_clone)) {
+                                        if (unlikely(ret[n].type & action_clone)) {
 
-                                                sock_mask |= eligible_mask;
+                                                for(i = 0; i < id_words; i++)
+                                                        sock_mask[i] |= eligible_mask[i];
                                         }
                                         else {
-                                                if (unlikely(eligible_mask != local_cache->eligible_mask)) {
+                                                unsigned int gen = ACCESS_ONCE(pfq_groups[gid].weight_gen);
+                                                smp_rmb();
 
-                                                        unsigned long ebit;
+                                                if (unlikely(local_cache->sock_gid != gid || local_cache->sock_gen != gen ||
+                                                             memcmp(eligible_mask, local_cache->eligible_mask, id_words * sizeof(unsigned long)))) {
 
-                                                        local_cache->eligible_mask = eligible_mask;
-                                                        local_cache->sock_cnt = 0;
-
-                                                        bitwise_foreach(eligible_mask, ebit)
-                                                        {
-                                                                local_cache->sock_mask[local_cache->sock_cnt++] = ebit;
-                                                        }
+                                                        pfq_steer_table(local_cache, gid, eligible_mask, id_words, gen);
                                                 }
 
                                                 if (likely(local_cache->sock_cnt))
                                                 {
-                                                        unsigned int h = ret.hash ^ (ret.hash >> 8) ^ (ret.hash >> 16);
-                                                        sock_mask |= local_cache->sock_mask[pfq_fold(h, local_cache->sock_cnt)];
+                                                        unsigned int h = ret[n].hash ^ (ret[n].hash >> 8) ^ (ret[n].hash >> 16);
+
+                                                        /* balanced packets go to the least loaded socket, the indirection table
+                                                         * keeps flows in place across joins/leaves: a socket that is not
+                                                         * eligible falls back to folding */
+
+                                                        int id = -1;
+
+                                                        if (unlikely(ret[n].type & action_balance))
+                                                                id = pfq_balance(local_cache, gid, h, eligible_mask, id_words, &sampled);
+                                                        else if (reta)
+                                                                id = reta->sock[h & (reta->size - 1)];
+
+                                                        if (id >= 0 && test_bit(id, eligible_mask))
+                                                                __set_bit(id, sock_mask);
+                                                        else
+                                                                __set_bit(local_cache->sock_id[pfq_fold(h, local_cache->sock_cnt)], sock_mask);
                                                 }
                                         }
                                 }
                         }
                         else
                         {
-                                sock_mask |= atomic_long_read(&pfq_groups[gid].sock_mask[0]);
+                                memcpy(sock_mask, pfq_groups[gid].sock_mask[0], id_words * sizeof(unsigned long));
                         }
 
-			pfq_sock_mask_to_queue(n, sock_mask, sock_queue);
-			socket_mask |= sock_mask;
+			pfq_sock_mask_to_queue(n, sock_mask, id_words, sock_queue);
+
+                        for(i = 0; i < id_words; i++)
+                                socket_mask[i] |= sock_mask[i];
 		}
 
                 /* copy packets of this group to pfq sockets... */
 
-                bitwise_foreach(socket_mask, lb)
+                pfq_bitmap_foreach(socket_mask, id_words, sw, sword, i)
                 {
-                        int i = pfq_ctz(lb);
                         struct pfq_opt * pq = pfq_get_opt(i);
                         if (likely(pq))
                         {
@@ -538,9 +681,13 @@ pfq_receive(struct napi_struct *napi, struct sk_buff *skb, int direct)
                                 pfq_copy_to_user_skbs(pq, cpu, sock_queue[i], prefetch_queue, gid);
 #endif
                         }
+
+                        sock_queue[i] = 0;
                 }
 	}
 
+        rcu_read_unlock();
+
 #ifdef PFQ_STEERING_PROFILE
 	cycles_t b = get_cycles();
 
@@ -564,7 +711,7 @@ pfq_receive(struct napi_struct *napi, struct sk_buff *skb, int direct)
                                 if (cb->direct_skb == 1)
                                         netif_rx(skb);
                                 else
-                                if (cb->direct_skb == 2)
+                                if (cb->direct_skb == 2 || napi == NULL)
                                         netif_receive_skb(skb);
                                 else
                                         napi_gro_receive(napi, skb);
@@ -585,6 +732,208 @@ pfq_receive(struct napi_struct *napi, struct sk_buff *skb, int direct)
 }
 
 
+/* effective batch length of this cpu: prefetch_len, or the adaptive length
+ * bounded by prefetch_min and prefetch_max (runtime parameters, never longer
+ * than the prefetch queue)
+ */
+
+static inline int
+pfq_batch_clamp(int len)
+{
+        int hi = min_t(int, prefetch_max, PFQ_QUEUE_MAX_LEN);
+        int lo = clamp_t(int, prefetch_min, 1, hi);
+
+        return clamp_t(int, len, lo, hi);
+}
+
+
+static inline int
+pfq_batch_len(struct local_data *local_cache)
+{
+        if (prefetch_max <= 0)
+                return clamp_t(int, prefetch_len, 1, PFQ_QUEUE_MAX_LEN);
+
+        return pfq_batch_clamp(local_cache->batch_len);
+}
+
+
+/* adapt the batch length to the arrival rate: it doubles when a batch fills
+ * in less than half of the latency budget (flush_timeout) and halves when a
+ * partial batch is flushed at its deadline (a partial batch flushed earlier
+ * keeps the current length).
+ */
+
+static inline void
+pfq_batch_adapt(struct local_data *local_cache, bool full)
+{
+        int len = pfq_batch_len(local_cache);
+        u64 budget, age;
+
+        if (prefetch_max <= 0)
+                return;
+
+        budget = (flush_timeout > 0 ? flush_timeout : 100) * 1000ULL;
+        age = local_clock() - local_cache->batch_start;
+
+        if (full) {
+                if (age < (budget >> 1))
+                        len <<= 1;
+        }
+        else {
+                if (age >= budget)
+                        len >>= 1;
+        }
+
+        local_cache->batch_len = pfq_batch_clamp(len);
+}
+
+
+/* flush of a partial batch: the timer fires on the cpu that armed it and
+ * defers the work to a tasklet, which runs on the same cpu in softirq
+ * context (serialized with pfq_receive).
+ */
+
+static enum hrtimer_restart
+pfq_flush_timer(struct hrtimer *timer)
+{
+        struct local_data *local_cache = container_of(timer, struct local_data, flush_timer);
+        tasklet_schedule(&local_cache->flush_tasklet);
+        return HRTIMER_NORESTART;
+}
+
+
+static void
+pfq_flush_tasklet(unsigned long data)
+{
+        struct local_data *local_cache = (struct local_data *)data;
+        u64 age, timeout;
+
+        if (unlikely(local_cache != __this_cpu_ptr(cpu_data)))
+                return;
+
+        if (pfq_queue_skb_size(&local_cache->prefetch_queue) == 0)
+                return;
+
+        /* a timer armed for a batch already processed: wait for the deadline
+         * of the current one */
+
+        age = local_clock() - local_cache->batch_start;
+        timeout = flush_timeout > 0 ? flush_timeout * 1000ULL : 0;
+
+        if (unlikely(age < timeout)) {
+                hrtimer_start(&local_cache->flush_timer, ns_to_ktime(timeout - age), HRTIMER_MODE_REL_PINNED);
+                return;
+        }
+
+        local_cache->flush_cnt++;
+
+        pfq_batch_adapt(local_cache, false);
+
+        pfq_receive_batch(NULL, local_cache);
+}
+
+
+int
+pfq_receive(struct napi_struct *napi, struct sk_buff *skb, int direct)
+{
+        struct local_data * local_cache = __this_cpu_ptr(cpu_data);
+        struct pfq_queue_skb * prefetch_queue = &local_cache->prefetch_queue;
+        struct pfq_annotation *cb;
+        int n;
+
+#ifdef PFQ_USE_FLOW_CONTROL
+
+	/* flow control */
+
+	if (local_cache->flowctrl &&
+	    local_cache->flowctrl--)
+	{
+                if (direct)
+                        pfq_kfree_skb_recycle(skb, &local_cache->recycle_list);
+                else
+                        kfree_skb(skb);
+
+		return 0;
+	}
+#endif
+
+        /* if vlan header is present, remove it */
+        if (vl_untag && skb->protocol == cpu_to_be16(ETH_P_8021Q)) {
+                skb = vlan_untag(skb);
+                if (unlikely(!skb))
+                        return -1;
+        }
+
+        /* reset mac len */
+
+        skb_reset_mac_len(skb);
+
+        /* push the mac header: reset skb->data to the beginning of the packet */
+
+        if (likely(skb->pkt_type != PACKET_OUTGOING))
+        {
+            skb_push(skb, skb->mac_len);
+        }
+
+	/* if required, timestamp this packet now */
+
+        if (atomic_read(&timestamp_toggle) && skb->tstamp.tv64 == 0) {
+                __net_timestamp(skb);
+        }
+
+	/* enqueue the packet to the prefetch queue */
+
+        cb = pfq_skb_annotation(skb);
+
+        cb->direct_skb      = direct;
+        cb->stolen_skb      = false;
+        cb->send_to_kernel  = false;
+
+        /* enqueue this skb ... */
+
+        n = pfq_queue_skb_size(prefetch_queue);
+
+        if (unlikely(pfq_queue_skb_push(prefetch_queue, skb) < 0))
+        {
+                if (direct)
+                        pfq_kfree_skb_recycle(skb, &local_cache->recycle_list);
+                else
+                        kfree_skb(skb);
+
+                return 0;
+        }
+
+        /* ... and bind its per-cpu header cache slot (dissected on first use) */
+
+        cb->dissect         = &local_cache->dissect[n];
+        cb->dissect->flags  = 0;
+
+        if (pfq_queue_skb_size(prefetch_queue) == 1)
+                local_cache->batch_start = local_clock();
+
+        if (pfq_queue_skb_size(prefetch_queue) < pfq_batch_len(local_cache)) {
+
+                /* bound the latency of a partial batch */
+
+                if (pfq_queue_skb_size(prefetch_queue) == 1 && flush_timeout > 0 &&
+                    !hrtimer_active(&local_cache->flush_timer))
+                        hrtimer_start(&local_cache->flush_timer, ns_to_ktime(flush_timeout * 1000ULL), HRTIMER_MODE_REL_PINNED);
+
+                return 0;
+	}
+
+        /* the batch is full: its flush timer is no longer needed */
+
+        hrtimer_try_to_cancel(&local_cache->flush_timer);
+
+        local_cache->batch_cnt++;
+
+        pfq_batch_adapt(local_cache, true);
+
+        return pfq_receive_batch(napi, local_cache);
+}
+
+
 /* simple packet HANDLER */
 
 int
@@ -629,11 +978,19 @@ pfq_ctor(struct pfq_opt *pq)
         /* set to 0 by default */
         memset(pq, 0, sizeof(struct pfq_opt));
 
+        /* per-cpu stats, before the id makes this queue visible */
+        if (pfq_kstats_init(&pq->stat) != 0)
+        {
+                printk(KERN_WARNING "[PFQ] stats: out of memory!\n");
+                return -ENOMEM;
+        }
+
         /* get a unique id for this queue */
         pq->id = pfq_get_free_id(pq);
         if (pq->id == -1)
         {
                 printk(KERN_WARNING "[PFQ] no queue available!\n");
+                pfq_kstats_free(&pq->stat);
                 return -EBUSY;
         }
 
@@ -648,8 +1005,18 @@ pfq_ctor(struct pfq_opt *pq)
 
         pq->caplen    = cap_len;
         pq->offset    = 0;
-        pq->slot_size = MPDB_QUEUE_SLOT_SIZE(cap_len);
+        pq->layout    = Q_LAYOUT_DEFAULT;
+
+        pq->user_addr = NULL;
+        pq->user_size = 0;
+        pq->pages     = NULL;
+        pq->nr_pages  = 0;
+
+        pq->numa_node  = Q_NUMA_ANY;
+        pq->queue_node = Q_NUMA_ANY;
+        pq->slot_size = mpdb_slot_size(pq);
         pq->slots     = queue_slots;
+        pq->rings     = 1;
 
         /* disabled by default */
         pq->active = false;
@@ -671,7 +1038,15 @@ pfq_dtor(struct pfq_opt *pq)
 {
         pfq_release_id(pq->id);
 
+        /* wait for pfq_receive to drop any reference to this socket
+         * (the queue is vmalloc'ed, it cannot be released by an RCU callback)
+         */
+
+        synchronize_rcu();
+
         mpdb_queue_free(pq);
+
+        pfq_kstats_free(&pq->stat);
 }
 
 
@@ -776,16 +1151,8 @@ pfq_release(struct socket *sock)
 
         	pfq_leave_all_groups(pq->id);
 
-                msleep(GRACE_PERIOD);
-
 		pfq_dtor(pq);
 
-		/* Convenient way to avoid a race condition,
-		 * without using expensive rw-mutexes
-		 */
-
-                msleep(GRACE_PERIOD);
-
 		kfree(pq);
 	}
 
@@ -868,55 +1235,189 @@ int pfq_getsockopt(struct socket *sock,
             {
                     if (len != sizeof(pq->active))
                             return -EINVAL;
-
-                    if (copy_to_user(optval, &pq->active, sizeof(pq->active)))
+
+                    if (copy_to_user(optval, &pq->active, sizeof(pq->active)))
+                            return -EFAULT;
+
+            } break;
+
+        case Q_SO_GET_STATS:
+            {
+                    struct pfq_stats stat;
+                    if (len != sizeof(struct pfq_stats))
+                            return -EINVAL;
+
+                    stat.recv = sparse_read(&pq->stat.recv);
+                    stat.lost = sparse_read(&pq->stat.lost);
+                    stat.drop = sparse_read(&pq->stat.drop);
+
+                    if (copy_to_user(optval, &stat, sizeof(stat)))
+                            return -EFAULT;
+            } break;
+
+        case Q_SO_GET_BATCH_STATS:
+            {
+                    struct pfq_batch_stats stat = { 0, 0 };
+                    int cpu;
+
+                    if (len != sizeof(struct pfq_batch_stats))
+                            return -EINVAL;
+
+                    for_each_possible_cpu(cpu) {
+                            struct local_data *this_cpu = per_cpu_ptr(cpu_data, cpu);
+                            stat.batch += ACCESS_ONCE(this_cpu->batch_cnt);
+                            stat.flush += ACCESS_ONCE(this_cpu->flush_cnt);
+                    }
+
+                    if (copy_to_user(optval, &stat, sizeof(stat)))
+                            return -EFAULT;
+            } break;
+
+        case Q_SO_GET_FLOW_STATS:
+            {
+                    struct pfq_flow_stats stat;
+
+                    if (len != sizeof(struct pfq_flow_stats))
+                            return -EINVAL;
+
+                    pfq_flow_get_stats(&stat);
+
+                    if (copy_to_user(optval, &stat, sizeof(stat)))
+                            return -EFAULT;
+            } break;
+
+        case Q_SO_GET_BATCH_LEN:
+            {
+                    int *blen, n = len / sizeof(int);
+                    int cpu, err = 0;
+
+                    if (len <= 0 || n > Q_MAX_CPU || len % sizeof(int))
+                            return -EINVAL;
+
+                    blen = kcalloc(n, sizeof(int), GFP_KERNEL);
+                    if (blen == NULL)
+                            return -ENOMEM;
+
+                    for_each_possible_cpu(cpu) {
+                            if (cpu < n)
+                                    blen[cpu] = pfq_batch_len(per_cpu_ptr(cpu_data, cpu));
+                    }
+
+                    if (copy_to_user(optval, blen, len))
+                            err = -EFAULT;
+
+                    kfree(blen);
+                    if (err)
+                            return err;
+            } break;
+
+        case Q_SO_GET_TSTAMP:
+            {
+                    if (len != sizeof(pq->tstamp))
+                            return -EINVAL;
+                    if (copy_to_user(optval, &pq->tstamp, sizeof(pq->tstamp)))
+                            return -EFAULT;
+            } break;
+
+        case Q_SO_GET_QUEUE_MEM:
+            {
+                    size_t mem = pq->addr ? pq->queue_mem : PAGE_ALIGN(mpdb_queue_tot_mem(pq));
+                    if (len != sizeof(mem))
+                            return -EINVAL;
+                    if (copy_to_user(optval, &mem, sizeof(mem)))
+                            return -EFAULT;
+            } break;
+
+        case Q_SO_GET_CAPLEN:
+            {
+                    if (len != sizeof(pq->caplen))
+                            return -EINVAL;
+                    if (copy_to_user(optval, &pq->caplen, sizeof(pq->caplen)))
+                            return -EFAULT;
+            } break;
+
+        case Q_SO_GET_SLOTS:
+            {
+                    if (len != sizeof(pq->slots))
+                            return -EINVAL;
+                    if (copy_to_user(optval, &pq->slots, sizeof(pq->slots)))
                             return -EFAULT;
-
             } break;
 
-        case Q_SO_GET_STATS:
+        case Q_SO_GET_LAYOUT:
             {
-                    struct pfq_stats stat;
-                    if (len != sizeof(struct pfq_stats))
+                    if (len != sizeof(pq->layout))
                             return -EINVAL;
-
-                    stat.recv = sparse_read(&pq->stat.recv);
-                    stat.lost = sparse_read(&pq->stat.lost);
-                    stat.drop = sparse_read(&pq->stat.drop);
-
-                    if (copy_to_user(optval, &stat, sizeof(stat)))
+                    if (copy_to_user(optval, &pq->layout, sizeof(pq->layout)))
                             return -EFAULT;
             } break;
 
-        case Q_SO_GET_TSTAMP:
+        case Q_SO_GET_SLOT_SIZE:
             {
-                    if (len != sizeof(pq->tstamp))
+                    if (len != sizeof(pq->slot_size))
                             return -EINVAL;
-                    if (copy_to_user(optval, &pq->tstamp, sizeof(pq->tstamp)))
+                    if (copy_to_user(optval, &pq->slot_size, sizeof(pq->slot_size)))
                             return -EFAULT;
             } break;
 
-        case Q_SO_GET_QUEUE_MEM:
+        case Q_SO_GET_NUMA_NODE:
             {
-                    if (len != sizeof(pq->queue_mem))
+                    int node = mpdb_queue_node(pq);
+                    if (len != sizeof(node))
                             return -EINVAL;
-                    if (copy_to_user(optval, &pq->queue_mem, sizeof(pq->queue_mem)))
+                    if (copy_to_user(optval, &node, sizeof(node)))
                             return -EFAULT;
             } break;
 
-        case Q_SO_GET_CAPLEN:
+        case Q_SO_GET_GROUP_NODES:
             {
-                    if (len != sizeof(pq->caplen))
+                    struct pfq_group_nodes g;
+                    struct pfq_queue_node *queue = NULL;
+
+                    if (len != sizeof(g))
                             return -EINVAL;
-                    if (copy_to_user(optval, &pq->caplen, sizeof(pq->caplen)))
+
+                    if (copy_from_user(&g, optval, len))
+                            return -EFAULT;
+
+                    if (g.gid < 0  || g.gid >= Q_MAX_GROUP) {
+                    	    pr_devel("[PFQ|%d] get group nodes error: gid:%d invalid argument!\n", pq->id, g.gid);
+			    return -EINVAL;
+		    }
+
+		    if (!__pfq_group_access(g.gid, pq->id, Q_GROUP_UNDEFINED, false)) {
+                    	    pr_devel("[PFQ|%d] get group nodes error: gid:%d access denied!\n", pq->id, g.gid);
+			    return -EPERM;
+		    }
+
+                    if (g.size > 0 && g.queue) {
+                            queue = vmalloc(min(g.size, Q_MAX_DEVICE * Q_MAX_HW_QUEUE) * sizeof(struct pfq_queue_node));
+                            if (queue == NULL)
+                                    return -ENOMEM;
+                    }
+
+                    /* the queues are copied only if the user buffer is large enough */
+
+                    len = pfq_devmap_get_nodes(g.gid, queue, queue ? min(g.size, Q_MAX_DEVICE * Q_MAX_HW_QUEUE) : 0);
+
+                    if (queue && len <= g.size && copy_to_user(g.queue, queue, len * sizeof(struct pfq_queue_node))) {
+                            vfree(queue);
+                            return -EFAULT;
+                    }
+
+                    vfree(queue);
+
+                    g.size = len;
+
+                    if (copy_to_user(optval, &g, sizeof(g)))
                             return -EFAULT;
             } break;
 
-        case Q_SO_GET_SLOTS:
+        case Q_SO_GET_RINGS:
             {
-                    if (len != sizeof(pq->slots))
+                    if (len != sizeof(pq->rings))
                             return -EINVAL;
-                    if (copy_to_user(optval, &pq->slots, sizeof(pq->slots)))
+                    if (copy_to_user(optval, &pq->rings, sizeof(pq->rings)))
                             return -EFAULT;
             } break;
 
@@ -930,11 +1431,14 @@ int pfq_getsockopt(struct socket *sock,
 
         case Q_SO_GET_GROUPS:
             {
-                    unsigned long grps;
-                    if(len != sizeof(unsigned long))
+                    unsigned long grps[BITS_TO_LONGS(Q_MAX_GROUP)];
+
+                    /* a single word is still accepted for legacy users (groups 0..63) */
+
+                    if(len != sizeof(unsigned long) && len != sizeof(grps))
                             return -EINVAL;
-                    grps = pfq_get_groups(pq->id);
-                    if (copy_to_user(optval, &grps, sizeof(grps)))
+                    pfq_get_groups(pq->id, grps);
+                    if (copy_to_user(optval, grps, len))
                             return -EFAULT;
             } break;
 
@@ -963,9 +1467,9 @@ int pfq_getsockopt(struct socket *sock,
 			    return -EPERM;
 		    }
 
-                    stat.recv = sparse_read(&pfq_groups[gid].recv);
-                    stat.lost = sparse_read(&pfq_groups[gid].lost);
-                    stat.drop = sparse_read(&pfq_groups[gid].drop);
+                    stat.recv = sparse_read(&pfq_groups[gid].stats.recv);
+                    stat.lost = sparse_read(&pfq_groups[gid].stats.lost);
+                    stat.drop = sparse_read(&pfq_groups[gid].stats.drop);
 
                     if (copy_to_user(optval, &stat, sizeof(stat)))
                             return -EFAULT;
@@ -998,13 +1502,135 @@ int pfq_getsockopt(struct socket *sock,
 			    return -EPERM;
 		    }
 
-                    if (__pfq_get_group_context(s.gid, s.level, s.size, s.context) < 0) {
+                    if (pfq_get_group_context(s.gid, s.level, s.size, s.context) < 0) {
                     	pr_devel("[PFQ|%d] get context error: gid:%d error!\n", pq->id, s.gid);
                             return -EFAULT;
                     }
 
 	    } break;
 
+        case Q_SO_GET_GROUP_FPROG_MODE:
+            {
+                    int gid, mode;
+
+                    if (len != sizeof(gid))
+                            return -EINVAL;
+
+                    if (copy_from_user(&gid, optval, len))
+                            return -EFAULT;
+
+                    if (gid < 0  || gid >= Q_MAX_GROUP) {
+                    	    pr_devel("[PFQ|%d] fprog mode error: gid:%d invalid argument!\n", pq->id, gid);
+			    return -EINVAL;
+		    }
+
+		    if (!__pfq_group_access(gid, pq->id, Q_GROUP_UNDEFINED, false)) {
+                    	    pr_devel("[PFQ|%d] fprog mode error: gid:%d access denied!\n", pq->id, gid);
+			    return -EPERM;
+		    }
+
+                    mode = pfq_groups[gid].fprog_mode;
+
+                    if (copy_to_user(optval, &mode, sizeof(mode)))
+                            return -EFAULT;
+            } break;
+
+        case Q_SO_GET_GROUP_WEIGHT:
+            {
+                    struct pfq_group_weight w;
+
+                    if (len != sizeof(w))
+                            return -EINVAL;
+
+                    if (copy_from_user(&w, optval, len))
+                            return -EFAULT;
+
+                    if (w.gid < 0  || w.gid >= Q_MAX_GROUP) {
+                    	    pr_devel("[PFQ|%d] get weight error: gid:%d invalid argument!\n", pq->id, w.gid);
+			    return -EINVAL;
+		    }
+
+                    if (!__pfq_has_joined_group(w.gid, pq->id)) {
+                    	    pr_devel("[PFQ|%d] get weight error: gid:%d not joined!\n", pq->id, w.gid);
+			    return -EPERM;
+		    }
+
+                    w.weight = pfq_groups[w.gid].weight[pq->id];
+
+                    if (copy_to_user(optval, &w, sizeof(w)))
+                            return -EFAULT;
+            } break;
+
+        case Q_SO_GET_GROUP_RETA:
+            {
+                    struct pfq_group_reta r;
+                    int *sock = NULL;
+
+                    if (len != sizeof(r))
+                            return -EINVAL;
+
+                    if (copy_from_user(&r, optval, len))
+                            return -EFAULT;
+
+                    if (r.gid < 0  || r.gid >= Q_MAX_GROUP) {
+                    	    pr_devel("[PFQ|%d] get reta error: gid:%d invalid argument!\n", pq->id, r.gid);
+			    return -EINVAL;
+		    }
+
+		    if (!__pfq_group_access(r.gid, pq->id, Q_GROUP_UNDEFINED, false)) {
+                    	    pr_devel("[PFQ|%d] get reta error: gid:%d access denied!\n", pq->id, r.gid);
+			    return -EPERM;
+		    }
+
+                    if (r.size > 0 && r.sock) {
+                            sock = kmalloc(min(r.size, Q_RETA_MAX) * sizeof(int), GFP_KERNEL);
+                            if (sock == NULL)
+                                    return -ENOMEM;
+                    }
+
+                    /* the table is copied only if the user buffer is large enough */
+
+                    len = pfq_get_group_reta(r.gid, sock, sock ? min(r.size, Q_RETA_MAX) : 0);
+
+                    if (sock && len <= r.size && copy_to_user(r.sock, sock, len * sizeof(int))) {
+                            kfree(sock);
+                            return -EFAULT;
+                    }
+
+                    kfree(sock);
+
+                    r.size = len;
+
+                    if (copy_to_user(optval, &r, sizeof(r)))
+                            return -EFAULT;
+            } break;
+
+        case Q_SO_GET_GROUP_ELEPHANT:
+            {
+                    struct pfq_group_elephant e;
+
+                    if (len != sizeof(e))
+                            return -EINVAL;
+
+                    if (copy_from_user(&e, optval, len))
+                            return -EFAULT;
+
+                    if (e.gid < 0  || e.gid >= Q_MAX_GROUP) {
+                    	    pr_devel("[PFQ|%d] get elephant error: gid:%d invalid argument!\n", pq->id, e.gid);
+			    return -EINVAL;
+		    }
+
+		    if (!__pfq_group_access(e.gid, pq->id, Q_GROUP_UNDEFINED, false)) {
+                    	    pr_devel("[PFQ|%d] get elephant error: gid:%d access denied!\n", pq->id, e.gid);
+			    return -EPERM;
+		    }
+
+                    pfq_get_group_elephant(e.gid, &e.policy, &e.pps);
+
+                    if (copy_to_user(optval, &e, sizeof(e)))
+                            return -EFAULT;
+            } break;
+
         default:
             return -EFAULT;
         }
@@ -1054,16 +1680,26 @@ int pfq_setsockopt(struct socket *sock,
                     {
                             if (!pq->addr)
                             {
-                                    struct pfq_queue_descr *sq;
+                                    size_t n;
+
+                                    /* the length of a buffer must fit in MPDB_QUEUE_LEN */
+                                    if (mpdb_queue_capacity(pq) > MPDB_QUEUE_LEN(~0U)) {
+                                            pr_devel("[PFQ|%d] queue too large!\n", pq->id);
+                                            return -EINVAL;
+                                    }
 
                                     /* alloc queue memory */
                                     pq->addr = mpdb_queue_alloc(pq, mpdb_queue_tot_mem(pq), &pq->queue_mem);
                                     if (pq->addr == NULL) {
                                             return -ENOMEM;
                                     }
-                                    sq = (struct pfq_queue_descr *)pq->addr;
-                                    sq->data      = (1L << 24);
-                                    sq->poll_wait = 0;
+
+                                    for(n = 0; n < pq->rings; n++)
+                                    {
+                                            struct pfq_queue_descr *sq = mpdb_queue_descr(pq, n);
+                                            sq->data      = (1L << 24);
+                                            sq->poll_wait = 0;
+                                    }
 
 				    smp_wmb();
 
@@ -1073,7 +1709,7 @@ int pfq_setsockopt(struct socket *sock,
                     else {
                         pq->active = false;
 
-                        msleep(GRACE_PERIOD);
+                        synchronize_rcu();
 
                         mpdb_queue_free(pq);
                     }
@@ -1133,11 +1769,31 @@ int pfq_setsockopt(struct socket *sock,
                     if (copy_from_user(&pq->caplen, optval, optlen))
                             return -EFAULT;
 
-                    pq->slot_size = MPDB_QUEUE_SLOT_SIZE(pq->caplen);
+                    pq->slot_size = mpdb_slot_size(pq);
                     pr_devel("[PFQ|%d] caplen:%lu -> slot_size:%lu\n",
                                     pq->id, pq->caplen, pq->slot_size);
             } break;
 
+        case Q_SO_SET_LAYOUT:
+            {
+                    int layout;
+                    if (optlen != sizeof(layout))
+                            return -EINVAL;
+                    if (copy_from_user(&layout, optval, optlen))
+                            return -EFAULT;
+
+                    if (layout & ~(Q_LAYOUT_CACHELINE|Q_LAYOUT_VARLEN))
+                            return -EINVAL;
+
+                    if (pq->addr)
+                            return -EBUSY;
+
+                    pq->layout    = layout;
+                    pq->slot_size = mpdb_slot_size(pq);
+                    pr_devel("[PFQ|%d] layout:%d -> slot_size:%lu\n",
+                                    pq->id, pq->layout, pq->slot_size);
+            } break;
+
         case Q_SO_SET_SLOTS:
             {
                     if (optlen != sizeof(pq->slots))
@@ -1149,6 +1805,69 @@ int pfq_setsockopt(struct socket *sock,
                                     pq->id, pq->slots, pq->slot_size);
             } break;
 
+        case Q_SO_SET_RINGS:
+            {
+                    size_t rings;
+                    if (optlen != sizeof(rings))
+                            return -EINVAL;
+                    if (copy_from_user(&rings, optval, optlen))
+                            return -EFAULT;
+
+                    if (rings < 1 || rings > Q_MAX_RINGS)
+                            return -EINVAL;
+
+                    /* the layout of the queue cannot change under the producers */
+
+                    if (pq->addr)
+                            return -EBUSY;
+
+                    pq->rings = rings;
+                    pr_devel("[PFQ|%d] rings:%lu\n", pq->id, pq->rings);
+            } break;
+
+        case Q_SO_SET_HUGEPAGES:
+            {
+                    struct pfq_hugepages hp;
+                    if (optlen != sizeof(hp))
+                            return -EINVAL;
+                    if (copy_from_user(&hp, optval, optlen))
+                            return -EFAULT;
+
+                    if (hp.addr && (!hp.size || !PAGE_ALIGNED((unsigned long)hp.addr)))
+                            return -EINVAL;
+
+                    if (hp.addr && !mpdb_queue_hugetlb((void __user *)hp.addr, hp.size)) {
+                            pr_devel("[PFQ|%d] hugepages error: %p is not hugetlb backed!\n", pq->id, hp.addr);
+                            return -EINVAL;
+                    }
+
+                    if (pq->addr)
+                            return -EBUSY;
+
+                    pq->user_addr = (void __user *)hp.addr;
+                    pq->user_size = hp.addr ? hp.size : 0;
+                    pr_devel("[PFQ|%d] hugepages:%p size:%lu\n", pq->id, pq->user_addr, pq->user_size);
+            } break;
+
+        case Q_SO_SET_NUMA_NODE:
+            {
+                    int node;
+                    if (optlen != sizeof(node))
+                            return -EINVAL;
+                    if (copy_from_user(&node, optval, optlen))
+                            return -EFAULT;
+
+                    if (node != Q_NUMA_ANY && node != Q_NUMA_LOCAL &&
+                        (node < 0 || node >= MAX_NUMNODES || !node_online(node)))
+                            return -EINVAL;
+
+                    if (pq->addr)
+                            return -EBUSY;
+
+                    pq->numa_node = node;
+                    pr_devel("[PFQ|%d] numa node:%d\n", pq->id, pq->numa_node);
+            } break;
+
         case Q_SO_SET_OFFSET:
             {
                     if (optlen != sizeof(pq->offset))
@@ -1186,7 +1905,7 @@ int pfq_setsockopt(struct socket *sock,
 
                     CHECK_GROUP_PERM(gid, "reset group");
 
-                    __pfq_reset_group_functx(gid);
+                    pfq_reset_group_functx(gid);
 
                     pr_devel("[PFQ|%d] reset group gid:%d\n", pq->id, gid);
             } break;
@@ -1194,6 +1913,8 @@ int pfq_setsockopt(struct socket *sock,
 	case Q_SO_GROUP_CONTEXT:
 	    {
 		    struct pfq_group_context s;
+		    int err;
+
 		    if (optlen != sizeof(s))
 			    return -EINVAL;
 
@@ -1204,27 +1925,30 @@ int pfq_setsockopt(struct socket *sock,
 
 		    if (s.size && s.context)
 		    {
-                    	void * context = kmalloc(s.size, GFP_KERNEL);
+                    	void * context = pfq_context_alloc(s.size);
 			if (context == NULL)
 				return -ENOMEM;
 
 			if(copy_from_user(context, s.context, s.size)) {
-                         	kfree(context);
+                         	pfq_context_free(context);
 				return -EFAULT;
 			}
 
-			if (__pfq_set_group_context(s.gid, context, s.level) < 0) {
-                    		pr_devel("[PFQ|%d] context error: gid:%d invalid level (%d)!\n", pq->id, s.gid, s.level);
-			        return -EINVAL;
+			err = pfq_set_group_context(s.gid, context, s.size, s.level);
+			if (err < 0) {
+                    		pr_devel("[PFQ|%d] context error: gid:%d level (%d) error!\n", pq->id, s.gid, s.level);
+                         	pfq_context_free(context);
+			        return err;
                         }
 
 			pr_devel("[PFQ|%d] context: gid:%d (context of %zu bytes set)\n", pq->id, s.gid, s.size);
 		    }
 		    else { /* empty context */
 
-			if (__pfq_set_group_context(s.gid, NULL, s.level) < 0) {
-                    		pr_devel("[PFQ|%d] context error: gid:%d invalid level (%d)!\n", pq->id, s.gid, s.level);
-			        return -EINVAL;
+			err = pfq_set_group_context(s.gid, NULL, 0, s.level);
+			if (err < 0) {
+                    		pr_devel("[PFQ|%d] context error: gid:%d level (%d) error!\n", pq->id, s.gid, s.level);
+			        return err;
                         }
 
 			pr_devel("[PFQ|%d] context: gid:%d (empty context set)\n", pq->id, s.gid);
@@ -1245,9 +1969,10 @@ int pfq_setsockopt(struct socket *sock,
 
 		    if (s.name == NULL) {
 
-			if (__pfq_set_group_function(s.gid, NULL, s.level) < 0) {
-                    		pr_devel("[PFQ|%d] function error: gid:%d invalid level (%d)!\n", pq->id, s.gid, s.level);
-			        return -EINVAL;
+			int err = pfq_set_group_function(s.gid, NULL, s.level);
+			if (err < 0) {
+                    		pr_devel("[PFQ|%d] function error: gid:%d level (%d) error!\n", pq->id, s.gid, s.level);
+			        return err;
                         }
 
                     	pr_devel("[PFQ|%d] function: gid:%d (NONE)\n", pq->id, s.gid);
@@ -1255,22 +1980,23 @@ int pfq_setsockopt(struct socket *sock,
 		    else {
 
                         char name[Q_FUN_NAME_LEN];
-			sk_function_t fun;
+			struct sk_function_descr descr;
+			int err;
 
                     	if (strncpy_from_user(name, s.name, Q_FUN_NAME_LEN-1) < 0)
 				return -EFAULT;
 
 			name[Q_FUN_NAME_LEN-1] = '\0';
 
-			fun = pfq_get_function(name);
-			if (fun == NULL) {
+			if (pfq_get_function_descr(name, &descr) < 0) {
                     		pr_devel("[PFQ|%d] function error: gid:%d '%s' unknown function!\n", pq->id, s.gid, name);
 				return -EINVAL;
 			}
 
-			if (__pfq_set_group_function(s.gid, fun, s.level) < 0) {
-                    		pr_devel("[PFQ|%d] function error: gid:%d invalid level (%d)!\n", pq->id, s.gid, s.level);
-			        return -EINVAL;
+			err = pfq_set_group_function(s.gid, &descr, s.level);
+			if (err < 0) {
+                    		pr_devel("[PFQ|%d] function error: gid:%d level (%d) error!\n", pq->id, s.gid, s.level);
+			        return err;
                         }
 
 			pr_devel("[PFQ|%d] function gid:%d -> function '%s'\n", pq->id, s.gid, name);
@@ -1297,13 +2023,13 @@ int pfq_setsockopt(struct socket *sock,
 			    return -EINVAL;
 			}
 
-			__pfq_set_group_filter(fprog.gid, filter);
+			pfq_set_group_filter(fprog.gid, filter);
 
 			pr_devel("[PFQ|%d] fprog: gid:%d (fprog len %d bytes)\n", pq->id, fprog.gid, fprog.fcode.len);
 		    }
 		    else 	/* reset the filter */
 		    {
-			__pfq_set_group_filter(fprog.gid, NULL);
+			pfq_set_group_filter(fprog.gid, NULL);
 
 			pr_devel("[PFQ|%d] fprog: gid:%d (resetting filter)\n", pq->id, fprog.gid);
 		    }
@@ -1363,6 +2089,92 @@ int pfq_setsockopt(struct socket *sock,
                     pr_devel("[PFQ|%d] vlan_set filter vid %d for gid:%d\n", pq->id, filt.vid, filt.gid);
             } break;
 
+        case Q_SO_GROUP_ELEPHANT:
+            {
+                    struct pfq_group_elephant e;
+
+		    if (optlen != sizeof(e))
+			    return -EINVAL;
+
+		    if (copy_from_user(&e, optval, optlen))
+			    return -EFAULT;
+
+                    CHECK_GROUP_PERM(e.gid, "group elephant");
+
+                    if (pfq_set_group_elephant(e.gid, e.policy, e.pps) < 0) {
+                    	    pr_devel("[PFQ|%d] elephant error: gid:%d invalid policy:%d!\n", pq->id, e.gid, e.policy);
+			    return -EINVAL;
+                    }
+
+                    pr_devel("[PFQ|%d] elephant policy %d (%u pps) for gid:%d\n", pq->id, e.policy, e.pps, e.gid);
+            } break;
+
+        case Q_SO_GROUP_WEIGHT:
+            {
+                    struct pfq_group_weight w;
+
+		    if (optlen != sizeof(w))
+			    return -EINVAL;
+
+		    if (copy_from_user(&w, optval, optlen))
+			    return -EFAULT;
+
+                    CHECK_GROUP_PERM(w.gid, "group weight");
+
+                    if (pfq_set_group_weight(w.gid, pq->id, w.weight) < 0) {
+                    	    pr_devel("[PFQ|%d] weight error: gid:%d invalid weight:%d!\n", pq->id, w.gid, w.weight);
+			    return -EINVAL;
+                    }
+
+                    pr_devel("[PFQ|%d] weight %d for gid:%d\n", pq->id, w.weight, w.gid);
+            } break;
+
+        case Q_SO_GROUP_RETA:
+            {
+                    struct pfq_group_reta r;
+                    struct pfq_reta *reta = NULL;
+
+		    if (optlen != sizeof(r))
+			    return -EINVAL;
+
+		    if (copy_from_user(&r, optval, optlen))
+			    return -EFAULT;
+
+                    CHECK_GROUP_PERM(r.gid, "group reta");
+
+                    if (r.size) /* size 0 removes the table */
+                    {
+                            int i;
+
+                            if (r.sock == NULL || !pfq_reta_valid_size(r.size)) {
+                    	            pr_devel("[PFQ|%d] reta error: gid:%d invalid size:%d!\n", pq->id, r.gid, r.size);
+                                    return -EINVAL;
+                            }
+
+                            reta = pfq_reta_alloc(r.size);
+                            if (reta == NULL)
+                                    return -ENOMEM;
+
+                            if (copy_from_user(reta->sock, r.sock, r.size * sizeof(int))) {
+                                    kfree(reta);
+                                    return -EFAULT;
+                            }
+
+                            for(i = 0; i < r.size; i++)
+                            {
+                                    if (reta->sock[i] < 0 || reta->sock[i] >= Q_MAX_ID) {
+                    	                    pr_devel("[PFQ|%d] reta error: gid:%d invalid id:%d!\n", pq->id, r.gid, reta->sock[i]);
+                                            kfree(reta);
+                                            return -EINVAL;
+                                    }
+                            }
+                    }
+
+                    pfq_set_group_reta(r.gid, reta);
+
+                    pr_devel("[PFQ|%d] reta of %d buckets for gid:%d\n", pq->id, r.size, r.gid);
+            } break;
+
         default:
             {
                     found = false;
@@ -1390,6 +2202,30 @@ pfq_memory_mmap(struct vm_area_struct *vma,
 }
 
 
+/* queues allocated on a numa node are not VM_USERMAP: map them page by page */
+
+static inline
+int
+pfq_memory_mmap_pages(struct vm_area_struct *vma,
+                unsigned long size, char *ptr, unsigned int flags)
+{
+        unsigned long off;
+
+        vma->vm_flags |= flags;
+
+        for(off = 0; off < size; off += PAGE_SIZE)
+        {
+                if (vm_insert_page(vma, vma->vm_start + off, vmalloc_to_page(ptr + off)) != 0)
+                {
+                        printk(KERN_WARNING "[PFQ] vm_insert_page!\n");
+                        return -EAGAIN;
+                }
+        }
+
+        return 0;
+}
+
+
 static int
 pfq_mmap(struct file *file, struct socket *sock, struct vm_area_struct *vma)
 {
@@ -1407,7 +2243,19 @@ pfq_mmap(struct file *file, struct socket *sock, struct vm_area_struct *vma)
                 return -EINVAL;
         }
 
-        if((ret = pfq_memory_mmap(vma, size, pq->addr, VM_LOCKED)) < 0)
+        /* hugepage queues are mapped by the process */
+
+        if (pq->pages) {
+                printk(KERN_WARNING "[PFQ] pfq_mmap: queue on hugepages!\n");
+                return -EINVAL;
+        }
+
+        if (pq->queue_node != Q_NUMA_ANY)
+                ret = pfq_memory_mmap_pages(vma, size, pq->addr, VM_LOCKED);
+        else
+                ret = pfq_memory_mmap(vma, size, pq->addr, VM_LOCKED);
+
+        if (ret < 0)
                 return ret;
 
         return 0;
@@ -1430,7 +2278,7 @@ pfq_poll(struct file *file, struct socket *sock, poll_table * wait)
         if (q == NULL)
                 return mask;
 
-        if (mpdb_queue_len(pq) >= (pq->slots>>1)) {
+        if (mpdb_queue_max_len(pq) >= (mpdb_queue_capacity(pq)>>1)) {
                 q->poll_wait = 0;
                 mask |= POLLIN | POLLRDNORM;
         }
@@ -1577,6 +2425,36 @@ static int __init pfq_init_module(void)
 		return -ENOMEM;
         }
 
+        /* per-cpu group counters */
+        if (pfq_groups_init() != 0) {
+                printk(KERN_WARNING "[PFQ] out of memory!\n");
+                n = -ENOMEM;
+                goto err_cpu;
+        }
+
+        /* per-cpu flow tables */
+        if (pfq_flow_init() != 0) {
+                printk(KERN_WARNING "[PFQ] out of memory!\n");
+                n = -ENOMEM;
+                goto err_groups;
+        }
+
+        {
+                int cpu;
+
+                /* setup the flush timer of the prefetch queues */
+
+                for_each_possible_cpu(cpu) {
+                        struct local_data *this_cpu = per_cpu_ptr(cpu_data, cpu);
+                        hrtimer_init(&this_cpu->flush_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+                        this_cpu->flush_timer.function = pfq_flush_timer;
+                        tasklet_init(&this_cpu->flush_tasklet, pfq_flush_tasklet, (unsigned long)this_cpu);
+                        this_cpu->batch_len = prefetch_len;
+                        this_cpu->sock_gid  = -1;
+                        this_cpu->flows     = per_cpu_ptr(pfq_flows, cpu);
+                }
+        }
+
 #ifdef PFQ_USE_SKB_RECYCLE
         {
                 int cpu;
@@ -1593,7 +2471,7 @@ static int __init pfq_init_module(void)
         /* register pfq sniffer protocol */
         n = proto_register(&pfq_proto, 0);
         if (n != 0)
-                return n;
+                goto err_flows;
 
 	/* register the pfq socket */
         sock_register(&pfq_family_ops);
@@ -1607,6 +2485,14 @@ static int __init pfq_init_module(void)
 
 	printk(KERN_INFO "[PFQ] ready!\n");
         return 0;
+
+err_flows:
+        pfq_flow_free();
+err_groups:
+        pfq_groups_free();
+err_cpu:
+        free_percpu(cpu_data);
+        return n;
 }
 
 
@@ -1626,8 +2512,8 @@ static void __exit pfq_exit_module(void)
         /* disable direct capture */
         __pfq_devmap_monitor_reset();
 
-        /* wait grace period */
-        msleep(GRACE_PERIOD);
+        /* wait for the running pfq_receive */
+        synchronize_rcu();
 
         /* destroy pipeline queues (of each cpu) */
 
@@ -1637,6 +2523,10 @@ static void __exit pfq_exit_module(void)
                 struct pfq_queue_skb *this_queue = &local_cache->prefetch_queue;
                 struct sk_buff *skb;
 		int n = 0;
+
+                hrtimer_cancel(&local_cache->flush_timer);
+                tasklet_kill(&local_cache->flush_tasklet);
+
 		queue_for_each(skb, n, this_queue)
 		{
                         struct pfq_annotation *cb = pfq_skb_annotation(skb);
@@ -1655,10 +2545,19 @@ static void __exit pfq_exit_module(void)
         /* free per-cpu data */
 	free_percpu(cpu_data);
 
+        /* free group counters */
+        pfq_groups_free();
+
+        /* free flow tables */
+        pfq_flow_free();
+
 	/* free functions */
 
 	pfq_function_factory_free();
 
+        /* wait for the pending RCU callbacks (contexts, computations and filters) */
+        rcu_barrier();
+
         printk(KERN_INFO "[PFQ] unloaded.\n");
 }
 
@@ -1750,5 +2649,9 @@ EXPORT_SYMBOL_GPL(pfq_gro_receive);
 EXPORT_SYMBOL_GPL(pfq_register_functions);
 EXPORT_SYMBOL_GPL(pfq_unregister_functions);
 
+EXPORT_SYMBOL_GPL(__pfq_dissect_skb);
+EXPORT_SYMBOL_GPL(__pfq_dissect_tunnel);
+EXPORT_SYMBOL_GPL(__pfq_tunnel_type);
+
 module_init(pfq_init_module);
 module_exit(pfq_exit_module);
@@ -99,11 +99,22 @@ namespace pfq_lang
 
     PFQ_GEN_FUN(steer_mac    , "steer-mac"    )
     PFQ_GEN_FUN(steer_vlan   , "steer-vlan-id")
+    PFQ_GEN_FUN(steer_vlan_outer, "steer-vlan-outer")
+    PFQ_GEN_FUN(steer_vlan_inner, "steer-vlan-inner")
+    PFQ_GEN_FUN(steer_mpls   , "steer-mpls"   )
     PFQ_GEN_FUN(steer_ipv4   , "steer-ipv4"   )
     PFQ_GEN_FUN(steer_ipv6   , "steer-ipv6"   )
     PFQ_GEN_FUN(steer_flow   , "steer-flow"   )
+    PFQ_GEN_FUN(steer_flow6  , "steer-flow6"  )
+    PFQ_GEN_FUN(steer_tunnel , "steer-tunnel" )
     PFQ_GEN_FUN(steer_rtp    , "steer-rtp"    )
 
+    PFQ_GEN_FUN(balance      , "balance"      )
+    PFQ_GEN_FUN(balance_flow , "balance-flow" )
+
+    PFQ_GEN_FUN(sample       , "sample"       )
+    PFQ_GEN_FUN(sample_flow  , "sample-flow"  )
+
     PFQ_GEN_FUN(clone        , "clone"        )
     PFQ_GEN_FUN(broadcast    , "broadcast"    )
 
@@ -112,6 +123,16 @@ namespace pfq_lang
     PFQ_GEN_FUN(udp          , "udp"          )
     PFQ_GEN_FUN(tcp          , "tcp"          )
     PFQ_GEN_FUN(flow         , "flow"         )
+    PFQ_GEN_FUN(ipv6         , "ipv6"         )
+    PFQ_GEN_FUN(udp6         , "udp6"         )
+    PFQ_GEN_FUN(tcp6         , "tcp6"         )
+    PFQ_GEN_FUN(flow6        , "flow6"        )
+    PFQ_GEN_FUN(qinq         , "qinq"         )
+    PFQ_GEN_FUN(mpls         , "mpls"         )
+    PFQ_GEN_FUN(tunnel       , "tunnel"       )
+    PFQ_GEN_FUN(gre          , "gre"          )
+    PFQ_GEN_FUN(vxlan        , "vxlan"        )
+    PFQ_GEN_FUN(gtp          , "gtp"          )
     PFQ_GEN_FUN(rtp          , "rtp"          )
 
     PFQ_GEN_FUN(strict_vlan  , "strict-vlan"  )
@@ -119,6 +140,11 @@ namespace pfq_lang
     PFQ_GEN_FUN(strict_udp   , "strict-udp"   )
     PFQ_GEN_FUN(strict_tcp   , "strict-tcp"   )
     PFQ_GEN_FUN(strict_flow  , "strict-flow"  )
+    PFQ_GEN_FUN(strict_ipv6  , "strict-ipv6"  )
+    PFQ_GEN_FUN(strict_udp6  , "strict-udp6"  )
+    PFQ_GEN_FUN(strict_tcp6  , "strict-tcp6"  )
+    PFQ_GEN_FUN(strict_flow6 , "strict-flow6" )
+    PFQ_GEN_FUN(strict_tunnel, "strict-tunnel")
 
     PFQ_GEN_FUN(neg          , "neg"          )
     PFQ_GEN_FUN(par          , "par"          )
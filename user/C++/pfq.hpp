@@ -49,6 +49,16 @@
 #include <algorithm>
 #include <system_error>
 
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT  26
+#endif
+#ifndef MAP_HUGE_2MB
+#define MAP_HUGE_2MB    (21 << MAP_HUGE_SHIFT)
+#endif
+#ifndef MAP_HUGE_1GB
+#define MAP_HUGE_1GB    (30 << MAP_HUGE_SHIFT)
+#endif
+
 namespace
 {
 
@@ -102,21 +112,24 @@ namespace net {
         {
             friend struct queue::const_iterator;
 
-            iterator(pfq_hdr *h, size_t slot_size, size_t index)
-            : hdr_(h), slot_size_(slot_size), index_(index)
+            iterator(pfq_hdr *h, size_t slot_size, size_t index, bool varlen = false)
+            : hdr_(h), slot_size_(slot_size), index_(index), varlen_(varlen)
             {}
 
             ~iterator() = default;
 
             iterator(const iterator &other)
-            : hdr_(other.hdr_), slot_size_(other.slot_size_), index_(other.index_)
+            : hdr_(other.hdr_), slot_size_(other.slot_size_), index_(other.index_), varlen_(other.varlen_)
             {}
 
+            // with Q_LAYOUT_VARLEN the stride is read from the header:
+            // advance only when the current slot is ready.
+
             iterator &
             operator++()
             {
                 hdr_ = reinterpret_cast<pfq_hdr *>(
-                        reinterpret_cast<char *>(hdr_) + slot_size_);
+                        reinterpret_cast<char *>(hdr_) + (varlen_ ? MPDB_VARLEN_STRIDE(hdr_->caplen, slot_size_) : slot_size_));
                 return *this;
             }
 
@@ -170,21 +183,22 @@ namespace net {
             pfq_hdr *hdr_;
             size_t   slot_size_;
             size_t   index_;
+            bool     varlen_;
         };
 
         /* simple forward const_iterator over frames */
         struct const_iterator : public std::iterator<std::forward_iterator_tag, pfq_hdr>
         {
-            const_iterator(pfq_hdr *h, size_t slot_size, size_t index)
-            : hdr_(h), slot_size_(slot_size), index_(index)
+            const_iterator(pfq_hdr *h, size_t slot_size, size_t index, bool varlen = false)
+            : hdr_(h), slot_size_(slot_size), index_(index), varlen_(varlen)
             {}
 
             const_iterator(const const_iterator &other)
-            : hdr_(other.hdr_), slot_size_(other.slot_size_), index_(other.index_)
+            : hdr_(other.hdr_), slot_size_(other.slot_size_), index_(other.index_), varlen_(other.varlen_)
             {}
 
             const_iterator(const queue::iterator &other)
-            : hdr_(other.hdr_), slot_size_(other.slot_size_), index_(other.index_)
+            : hdr_(other.hdr_), slot_size_(other.slot_size_), index_(other.index_), varlen_(other.varlen_)
             {}
 
             ~const_iterator() = default;
@@ -193,7 +207,7 @@ namespace net {
             operator++()
             {
                 hdr_ = reinterpret_cast<pfq_hdr *>(
-                        reinterpret_cast<char *>(hdr_) + slot_size_);
+                        reinterpret_cast<char *>(hdr_) + (varlen_ ? MPDB_VARLEN_STRIDE(hdr_->caplen, slot_size_) : slot_size_));
                 return *this;
             }
 
@@ -247,11 +261,12 @@ namespace net {
             pfq_hdr *hdr_;
             size_t  slot_size_;
             size_t  index_;
+            bool    varlen_;
         };
 
     public:
-        queue(void *addr, size_t slot_size, size_t queue_len, size_t index)
-        : addr_(addr), slot_size_(slot_size), queue_len_(queue_len), index_(index)
+        queue(void *addr, size_t slot_size, size_t queue_len, size_t index, bool varlen = false)
+        : addr_(addr), slot_size_(slot_size), queue_len_(queue_len), index_(index), varlen_(varlen)
         {}
 
         ~queue() = default;
@@ -259,7 +274,8 @@ namespace net {
         size_t
         size() const
         {
-            // return the number of packets in this queue.
+            // return the number of packets in this queue
+            // (of slot_size units with Q_LAYOUT_VARLEN).
             return queue_len_;
         }
 
@@ -281,6 +297,12 @@ namespace net {
             return slot_size_;
         }
 
+        bool
+        varlen() const
+        {
+            return varlen_;
+        }
+
         const void *
         data() const
         {
@@ -290,40 +312,40 @@ namespace net {
         iterator
         begin()
         {
-            return iterator(reinterpret_cast<pfq_hdr *>(addr_), slot_size_, index_);
+            return iterator(reinterpret_cast<pfq_hdr *>(addr_), slot_size_, index_, varlen_);
         }
 
         const_iterator
         begin() const
         {
-            return const_iterator(reinterpret_cast<pfq_hdr *>(addr_), slot_size_, index_);
+            return const_iterator(reinterpret_cast<pfq_hdr *>(addr_), slot_size_, index_, varlen_);
         }
 
         iterator
         end()
         {
             return iterator(reinterpret_cast<pfq_hdr *>(
-                        static_cast<char *>(addr_) + queue_len_ * slot_size_), slot_size_, index_);
+                        static_cast<char *>(addr_) + queue_len_ * slot_size_), slot_size_, index_, varlen_);
         }
 
         const_iterator
         end() const
         {
             return const_iterator(reinterpret_cast<pfq_hdr *>(
-                        static_cast<char *>(addr_) + queue_len_ * slot_size_), slot_size_, index_);
+                        static_cast<char *>(addr_) + queue_len_ * slot_size_), slot_size_, index_, varlen_);
         }
 
         const_iterator
         cbegin() const
         {
-            return const_iterator(reinterpret_cast<pfq_hdr *>(addr_), slot_size_, index_);
+            return const_iterator(reinterpret_cast<pfq_hdr *>(addr_), slot_size_, index_, varlen_);
         }
 
         const_iterator
         cend() const
         {
             return const_iterator(reinterpret_cast<pfq_hdr *>(
-                        static_cast<char *>(addr_) + queue_len_ * slot_size_), slot_size_, index_);
+                        static_cast<char *>(addr_) + queue_len_ * slot_size_), slot_size_, index_, varlen_);
         }
 
     private:
@@ -331,6 +353,7 @@ namespace net {
         size_t  slot_size_;
         size_t  queue_len_;
         size_t  index_;
+        bool    varlen_;
     };
 
     static inline void * data_ready(pfq_hdr &h, uint8_t current_commit)
@@ -479,6 +502,10 @@ namespace net {
             size_t queue_caplen;
             size_t queue_offset;
             size_t slot_size;
+            size_t queue_rings;
+            size_t ring_next;
+            int    queue_layout;
+            size_t hugepage_size;       // 0: queue mmap'ed from the socket
         };
 
         int fd_;
@@ -618,7 +645,7 @@ namespace net {
                 throw pfq_error("PFQ: module not loaded");
 
             /* allocate pdata */
-            pdata_.reset(new pfq_data { -1, -1, nullptr, 0, 0, 0, offset, 0 });
+            pdata_.reset(new pfq_data { -1, -1, nullptr, 0, 0, 0, offset, 0, 1, 0, Q_LAYOUT_DEFAULT, 0 });
 
             /* get id */
             socklen_t size = sizeof(pdata_->id);
@@ -639,7 +666,62 @@ namespace net {
             if (::setsockopt(fd_, PF_Q, Q_SO_SET_OFFSET, &offset, sizeof(offset)) == -1)
                 throw pfq_error(errno, "PFQ: set offset error");
 
-            pdata_->slot_size = align<8>(sizeof(pfq_hdr) + pdata_->queue_caplen);
+            update_slot_size();
+        }
+
+        /* map the hugepages of the queue and hand them to the kernel */
+
+        void
+        hugepages_map()
+        {
+            size_t mem; socklen_t size = sizeof(mem);
+
+            if (::getsockopt(fd_, PF_Q, Q_SO_GET_QUEUE_MEM, &mem, &size) == -1)
+                throw pfq_error(errno, "PFQ: queue memory error");
+
+            auto page = pdata_->hugepage_size;
+            mem = (mem + page - 1) & ~(page - 1);
+
+            int flags = MAP_SHARED|MAP_ANONYMOUS|MAP_HUGETLB|MAP_POPULATE|
+                        (page == Q_HUGEPAGE_1G ? MAP_HUGE_1GB : MAP_HUGE_2MB);
+
+            pfq_hugepages hp { mmap(nullptr, mem, PROT_READ|PROT_WRITE, flags, -1, 0), mem };
+            if (hp.addr == MAP_FAILED)
+                throw pfq_error(errno, "PFQ: hugepages mmap error");
+
+            if (::setsockopt(fd_, PF_Q, Q_SO_SET_HUGEPAGES, &hp, sizeof(hp)) == -1) {
+                auto err = errno;
+                munmap(hp.addr, mem);
+                throw pfq_error(err, "PFQ: set hugepages error");
+            }
+
+            pdata_->queue_addr = hp.addr;
+            pdata_->queue_tot_mem = mem;
+        }
+
+
+        void
+        hugepages_reset()
+        {
+            pfq_hugepages hp { nullptr, 0 };
+
+            if (pdata_->queue_addr) {
+                munmap(pdata_->queue_addr, pdata_->queue_tot_mem);
+                pdata_->queue_addr = nullptr;
+                pdata_->queue_tot_mem = 0;
+            }
+
+            ::setsockopt(fd_, PF_Q, Q_SO_SET_HUGEPAGES, &hp, sizeof(hp));
+        }
+
+        /* the slot size depends on caplen and layout: it is read from the kernel */
+
+        void
+        update_slot_size()
+        {
+            socklen_t size = sizeof(pdata_->slot_size);
+            if (::getsockopt(fd_, PF_Q, Q_SO_GET_SLOT_SIZE, &pdata_->slot_size, &size) == -1)
+                throw pfq_error(errno, "PFQ: get slot size error");
         }
 
     public:
@@ -666,10 +748,19 @@ namespace net {
         {
             int one = 1;
 
+            if (pdata_->hugepage_size)
+                hugepages_map();
+
             if(::setsockopt(fd_, PF_Q, Q_SO_TOGGLE_QUEUE, &one, sizeof(one)) == -1) {
-                throw pfq_error(errno, "PFQ: queue: out of memory");
+                auto err = errno;
+                if (pdata_->hugepage_size)
+                    hugepages_reset();
+                throw pfq_error(err, "PFQ: queue: out of memory");
             }
 
+            if (pdata_->hugepage_size)
+                return;
+
             size_t tot_mem; socklen_t size = sizeof(tot_mem);
 
             if (::getsockopt(fd_, PF_Q, Q_SO_GET_QUEUE_MEM, &tot_mem, &size) == -1)
@@ -698,6 +789,32 @@ namespace net {
             int zero = 0;
             if(::setsockopt(fd_, PF_Q, Q_SO_TOGGLE_QUEUE, &zero, sizeof(zero)) == -1)
                 throw pfq_error(errno, "PFQ: queue cleanup error");
+
+            if (pdata_->hugepage_size)
+                hugepages_reset();
+        }
+
+
+        void
+        hugepages(size_t page_size)
+        {
+            if (enabled())
+                throw pfq_error("PFQ: enabled (hugepages could not be set)");
+
+            if (page_size != 0 && page_size != Q_HUGEPAGE_2M && page_size != Q_HUGEPAGE_1G)
+                throw pfq_error("PFQ: bad hugepage size");
+
+            pdata_->hugepage_size = page_size;
+        }
+
+
+        size_t
+        hugepages() const
+        {
+            if (!pdata_)
+                throw pfq_error("PFQ: socket not open");
+
+            return pdata_->hugepage_size;
         }
 
 
@@ -745,7 +862,7 @@ namespace net {
                 throw pfq_error(errno, "PFQ: set caplen error");
             }
 
-            pdata_->slot_size = align<8>(sizeof(pfq_hdr)+ value);
+            update_slot_size();
         }
 
 
@@ -815,6 +932,77 @@ namespace net {
         }
 
 
+        void
+        layout(int value)
+        {
+            if (enabled())
+                throw pfq_error("PFQ: enabled (layout could not be set)");
+
+            if (::setsockopt(fd_, PF_Q, Q_SO_SET_LAYOUT, &value, sizeof(value)) == -1) {
+                throw pfq_error(errno, "PFQ: set layout error");
+            }
+
+            pdata_->queue_layout = value;
+            update_slot_size();
+        }
+
+
+        int
+        layout() const
+        {
+           int ret; socklen_t size = sizeof(ret);
+           if (::getsockopt(fd_, PF_Q, Q_SO_GET_LAYOUT, &ret, &size) == -1)
+                throw pfq_error(errno, "PFQ: get layout error");
+           return ret;
+        }
+
+
+        void
+        numa_node(int node)
+        {
+            if (enabled())
+                throw pfq_error("PFQ: enabled (numa node could not be set)");
+
+            if (::setsockopt(fd_, PF_Q, Q_SO_SET_NUMA_NODE, &node, sizeof(node)) == -1)
+                throw pfq_error(errno, "PFQ: set numa node error");
+        }
+
+
+        int
+        numa_node() const
+        {
+           int node; socklen_t size = sizeof(node);
+           if (::getsockopt(fd_, PF_Q, Q_SO_GET_NUMA_NODE, &node, &size) == -1)
+                throw pfq_error(errno, "PFQ: get numa node error");
+           return node;
+        }
+
+
+        void
+        rings(size_t value)
+        {
+            if (enabled())
+                throw pfq_error("PFQ: enabled (rings could not be set)");
+
+            if (::setsockopt(fd_, PF_Q, Q_SO_SET_RINGS, &value, sizeof(value)) == -1) {
+                throw pfq_error(errno, "PFQ: set rings error");
+            }
+
+            pdata_->queue_rings = value;
+            pdata_->ring_next = 0;
+        }
+
+
+        size_t
+        rings() const
+        {
+            if (!pdata_)
+                throw pfq_error("PFQ: socket not open");
+
+            return pdata_->queue_rings;
+        }
+
+
         void
         bind(const char *dev, int queue = any_queue)
         {
@@ -876,14 +1064,16 @@ namespace net {
         std::vector<int>
         groups() const
         {
+            unsigned long mask[Q_GROUP_MASK_WORDS];
+            socklen_t size = sizeof(mask);
+            if (::getsockopt(fd_, PF_Q, Q_SO_GET_GROUPS, mask, &size) == -1)
+                throw pfq_error(errno, "PFQ: get groups error");
+
             std::vector<int> vec;
-            auto grps = this->groups_mask();
-            for(int n = 0; grps != 0; n++)
+            for(int n = 0; n < Q_MAX_GROUP; n++)
             {
-                if (grps & (1L << n)) {
+                if (mask[n / (sizeof(unsigned long) << 3)] & (1UL << (n % (sizeof(unsigned long) << 3))))
                     vec.push_back(n);
-                    grps &= ~(1L << n);
-                }
             }
 
             return vec;
@@ -941,6 +1131,93 @@ namespace net {
             }
         }
 
+        //
+        // steering weight of this socket in the group (1 on join)
+        //
+
+        void
+        set_group_weight(int gid, int weight)
+        {
+            struct pfq_group_weight w { gid, weight };
+            if (::setsockopt(fd_, PF_Q, Q_SO_GROUP_WEIGHT, &w, sizeof(w)) == -1)
+                throw pfq_error(errno, "PFQ: set group weight error");
+        }
+
+        int
+        group_weight(int gid) const
+        {
+            struct pfq_group_weight w { gid, 0 };
+            socklen_t len = sizeof(w);
+            if (::getsockopt(fd_, PF_Q, Q_SO_GET_GROUP_WEIGHT, &w, &len) == -1)
+                throw pfq_error(errno, "PFQ: get group weight error");
+            return w.weight;
+        }
+
+        //
+        // elephant flows of balanced steering (pps 0 disables the detection)
+        //
+
+        void
+        set_group_elephant(int gid, int policy, unsigned int pps)
+        {
+            struct pfq_group_elephant e { gid, policy, pps };
+            if (::setsockopt(fd_, PF_Q, Q_SO_GROUP_ELEPHANT, &e, sizeof(e)) == -1)
+                throw pfq_error(errno, "PFQ: set group elephant error");
+        }
+
+        pfq_group_elephant
+        group_elephant(int gid) const
+        {
+            struct pfq_group_elephant e { gid, 0, 0 };
+            socklen_t len = sizeof(e);
+            if (::getsockopt(fd_, PF_Q, Q_SO_GET_GROUP_ELEPHANT, &e, &len) == -1)
+                throw pfq_error(errno, "PFQ: get group elephant error");
+            return e;
+        }
+
+        //
+        // indirection table of steering: size must be a power of 2 (empty removes the table)
+        //
+
+        void
+        set_group_reta(int gid, std::vector<int> const &sock)
+        {
+            struct pfq_group_reta r { gid, static_cast<int>(sock.size()), const_cast<int *>(sock.data()) };
+            if (::setsockopt(fd_, PF_Q, Q_SO_GROUP_RETA, &r, sizeof(r)) == -1)
+                throw pfq_error(errno, "PFQ: set group reta error");
+        }
+
+        std::vector<int>
+        group_reta(int gid) const
+        {
+            std::vector<int> sock(Q_RETA_MAX);
+            struct pfq_group_reta r { gid, Q_RETA_MAX, sock.data() };
+            socklen_t len = sizeof(r);
+            if (::getsockopt(fd_, PF_Q, Q_SO_GET_GROUP_RETA, &r, &len) == -1)
+                throw pfq_error(errno, "PFQ: get group reta error");
+            sock.resize(r.size);
+            return sock;
+        }
+
+        // node of the devices of the hardware queues bound to the group
+
+        std::vector<pfq_queue_node>
+        group_nodes(int gid) const
+        {
+            struct pfq_group_nodes g { gid, 0, nullptr };
+            socklen_t len = sizeof(g);
+            if (::getsockopt(fd_, PF_Q, Q_SO_GET_GROUP_NODES, &g, &len) == -1)
+                throw pfq_error(errno, "PFQ: get group nodes error");
+
+            std::vector<pfq_queue_node> queue(g.size);
+            g.queue = queue.data();
+            if (::getsockopt(fd_, PF_Q, Q_SO_GET_GROUP_NODES, &g, &len) == -1)
+                throw pfq_error(errno, "PFQ: get group nodes error");
+
+            queue.resize(std::min(static_cast<size_t>(g.size), queue.size()));
+            return queue;
+        }
+
         void
         reset_group(int gid)
         {
@@ -970,6 +1247,17 @@ namespace net {
                 throw pfq_error(errno, "PFQ: reset group fprog error");
         }
 
+        int
+        group_fprog_mode(int gid) const
+        {
+            int mode = gid;
+            socklen_t size = sizeof(mode);
+
+            if (::getsockopt(fd_, PF_Q, Q_SO_GET_GROUP_FPROG_MODE, &mode, &size) == -1)
+                throw pfq_error(errno, "PFQ: get group fprog mode error");
+            return mode;   // Q_FPROG_NONE, Q_FPROG_INTERP or Q_FPROG_JIT
+        }
+
         int
         join_group(int gid, group_policy pol = group_policy::shared, class_mask mask = class_default)
         {
@@ -1024,27 +1312,50 @@ namespace net {
                 throw pfq_error("PFQ: not enabled");
 
             auto q = static_cast<struct pfq_queue_descr *>(pdata_->queue_addr);
+            auto rings = pdata_->queue_rings;
 
-            size_t data = q->data;
-            size_t index = MPDB_QUEUE_INDEX(data);
             size_t q_size = pdata_->queue_slots * pdata_->slot_size;
+            size_t max_len = 0;
+
+            bool varlen = pdata_->queue_layout & Q_LAYOUT_VARLEN;
+            size_t unit = varlen ? MPDB_QUEUE_SLOT_ALIGN(pdata_->queue_layout) : pdata_->slot_size;
+            size_t capacity = q_size / unit;
+
+            //  watermark for polling (on the fullest ring)...
 
-            //  watermark for polling...
+            for(size_t n = 0; n < rings; n++)
+                max_len = std::max(max_len, static_cast<size_t>(MPDB_QUEUE_LEN(q[n].data)));
 
-            if( MPDB_QUEUE_LEN(data) < (pdata_->queue_slots >> 1) ) {
+            if( max_len < (capacity >> 1) ) {
                 this->poll(microseconds);
             }
 
+            // the next ring with packets, round-robin...
+
+            auto ring = pdata_->ring_next;
+            for(size_t n = 0; n < rings; n++)
+            {
+                auto r = (pdata_->ring_next + n) % rings;
+                if (MPDB_QUEUE_LEN(q[r].data)) {
+                    ring = r;
+                    break;
+                }
+            }
+
+            pdata_->ring_next = (ring + 1) % rings;
+
+            size_t data = q[ring].data;
+            size_t index = MPDB_QUEUE_INDEX(data);
+
             // reset the next buffer...
 
-            data = __sync_lock_test_and_set(&q->data, (unsigned int)((index+1) << 24));
+            data = __sync_lock_test_and_set(&q[ring].data, (unsigned int)((index+1) << 24));
 
-            auto queue_len =  std::min(static_cast<size_t>(MPDB_QUEUE_LEN(data)), pdata_->queue_slots);
+            auto queue_len =  std::min(static_cast<size_t>(MPDB_QUEUE_LEN(data)), capacity);
 
-            return queue(static_cast<char *>(pdata_->queue_addr) +
-						 sizeof(pfq_queue_descr) +
-						 (index & 1) * q_size,
-                         pdata_->slot_size, queue_len, index);
+            return queue(reinterpret_cast<char *>(q + rings) +
+						 ((ring << 1) + (index & 1)) * q_size,
+                         unit, queue_len, index, varlen);
         }
 
 
@@ -1068,7 +1379,7 @@ namespace net {
                 throw pfq_error("PFQ: buffer too small");
 
             memcpy(buff.first, this_queue.data(), this_queue.slot_size() * this_queue.size());
-            return queue(buff.first, this_queue.slot_size(), this_queue.size(), this_queue.index());
+            return queue(buff.first, this_queue.slot_size(), this_queue.size(), this_queue.index(), this_queue.varlen());
         }
 
         // typedef void (*pfq_handler)(char *user, const struct pfq_hdr *h, const char *data);
@@ -1159,6 +1470,39 @@ namespace net {
         }
 
 
+        pfq_batch_stats
+        batch_stats() const
+        {
+            pfq_batch_stats stat;
+            socklen_t size = sizeof(struct pfq_batch_stats);
+            if (::getsockopt(fd_, PF_Q, Q_SO_GET_BATCH_STATS, &stat, &size) == -1)
+                throw pfq_error(errno, "PFQ: get batch stats error");
+            return stat;
+        }
+
+
+        pfq_flow_stats
+        flow_stats() const
+        {
+            pfq_flow_stats stat;
+            socklen_t size = sizeof(struct pfq_flow_stats);
+            if (::getsockopt(fd_, PF_Q, Q_SO_GET_FLOW_STATS, &stat, &size) == -1)
+                throw pfq_error(errno, "PFQ: get flow stats error");
+            return stat;
+        }
+
+
+        std::vector<int>
+        batch_len(int ncpu = Q_MAX_CPU) const
+        {
+            std::vector<int> len(ncpu);
+            socklen_t size = sizeof(int) * ncpu;
+            if (::getsockopt(fd_, PF_Q, Q_SO_GET_BATCH_LEN, len.data(), &size) == -1)
+                throw pfq_error(errno, "PFQ: get batch length error");
+            return len;
+        }
+
+
         size_t
         mem_size() const
         {
@@ -42,6 +42,16 @@
 
 #include <poll.h>
 
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT  26
+#endif
+#ifndef MAP_HUGE_2MB
+#define MAP_HUGE_2MB    (21 << MAP_HUGE_SHIFT)
+#endif
+#ifndef MAP_HUGE_1GB
+#define MAP_HUGE_1GB    (30 << MAP_HUGE_SHIFT)
+#endif
+
 /* pfq descriptor */
 
 typedef char * pfq_iterator_t;
@@ -49,9 +59,10 @@ typedef char * pfq_iterator_t;
 struct pfq_net_queue
 {
 	pfq_iterator_t queue; 	  		/* net queue */
-	size_t         len;       		/* number of packets in the queue */
-    	size_t         slot_size;
+	size_t         len;       		/* number of packets in the queue (units with Q_LAYOUT_VARLEN) */
+    	size_t         slot_size;               /* size of a slot (of a unit with Q_LAYOUT_VARLEN) */
 	unsigned int   index; 	  		/* current queue index */
+	int            layout;                  /* Q_LAYOUT_* flags */
 };
 
 
@@ -63,7 +74,12 @@ typedef struct
 	size_t queue_slots;
 	size_t queue_caplen;
 	size_t queue_offset;
+	size_t queue_rings;
 	size_t slot_size;
+	int    queue_layout;
+	size_t hugepage_size;           /* 0: queue mmap'ed from the socket */
+
+	unsigned int ring_next;         /* next ring to read */
 
 	const char * error;
 
@@ -78,8 +94,6 @@ typedef struct
 #define PFQ_LIBRARY
 #include <pfq.h>
 
-#define  ALIGN8(value) ((value + 7) & ~(__typeof__(value))7)
-
 #define max(a,b) \
 	({ __typeof__ (a) _a = (a); \
 	   __typeof__ (b) _b = (b); \
@@ -101,6 +115,19 @@ const char *pfq_error(pfq_t *q)
 }
 
 
+/* the slot size depends on caplen and layout: it is read from the kernel */
+
+static int
+pfq_update_slot_size(pfq_t *q)
+{
+	socklen_t size = sizeof(q->slot_size);
+	if (getsockopt(q->fd, PF_Q, Q_SO_GET_SLOT_SIZE, &q->slot_size, &size) == -1) {
+		return q->error = "PFQ: get slot size error", -1;
+	}
+	return 0;
+}
+
+
 /* costructor */
 
 pfq_t *
@@ -141,7 +168,11 @@ pfq_open_group(unsigned int class_mask, int group_policy, size_t caplen, size_t
 	q->queue_slots   = 0;
 	q->queue_caplen  = 0;
 	q->queue_offset  = offset;
+	q->queue_rings   = 1;
+	q->queue_layout  = Q_LAYOUT_DEFAULT;
+	q->hugepage_size = 0;
 	q->slot_size     = 0;
+	q->ring_next     = 0;
 	q->error 	 = NULL;
         memset(&q->netq, 0, sizeof(q->netq));
 
@@ -170,7 +201,9 @@ pfq_open_group(unsigned int class_mask, int group_policy, size_t caplen, size_t
 		return __error = "PFQ: set offset error", free(q), NULL;
 	}
 
-	q->slot_size = ALIGN8(sizeof(struct pfq_hdr) + q->queue_caplen);
+	if (pfq_update_slot_size(q) == -1) {
+		return __error = q->error, free(q), NULL;
+	}
 
 	if (group_policy != Q_GROUP_UNDEFINED)
 	{
@@ -205,15 +238,71 @@ int pfq_close(pfq_t *q)
 }
 
 
+/* map the hugepages of the queue and hand them to the kernel */
+
+static int
+pfq_hugepages_map(pfq_t *q)
+{
+	int flags = MAP_SHARED|MAP_ANONYMOUS|MAP_HUGETLB|MAP_POPULATE;
+	struct pfq_hugepages hp;
+	size_t mem; socklen_t size = sizeof(mem);
+
+	if (getsockopt(q->fd, PF_Q, Q_SO_GET_QUEUE_MEM, &mem, &size) == -1) {
+		return q->error = "PFQ: queue memory error", -1;
+	}
+
+	mem = (mem + q->hugepage_size - 1) & ~(q->hugepage_size - 1);
+	flags |= q->hugepage_size == Q_HUGEPAGE_1G ? MAP_HUGE_1GB : MAP_HUGE_2MB;
+
+	if ((hp.addr = mmap(NULL, mem, PROT_READ|PROT_WRITE, flags, -1, 0)) == MAP_FAILED) {
+		return q->error = "PFQ: hugepages mmap error", -1;
+	}
+	hp.size = mem;
+
+	if (setsockopt(q->fd, PF_Q, Q_SO_SET_HUGEPAGES, &hp, sizeof(hp)) == -1) {
+		munmap(hp.addr, mem);
+		return q->error = "PFQ: set hugepages error", -1;
+	}
+
+	q->queue_addr = hp.addr;
+	q->queue_tot_mem = mem;
+	return 0;
+}
+
+
+static void
+pfq_hugepages_reset(pfq_t *q)
+{
+	struct pfq_hugepages hp = { NULL, 0 };
+
+	if (q->queue_addr) {
+		munmap(q->queue_addr, q->queue_tot_mem);
+		q->queue_addr = NULL;
+		q->queue_tot_mem = 0;
+	}
+	setsockopt(q->fd, PF_Q, Q_SO_SET_HUGEPAGES, &hp, sizeof(hp));
+}
+
+
 int
 pfq_enable(pfq_t *q)
 {
 	int one = 1;
 
+	if (q->hugepage_size && pfq_hugepages_map(q) < 0) {
+		return -1;
+	}
+
 	if(setsockopt(q->fd, PF_Q, Q_SO_TOGGLE_QUEUE, &one, sizeof(one)) == -1) {
+		if (q->hugepage_size)
+			pfq_hugepages_reset(q);
 		return q->error = "PFQ: queue: out of memory", -1;
 	}
 
+	if (q->hugepage_size) {
+		return q->error = NULL, 0;
+	}
+
 	size_t tot_mem; socklen_t size = sizeof(tot_mem);
 
 	if (getsockopt(q->fd, PF_Q, Q_SO_GET_QUEUE_MEM, &tot_mem, &size) == -1) {
@@ -243,10 +332,37 @@ pfq_disable(pfq_t *q)
 	if(setsockopt(q->fd, PF_Q, Q_SO_TOGGLE_QUEUE, &zero, sizeof(zero)) == -1) {
 		return q->error = "PFQ: queue cleanup error", -1;
 	}
+
+	if (q->hugepage_size) {
+		pfq_hugepages_reset(q);
+	}
+	return q->error = NULL, 0;
+}
+
+
+int
+pfq_set_hugepages(pfq_t *q, size_t page_size)
+{
+	int enabled = pfq_is_enabled(q);
+	if (enabled == 1) {
+		return q->error =  "PFQ: enabled (hugepages could not be set)", -1;
+	}
+	if (page_size != 0 && page_size != Q_HUGEPAGE_2M && page_size != Q_HUGEPAGE_1G) {
+		return q->error = "PFQ: bad hugepage size", -1;
+	}
+
+	q->hugepage_size = page_size;
 	return q->error = NULL, 0;
 }
 
 
+size_t
+pfq_get_hugepages(pfq_t const *q)
+{
+	return q->hugepage_size;
+}
+
+
 int
 pfq_is_enabled(pfq_t const *q)
 {
@@ -339,7 +455,9 @@ pfq_set_caplen(pfq_t *q, size_t value)
 		return q->error = "PFQ: set caplen error", -1;
 	}
 
-	q->slot_size = ALIGN8(sizeof(struct pfq_hdr)+ value);
+	if (pfq_update_slot_size(q) == -1) {
+		return -1;
+	}
 	return q->error = NULL, 0;
 }
 
@@ -414,6 +532,61 @@ pfq_get_slot_size(pfq_t const *q)
 }
 
 
+int
+pfq_set_layout(pfq_t *q, int value)
+{
+	int enabled = pfq_is_enabled(q);
+	if (enabled == 1) {
+		return q->error =  "PFQ: enabled (layout could not be set)", -1;
+	}
+	if (setsockopt(q->fd, PF_Q, Q_SO_SET_LAYOUT, &value, sizeof(value)) == -1) {
+		return q->error = "PFQ: set layout error", -1;
+	}
+	q->queue_layout = value;
+	if (pfq_update_slot_size(q) == -1) {
+		return -1;
+	}
+	return q->error = NULL, 0;
+}
+
+
+int
+pfq_get_layout(pfq_t const *q)
+{
+	pfq_t * mutable = (pfq_t *)q;
+	int ret; socklen_t size = sizeof(ret);
+
+	if (getsockopt(q->fd, PF_Q, Q_SO_GET_LAYOUT, &ret, &size) == -1) {
+	        return mutable->error = "PFQ: get layout error", -1;
+	}
+	return mutable->error = NULL, ret;
+}
+
+
+int
+pfq_set_rings(pfq_t *q, size_t value)
+{
+	int enabled = pfq_is_enabled(q);
+	if (enabled == 1) {
+		return q->error =  "PFQ: enabled (rings could not be set)", -1;
+	}
+	if (setsockopt(q->fd, PF_Q, Q_SO_SET_RINGS, &value, sizeof(value)) == -1) {
+		return q->error = "PFQ: set rings error", -1;
+	}
+
+	q->queue_rings = value;
+	q->ring_next   = 0;
+	return q->error = NULL, 0;
+}
+
+
+size_t
+pfq_get_rings(pfq_t const *q)
+{
+	return q->queue_rings;
+}
+
+
 int
 pfq_bind_group(pfq_t *q, int gid, const char *dev, int queue)
 {
@@ -481,6 +654,19 @@ pfq_groups_mask(pfq_t const *q, unsigned long *_mask)
 }
 
 
+int
+pfq_groups_bitmap(pfq_t const *q, unsigned long *bitmap)
+{
+	socklen_t size = sizeof(unsigned long) * Q_GROUP_MASK_WORDS;
+	pfq_t * mutable = (pfq_t *)q;
+
+	if (getsockopt(q->fd, PF_Q, Q_SO_GET_GROUPS, bitmap, &size) == -1) {
+		return mutable->error = "PFQ: get groups error", -1;
+	}
+	return mutable->error = NULL, 0;
+}
+
+
 int
 pfq_set_group_function(pfq_t *q, int gid, const char *fun_name, int level)
 {
@@ -515,6 +701,117 @@ pfq_get_group_function_context(pfq_t *q, int gid, void *context, size_t size, in
 }
 
 
+int
+pfq_set_group_weight(pfq_t *q, int gid, int weight)
+{
+	struct pfq_group_weight w = { gid, weight };
+	if (setsockopt(q->fd, PF_Q, Q_SO_GROUP_WEIGHT, &w, sizeof(w)) == -1) {
+		return q->error = "PFQ: set group weight error", -1;
+	}
+	return q->error = NULL, 0;
+}
+
+
+int
+pfq_get_group_weight(pfq_t *q, int gid)
+{
+	struct pfq_group_weight w = { gid, 0 };
+	socklen_t len = sizeof(w);
+	if (getsockopt(q->fd, PF_Q, Q_SO_GET_GROUP_WEIGHT, &w, &len) == -1) {
+		return q->error = "PFQ: get group weight error", -1;
+	}
+	return q->error = NULL, w.weight;
+}
+
+
+int
+pfq_set_group_elephant(pfq_t *q, int gid, int policy, unsigned int pps)
+{
+	struct pfq_group_elephant e = { gid, policy, pps };
+	if (setsockopt(q->fd, PF_Q, Q_SO_GROUP_ELEPHANT, &e, sizeof(e)) == -1) {
+		return q->error = "PFQ: set group elephant error", -1;
+	}
+	return q->error = NULL, 0;
+}
+
+
+int
+pfq_get_group_elephant(pfq_t const *q, int gid, int *policy, unsigned int *pps)
+{
+	pfq_t * mutable = (pfq_t *)q;
+	struct pfq_group_elephant e = { gid, 0, 0 };
+	socklen_t len = sizeof(e);
+	if (getsockopt(q->fd, PF_Q, Q_SO_GET_GROUP_ELEPHANT, &e, &len) == -1) {
+		return mutable->error = "PFQ: get group elephant error", -1;
+	}
+	*policy = e.policy;
+	*pps    = e.pps;
+	return mutable->error = NULL, 0;
+}
+
+
+int
+pfq_set_group_reta(pfq_t *q, int gid, const int *sock, int size)
+{
+	struct pfq_group_reta r = { gid, size, (int *)sock };
+	if (setsockopt(q->fd, PF_Q, Q_SO_GROUP_RETA, &r, sizeof(r)) == -1) {
+		return q->error = "PFQ: set group reta error", -1;
+	}
+	return q->error = NULL, 0;
+}
+
+
+int
+pfq_get_group_reta(pfq_t *q, int gid, int *sock, int size)
+{
+	struct pfq_group_reta r = { gid, size, sock };
+	socklen_t len = sizeof(r);
+	if (getsockopt(q->fd, PF_Q, Q_SO_GET_GROUP_RETA, &r, &len) == -1) {
+		return q->error = "PFQ: get group reta error", -1;
+	}
+	return q->error = NULL, r.size;
+}
+
+
+int
+pfq_set_numa_node(pfq_t *q, int node)
+{
+	int enabled = pfq_is_enabled(q);
+	if (enabled == 1) {
+		return q->error =  "PFQ: enabled (numa node could not be set)", -1;
+	}
+	if (setsockopt(q->fd, PF_Q, Q_SO_SET_NUMA_NODE, &node, sizeof(node)) == -1) {
+		return q->error = "PFQ: set numa node error", -1;
+	}
+	return q->error = NULL, 0;
+}
+
+
+int
+pfq_get_numa_node(pfq_t const *q)
+{
+	pfq_t * mutable = (pfq_t *)q;
+	int node; socklen_t size = sizeof(node);
+
+	if (getsockopt(q->fd, PF_Q, Q_SO_GET_NUMA_NODE, &node, &size) == -1) {
+	        return mutable->error = "PFQ: get numa node error", Q_NUMA_ANY;
+	}
+	return mutable->error = NULL, node;
+}
+
+
+int
+pfq_get_group_nodes(pfq_t *q, int gid, struct pfq_queue_node *queue, int size)
+{
+	struct pfq_group_nodes g = { gid, size, queue };
+        socklen_t len = sizeof(g);
+	if (getsockopt(q->fd, PF_Q, Q_SO_GET_GROUP_NODES, &g, &len) == -1) {
+		return q->error = "PFQ: get group nodes error", -1;
+	}
+	return q->error = NULL, g.size;
+}
+
+
 int
 pfq_group_reset(pfq_t *q, int gid)
 {
@@ -559,6 +856,20 @@ pfq_group_fprog_reset(pfq_t *q, int gid)
 }
 
 
+int
+pfq_group_fprog_mode(pfq_t const *q, int gid)
+{
+	pfq_t *mutable = (pfq_t *)q;
+	socklen_t size = sizeof(gid);
+	int mode = gid;
+
+	if (getsockopt(q->fd, PF_Q, Q_SO_GET_GROUP_FPROG_MODE, &mode, &size) == -1) {
+		return mutable->error = "PFQ: get group fprog mode error", -1;
+	}
+	return mutable->error = NULL, mode;
+}
+
+
 int
 pfq_join_group(pfq_t *q, int gid, unsigned int class_mask, int group_policy)
 {
@@ -638,6 +949,45 @@ pfq_get_group_stats(pfq_t const *q, int gid, struct pfq_stats *stats)
 }
 
 
+int
+pfq_get_batch_stats(pfq_t const *q, struct pfq_batch_stats *stats)
+{
+	pfq_t *mutable = (pfq_t *)q;
+	socklen_t size = sizeof(struct pfq_batch_stats);
+
+	if (getsockopt(q->fd, PF_Q, Q_SO_GET_BATCH_STATS, stats, &size) == -1) {
+		return mutable->error = "PFQ: get batch stats error", -1;
+	}
+	return mutable->error = NULL, 0;
+}
+
+
+int
+pfq_get_flow_stats(pfq_t const *q, struct pfq_flow_stats *stats)
+{
+	pfq_t *mutable = (pfq_t *)q;
+	socklen_t size = sizeof(struct pfq_flow_stats);
+
+	if (getsockopt(q->fd, PF_Q, Q_SO_GET_FLOW_STATS, stats, &size) == -1) {
+		return mutable->error = "PFQ: get flow stats error", -1;
+	}
+	return mutable->error = NULL, 0;
+}
+
+
+int
+pfq_get_batch_len(pfq_t const *q, int *len, int ncpu)
+{
+	pfq_t *mutable = (pfq_t *)q;
+	socklen_t size = sizeof(int) * ncpu;
+
+	if (getsockopt(q->fd, PF_Q, Q_SO_GET_BATCH_LEN, len, &size) == -1) {
+		return mutable->error = "PFQ: get batch length error", -1;
+	}
+	return mutable->error = NULL, 0;
+}
+
+
 int
 pfq_vlan_filters_enable(pfq_t *q, int gid, int toggle)
 {
@@ -678,38 +1028,59 @@ int
 pfq_read(pfq_t *q, struct pfq_net_queue *nq, long int microseconds)
 {
 	size_t q_size = q->queue_slots * q->slot_size;
+	size_t unit = (q->queue_layout & Q_LAYOUT_VARLEN) ? MPDB_QUEUE_SLOT_ALIGN(q->queue_layout) : q->slot_size;
+	size_t capacity = q_size / unit;
 	struct pfq_queue_descr * qd;
-	unsigned int index, data;
+	unsigned int index, data, ring, n;
+	size_t max_len = 0;
 
         if (q->queue_addr == NULL) {
          	return q->error = "PFQ: read on pfq socket not enabled", -1;
 	}
 
 	qd = (struct pfq_queue_descr *)(q->queue_addr);
-	data   = qd->data;
-	index  = MPDB_QUEUE_INDEX(data);
 
-	/*  watermark for polling... */
+	/*  watermark for polling (on the fullest ring)... */
 
-	if( MPDB_QUEUE_LEN(data) < (q->queue_slots >> 1) ) {
+	for(n = 0; n < q->queue_rings; n++)
+		max_len = max(max_len, (size_t)MPDB_QUEUE_LEN(qd[n].data));
+
+	if( max_len < (capacity >> 1) ) {
 		if (pfq_poll(q, microseconds) < 0)
 		{
 			return -1;
 		}
 	}
 
+	/* the next ring with packets, round-robin... */
+
+	ring = q->ring_next;
+	for(n = 0; n < q->queue_rings; n++)
+	{
+		unsigned int r = (q->ring_next + n) % q->queue_rings;
+		if (MPDB_QUEUE_LEN(qd[r].data)) {
+			ring = r;
+			break;
+		}
+	}
+
+	q->ring_next = (ring + 1) % q->queue_rings;
+
+	data   = qd[ring].data;
+	index  = MPDB_QUEUE_INDEX(data);
+
 	/* reset the next buffer... */
 
-	data = __sync_lock_test_and_set(&qd->data, ((index+1) << 24));
+	data = __sync_lock_test_and_set(&qd[ring].data, ((index+1) << 24));
 
-	size_t queue_len = min(MPDB_QUEUE_LEN(data), q->queue_slots);
+	size_t queue_len = min(MPDB_QUEUE_LEN(data), capacity);
 
-	nq->queue = (char *)(q->queue_addr) +
-			    sizeof(struct pfq_queue_descr) +
-			    (index & 1) * q_size;
+	nq->queue = (char *)(qd + q->queue_rings) +
+			    ((ring << 1) + (index & 1)) * q_size;
 	nq->index = index;
 	nq->len   = queue_len;
-        nq->slot_size = q->slot_size;
+        nq->slot_size = unit;
+	nq->layout = q->queue_layout;
 
 	return q->error = NULL, (int)queue_len;
 }
@@ -725,7 +1096,7 @@ pfq_recv(pfq_t *q, void *buf, size_t buflen, struct pfq_net_queue *nq, long int
 		return q->error = "PFQ: buffer too small", -1;
 	}
 
-	memcpy(buf, nq->queue, q->slot_size * nq->len);
+	memcpy(buf, nq->queue, nq->slot_size * nq->len);
 	return q->error = NULL, 0;
 }
 
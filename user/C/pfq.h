@@ -75,9 +75,10 @@ typedef char * pfq_iterator_t;
 struct pfq_net_queue
 {
 	pfq_iterator_t queue; 	  		/* net queue */
-	size_t         len;       		/* number of packets in the queue */
-    size_t         slot_size;
+	size_t         len;       		/* number of packets in the queue (units with Q_LAYOUT_VARLEN) */
+    size_t         slot_size;           /* size of a slot (of a unit with Q_LAYOUT_VARLEN) */
 	unsigned int   index; 	  		/* current queue index */
+	int            layout;                  /* Q_LAYOUT_* flags */
 };
 #endif
 
@@ -98,14 +99,22 @@ pfq_net_queue_end(struct pfq_net_queue const *nq)
 }
 
 
+/* with Q_LAYOUT_VARLEN the stride is read from the header: move to the
+ * next slot only when the current one is ready.
+ */
+
 static inline
 pfq_iterator_t
 pfq_net_queue_next(struct pfq_net_queue const *nq, pfq_iterator_t iter)
 {
+    if (nq->layout & Q_LAYOUT_VARLEN)
+        return iter + MPDB_VARLEN_STRIDE(((const struct pfq_hdr *)iter)->caplen, nq->slot_size);
     return iter + nq->slot_size;
 }
 
 
+/* fixed layout only */
+
 static inline
 pfq_iterator_t
 pfq_net_queue_prev(struct pfq_net_queue const *nq, pfq_iterator_t iter)
@@ -210,6 +219,28 @@ extern size_t pfq_get_slots(pfq_t const *q);
 
 extern size_t pfq_get_slot_size(pfq_t const *q);
 
+/* Q_LAYOUT_* flags: the slot size is updated accordingly */
+
+extern int pfq_set_layout(pfq_t *q, int value);
+
+extern int pfq_get_layout(pfq_t const *q);
+
+/* queue on hugepages (Q_HUGEPAGE_2M or Q_HUGEPAGE_1G, 0 to disable): the
+ * memory is mapped from hugetlbfs when the socket is enabled.
+ */
+
+extern int pfq_set_hugepages(pfq_t *q, size_t page_size);
+
+extern size_t pfq_get_hugepages(pfq_t const *q);
+
+/* rings of the queue (1..Q_MAX_RINGS): the rx cpus share a ring only when
+ * they are more than the rings. pfq_read returns them round-robin.
+ */
+
+extern int pfq_set_rings(pfq_t *q, size_t value);
+
+extern size_t pfq_get_rings(pfq_t const *q);
+
 extern int pfq_bind_group(pfq_t *q, int gid, const char *dev, int queue);
 
 extern int pfq_bind(pfq_t *q, const char *dev, int queue);
@@ -218,7 +249,9 @@ extern int pfq_unbind_group(pfq_t *q, int gid, const char *dev, int queue); /* Q
 
 extern int pfq_unbind(pfq_t *q, const char *dev, int queue);
 
-extern int pfq_groups_mask(pfq_t const *q, unsigned long *_mask);
+extern int pfq_groups_mask(pfq_t const *q, unsigned long *_mask);     /* groups 0..63 only */
+
+extern int pfq_groups_bitmap(pfq_t const *q, unsigned long *bitmap);  /* unsigned long[Q_GROUP_MASK_WORDS] */
 
 extern int pfq_set_group_function(pfq_t *q, int gid, const char *fun_name, int level);
 
@@ -228,10 +261,34 @@ extern int pfq_get_group_function_context(pfq_t *q, int gid, void *context, size
 
 extern int pfq_group_reset(pfq_t *q, int gid);
 
+extern int pfq_set_group_weight(pfq_t *q, int gid, int weight);                 /* 1..Q_MAX_WEIGHT */
+
+extern int pfq_get_group_weight(pfq_t *q, int gid);
+
+extern int pfq_set_group_elephant(pfq_t *q, int gid, int policy, unsigned int pps);  /* Q_ELEPHANT_*, pps 0 disables */
+
+extern int pfq_get_group_elephant(pfq_t const *q, int gid, int *policy, unsigned int *pps);
+
+extern int pfq_set_group_reta(pfq_t *q, int gid, const int *sock, int size);     /* size 0 removes the table */
+
+extern int pfq_get_group_reta(pfq_t *q, int gid, int *sock, int size);           /* returns the size of the table */
+
+/* numa node of the queue (Q_NUMA_ANY, Q_NUMA_LOCAL or node), and of the
+ * devices of the hardware queues bound to a group.
+ */
+
+extern int pfq_set_numa_node(pfq_t *q, int node);
+
+extern int pfq_get_numa_node(pfq_t const *q);
+
+extern int pfq_get_group_nodes(pfq_t *q, int gid, struct pfq_queue_node *queue, int size);  /* returns the number of queues */
+
 extern int pfq_group_fprog(pfq_t *q, int gid, struct sock_fprog *);
 
 extern int pfq_group_fprog_reset(pfq_t *q, int gid);
 
+extern int pfq_group_fprog_mode(pfq_t const *q, int gid);   /* Q_FPROG_NONE, Q_FPROG_INTERP or Q_FPROG_JIT */
+
 extern int pfq_vlan_filters_enable(pfq_t *q, int gid, int toggle);
 
 extern int pfq_vlan_set_filter(pfq_t *q, int gid, int vid);
@@ -265,5 +322,11 @@ extern int pfq_get_stats(pfq_t const *q, struct pfq_stats *stats);
 
 extern int pfq_get_group_stats(pfq_t const *q, int gid, struct pfq_stats *stats);
 
+extern int pfq_get_batch_stats(pfq_t const *q, struct pfq_batch_stats *stats);
+
+extern int pfq_get_batch_len(pfq_t const *q, int *len, int ncpu);     /* ncpu <= Q_MAX_CPU */
+
+extern int pfq_get_flow_stats(pfq_t const *q, struct pfq_flow_stats *stats);
+
 
 #endif /* _PFQ_H_ */
@@ -95,11 +95,22 @@ instance Show (Computation a) where
 
 steer_mac    = Computation comp_type "steer-mac"     Nothing
 steer_vlan   = Computation comp_type "steer-vlan-id" Nothing
+steer_vlan_outer = Computation comp_type "steer-vlan-outer" Nothing
+steer_vlan_inner = Computation comp_type "steer-vlan-inner" Nothing
+steer_mpls   = Computation comp_type "steer-mpls"    Nothing
 steer_ipv4   = Computation comp_type "steer-ipv4"    Nothing
 steer_ipv6   = Computation comp_type "steer-ipv6"    Nothing
 steer_flow   = Computation comp_type "steer-flow"    Nothing
+steer_flow6  = Computation comp_type "steer-flow6"   Nothing
+steer_tunnel = Computation comp_type "steer-tunnel"  Nothing
 steer_rtp    = Computation comp_type "steer-rtp"     Nothing
 
+balance      = Computation comp_type "balance"       Nothing
+balance_flow = Computation comp_type "balance-flow"  Nothing
+
+sample       = Computation comp_type "sample"        Nothing
+sample_flow  = Computation comp_type "sample-flow"   Nothing
+
 clone        = Computation comp_type "clone"         Nothing
 broadcast    = Computation comp_type "broadcast"     Nothing
 
@@ -108,6 +119,16 @@ ipv4         = Computation comp_type "ipv4"          Nothing
 udp          = Computation comp_type "udp"           Nothing
 tcp          = Computation comp_type "tcp"           Nothing
 flow         = Computation comp_type "flow"          Nothing
+ipv6         = Computation comp_type "ipv6"          Nothing
+udp6         = Computation comp_type "udp6"          Nothing
+tcp6         = Computation comp_type "tcp6"          Nothing
+flow6        = Computation comp_type "flow6"         Nothing
+qinq         = Computation comp_type "qinq"          Nothing
+mpls         = Computation comp_type "mpls"          Nothing
+tunnel       = Computation comp_type "tunnel"        Nothing
+gre          = Computation comp_type "gre"           Nothing
+vxlan        = Computation comp_type "vxlan"         Nothing
+gtp          = Computation comp_type "gtp"           Nothing
 rtp          = Computation comp_type "rtp"           Nothing
 
 strict_vlan  = Computation comp_type "strict-vlan"   Nothing
@@ -115,6 +136,11 @@ strict_ipv4  = Computation comp_type "strict-ipv4"   Nothing
 strict_udp   = Computation comp_type "strict-udp"    Nothing
 strict_tcp   = Computation comp_type "strict-tcp"    Nothing
 strict_flow  = Computation comp_type "strict-flow"   Nothing
+strict_ipv6  = Computation comp_type "strict-ipv6"   Nothing
+strict_udp6  = Computation comp_type "strict-udp6"   Nothing
+strict_tcp6  = Computation comp_type "strict-tcp6"   Nothing
+strict_flow6 = Computation comp_type "strict-flow6"  Nothing
+strict_tunnel = Computation comp_type "strict-tunnel" Nothing
 
 neg          = Computation comp_type "neg"           Nothing
 par          = Computation comp_type "par"           Nothing
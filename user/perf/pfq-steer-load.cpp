@@ -0,0 +1,237 @@
+/***************************************************************
+ *
+ * (C) 2011-13 Nicola Bonelli <nicola.bonelli@cnit.it>
+ *
+ * Socket load distribution of the steering functions for a given pcap:
+ * the hash and the folding are the same of the kernel module.
+ *
+ ****************************************************************/
+
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <stdexcept>
+#include <cstring>
+#include <cstdlib>
+
+#include <net/ethernet.h>
+#include <netinet/ip.h>
+#include <netinet/ip6.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <pcap.h>
+
+#include <linux/pf_q-hash.h>
+
+
+namespace opt
+{
+    std::string function = "steer-flow";
+    int hash = Q_HASH_LEGACY;
+    uint32_t seed = 0;
+    unsigned int sockets = 2;
+}
+
+
+/* same as pfq_fold in the kernel */
+
+static unsigned int
+clp2(unsigned int x)
+{
+    x = x - 1;
+    x = x | (x >> 1);
+    x = x | (x >> 2);
+    x = x | (x >> 4);
+    x = x | (x >> 8);
+    x = x | (x >> 16);
+    return x + 1;
+}
+
+
+static unsigned int
+fold(unsigned int a, unsigned int b)
+{
+    const unsigned int c = b - 1;
+    if (b & c) {
+        const unsigned int p = clp2(b);
+        const unsigned int r = a & (p-1);
+        return r < b ? r : a % b;
+    }
+    return a & c;
+}
+
+
+/* steering(): 24-bit hash, then the socket selection of pfq_receive */
+
+static unsigned int
+select_socket(uint32_t hash)
+{
+    uint32_t h = (hash ^ (hash >> 8)) & 0xffffff;
+    h = h ^ (h >> 8) ^ (h >> 16);
+    return fold(h, opt::sockets);
+}
+
+
+static bool
+steer(const u_char *pkt, size_t caplen, uint32_t &hash)
+{
+    if (caplen < sizeof(ether_header))
+        return false;
+
+    auto eth = reinterpret_cast<const ether_header *>(pkt);
+
+    if (opt::function == "steer-mac") {
+        uint16_t a[6];
+        memcpy(a, eth, sizeof(a));
+        hash = opt::hash == Q_HASH_LEGACY ? (uint32_t)(a[0] ^ a[1] ^ a[2] ^ a[3] ^ a[4] ^ a[5]) :
+                    pfq_hash_2words(opt::hash, ((uint32_t)a[0] << 16 | a[1]) ^ a[2], ((uint32_t)a[3] << 16 | a[4]) ^ a[5], opt::seed);
+        return true;
+    }
+
+    size_t off = sizeof(ether_header);
+    uint16_t proto = eth->ether_type;
+
+    if (proto == htons(ETHERTYPE_VLAN)) {
+        if (caplen < off + 4)
+            return false;
+        memcpy(&proto, pkt + off + 2, sizeof(proto));
+        off += 4;
+    }
+
+    uint8_t l4 = 0;
+    size_t l4_off = 0;
+
+    if (proto == htons(ETHERTYPE_IP) && opt::function != "steer-ipv6") {
+
+        if (caplen < off + sizeof(iphdr))
+            return false;
+
+        iphdr ip;
+        memcpy(&ip, pkt + off, sizeof(ip));
+
+        if (opt::function == "steer-ipv4") {
+            hash = pfq_hash_2words(opt::hash, ip.saddr, ip.daddr, opt::seed);
+            return true;
+        }
+
+        l4 = ip.protocol;
+        l4_off = off + ip.ihl * 4;
+
+        if (l4 != IPPROTO_TCP && l4 != IPPROTO_UDP)
+            return false;
+
+        /* fragments are steered by addresses and ip id, as in the kernel */
+
+        if (ntohs(ip.frag_off) & (IP_MF | IP_OFFMASK)) {
+            hash = pfq_hash_flow(opt::hash, ip.saddr, ip.daddr, ntohs(ip.id), 0, opt::seed);
+            return true;
+        }
+        if (caplen < l4_off + 4)
+            return false;
+
+        uint16_t ports[2];
+        memcpy(ports, pkt + l4_off, sizeof(ports));
+
+        hash = pfq_hash_flow(opt::hash, ip.saddr, ip.daddr, ports[0], ports[1], opt::seed);
+        return true;
+    }
+
+    if (proto == htons(ETHERTYPE_IPV6) && opt::function == "steer-ipv6") {
+
+        if (caplen < off + sizeof(ip6_hdr))
+            return false;
+
+        ip6_hdr ip6;
+        memcpy(&ip6, pkt + off, sizeof(ip6));
+
+        uint32_t s[4], d[4];
+        memcpy(s, &ip6.ip6_src, sizeof(s));
+        memcpy(d, &ip6.ip6_dst, sizeof(d));
+
+        hash = pfq_hash_ip6(opt::hash, s, d, opt::seed);
+        return true;
+    }
+
+    return false;
+}
+
+
+int
+main(int argc, char *argv[])
+try
+{
+    if (argc < 3)
+        throw std::runtime_error(std::string("usage: ").append(argv[0])
+                .append(" file.pcap sockets [steer-flow|steer-ipv4|steer-ipv6|steer-mac] [legacy|jhash|toeplitz] [seed]"));
+
+    opt::sockets = std::max(1, atoi(argv[2]));
+
+    if (argc > 3)
+        opt::function = argv[3];
+
+    if (argc > 4) {
+        std::string h(argv[4]);
+        if (h == "legacy")
+            opt::hash = Q_HASH_LEGACY;
+        else if (h == "jhash")
+            opt::hash = Q_HASH_JHASH;
+        else if (h == "toeplitz")
+            opt::hash = Q_HASH_TOEPLITZ;
+        else
+            throw std::runtime_error("unknown hash " + h);
+    }
+
+    if (argc > 5)
+        opt::seed = static_cast<uint32_t>(strtoul(argv[5], nullptr, 0));
+
+    char errbuf[PCAP_ERRBUF_SIZE];
+
+    pcap_t *p = pcap_open_offline(argv[1], errbuf);
+    if (p == nullptr)
+        throw std::runtime_error(errbuf);
+
+    std::vector<unsigned long> load(opt::sockets);
+    unsigned long total = 0, dropped = 0;
+
+    struct pcap_pkthdr *h;
+    const u_char *pkt;
+
+    while (pcap_next_ex(p, &h, &pkt) == 1)
+    {
+        uint32_t hash;
+
+        if (steer(pkt, h->caplen, hash)) {
+            load[select_socket(hash)]++;
+            total++;
+        }
+        else
+            dropped++;
+    }
+
+    pcap_close(p);
+
+    std::cout << opt::function << " (" << (argc > 4 ? argv[4] : "legacy") << ") on " << opt::sockets << " sockets: "
+              << total << " packets steered, " << dropped << " dropped" << std::endl;
+
+    for(unsigned int n = 0; n < opt::sockets; n++)
+    {
+        std::cout << "  socket " << std::setw(3) << n << ": " << std::setw(12) << load[n] << "  "
+                  << std::fixed << std::setprecision(2) << (total ? 100.0 * load[n] / total : 0.0) << "%" << std::endl;
+    }
+
+    auto mm = std::minmax_element(load.begin(), load.end());
+    if (*mm.first)
+        std::cout << "max/min load: " << std::setprecision(2) << static_cast<double>(*mm.second) / *mm.first << std::endl;
+    else
+        std::cout << "max/min load: inf" << std::endl;
+
+    return 0;
+}
+catch(std::exception &e)
+{
+    std::cerr << e.what() << std::endl;
+    return -1;
+}
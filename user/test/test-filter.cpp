@@ -1,4 +1,5 @@
 #include <cstdio>
+#include <iostream>
 #include <string>
 #include <stdexcept>
 
@@ -17,10 +18,15 @@ main(int argc, char *argv[])
 
     r.timestamp_enable(true);
 
-    struct sock_fprog p { 1, nullptr };
+    struct sock_filter accept { 0x06, 0, 0, 0xffffffff };  // ret #-1
+    struct sock_fprog p { 1, &accept };
 
     r.set_group_fprog(r.group_id(), p);
 
+    auto mode = r.group_fprog_mode(r.group_id());
+    std::cout << "filter mode: " << (mode == Q_FPROG_JIT    ? "jit" :
+                                     mode == Q_FPROG_INTERP ? "interpreter" : "none") << std::endl;
+
     std::this_thread::sleep_for(std::chrono::seconds(1));
 
     r.reset_group_fprog(r.group_id());
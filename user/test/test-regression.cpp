@@ -1,15 +1,240 @@
 #include <pfq.hpp>
 #include <future>
 #include <system_error>
+#include <fstream>
+#include <thread>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <cstring>
 
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <linux/if_packet.h>
+#include <linux/if_ether.h>
 
 #include "yats.hpp"
 
 using namespace yats;
 using namespace net;
 
+
+// module parameter, overridden for the lifetime of the object
+
+struct module_param
+{
+    module_param(const char *name, const char *value)
+    : path_(std::string("/sys/module/pfq/parameters/") + name)
+    {
+        std::ifstream(path_) >> value_;
+        std::ofstream(path_) << value;
+    }
+
+    ~module_param()
+    {
+        std::ofstream(path_) << value_;
+    }
+
+    std::string path_;
+    std::string value_;
+};
+
+
+// test frames: sent on the loopback, they come back as incoming packets and
+// are told apart by the tag in the source mac (02:50:46:51:tag:tag)
+
+typedef std::vector<uint8_t> frame;
+
+static frame &
+put(frame &f, uint32_t value, int bytes)
+{
+    for(int n = bytes - 1; n >= 0; n--)
+        f.push_back(static_cast<uint8_t>(value >> (n * 8)));
+    return f;
+}
+
+static frame
+eth_frame(uint16_t tag, uint16_t proto)
+{
+    frame f(ETH_ALEN, 0);
+    put(f, 0x02504651, 4);
+    put(f, tag, 2);
+    return put(f, proto, 2);
+}
+
+static frame &
+vlan_tag(frame &f, uint16_t vid, uint16_t proto)
+{
+    put(f, vid, 2);
+    return put(f, proto, 2);
+}
+
+static frame &
+mpls_label(frame &f, uint32_t label, bool bos)
+{
+    return put(f, label << 12 | (bos ? 0x100 : 0) | 64, 4);
+}
+
+// checksums are left invalid: the stack drops the frames after the capture
+
+static frame &
+ip4_hdr(frame &f, uint32_t saddr, uint32_t daddr, uint8_t proto, uint16_t id = 0, uint16_t frag = 0)
+{
+    put(f, 0x4500, 2);
+    put(f, 60, 2);
+    put(f, id, 2);
+    put(f, frag, 2);
+    put(f, 64 << 8 | proto, 2);
+    put(f, 0, 2);
+    put(f, saddr, 4);
+    return put(f, daddr, 4);
+}
+
+static frame &
+ip6_hdr(frame &f, uint32_t saddr, uint32_t daddr, uint8_t next)
+{
+    put(f, 0x60000000, 4);
+    put(f, 40, 2);
+    put(f, next << 8 | 64, 2);
+    put(f, 0xfd000000, 4); put(f, 0, 4); put(f, 0, 4); put(f, saddr, 4);
+    put(f, 0xfd000000, 4); put(f, 0, 4); put(f, 0, 4); return put(f, daddr, 4);
+}
+
+static frame &
+ip6_opts(frame &f, uint8_t next)
+{
+    put(f, next << 8, 2);
+    put(f, 0x0104, 2);      // PadN up to 8 bytes
+    return put(f, 0, 4);
+}
+
+static frame &
+ip6_frag(frame &f, uint8_t next, uint32_t id, uint16_t offset, bool more)
+{
+    put(f, next << 8, 2);
+    put(f, offset << 3 | (more ? 1 : 0), 2);
+    return put(f, id, 4);
+}
+
+static frame &
+udp_hdr(frame &f, uint16_t sport, uint16_t dport)
+{
+    put(f, sport, 2);
+    put(f, dport, 2);
+    put(f, 16, 2);
+    return put(f, 0, 2);
+}
+
+static frame &
+tcp_hdr(frame &f, uint16_t sport, uint16_t dport)
+{
+    put(f, sport, 2);
+    put(f, dport, 2);
+    put(f, 0, 4);
+    put(f, 0, 4);
+    put(f, 0x5002, 2);
+    put(f, 0xffff, 2);
+    return put(f, 0, 4);
+}
+
+static frame &
+gre_hdr(frame &f, uint16_t proto)
+{
+    put(f, 0, 2);
+    return put(f, proto, 2);
+}
+
+
+static void
+inject(const char *dev, std::vector<frame> frames)
+{
+    int fd = ::socket(AF_PACKET, SOCK_RAW, 0);
+    if (fd == -1)
+        throw std::system_error(errno, std::generic_category(), "inject");
+
+    struct sockaddr_ll addr;
+    memset(&addr, 0, sizeof(addr));
+
+    addr.sll_family  = AF_PACKET;
+    addr.sll_ifindex = static_cast<int>(if_nametoindex(dev));
+    addr.sll_halen   = ETH_ALEN;
+
+    for(auto & f : frames)
+    {
+        f.resize(std::max<size_t>(f.size(), ETH_ZLEN));
+
+        if (::sendto(fd, f.data(), f.size(), 0, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) == -1)
+        {
+            ::close(fd);
+            throw std::system_error(errno, std::generic_category(), "inject");
+        }
+    }
+
+    ::close(fd);
+}
+
+
+// test frames read by each socket, counted by tag: reads until n frames are
+// collected (one more round catches the unexpected ones), 2 sec at most
+
+static std::vector<std::map<int, int>>
+read_tags(std::vector<pfq *> qs, size_t n)
+{
+    std::vector<std::map<int, int>> tags(qs.size());
+    size_t count = 0;
+
+    for(int round = 0; round < 20; round++)
+    {
+        bool last = count >= n;
+
+        for(size_t i = 0; i < qs.size(); i++)
+        {
+            auto many = qs[i]->read(100000);
+
+            for(auto it = many.begin(); it != many.end(); ++it)
+            {
+                while (!it.ready())
+                    std::this_thread::yield();
+
+                auto p = static_cast<const uint8_t *>(it.data());
+                if (it->caplen < 12 || memcmp(p + 6, "\x02\x50\x46\x51", 4) != 0)
+                    continue;
+
+                tags[i][p[10] << 8 | p[11]]++;
+                count++;
+            }
+        }
+
+        if (last)
+            break;
+    }
+
+    return tags;
+}
+
+
+// for each tag: the number of sockets it was read from and of its frames
+
+static std::map<int, std::pair<int, int>>
+by_tag(const std::vector<std::map<int, int>> &tags)
+{
+    std::map<int, std::pair<int, int>> ret;
+    for(auto & t : tags)
+        for(auto & e : t)
+        {
+            ret[e.first].first++;
+            ret[e.first].second += e.second;
+        }
+    return ret;
+}
+
+
 Context(PFQ)
 {
     const std::string DEV("eth0");
@@ -179,6 +404,31 @@ Context(PFQ)
     }
 
 
+    Test(rings)
+    {
+        pfq x;
+        AssertThrow(x.rings(2));
+        AssertThrow(x.rings());
+
+        x.open(group_policy::undefined, 64, 0, 1024);
+        Assert(x.rings(), is_equal_to(1));
+
+        AssertThrow(x.rings(0));
+        AssertThrow(x.rings(Q_MAX_RINGS + 1));
+
+        x.rings(4);
+        Assert(x.rings(), is_equal_to(4));
+
+        x.enable();
+        AssertThrow(x.rings(2));
+
+        auto q = x.read(10);
+        Assert(q.size(), is_equal_to(0));
+
+        x.disable();
+    }
+
+
     Test(slot_size)
     {
         pfq x;
@@ -191,6 +441,115 @@ Context(PFQ)
     }
 
 
+    Test(layout)
+    {
+        pfq x;
+        AssertThrow(x.layout(Q_LAYOUT_CACHELINE));
+
+        x.open(group_policy::undefined, 64);
+        Assert(x.layout(), is_equal_to(Q_LAYOUT_DEFAULT));
+
+        AssertThrow(x.layout(-1));
+
+        x.layout(Q_LAYOUT_CACHELINE);
+        Assert(x.layout(), is_equal_to(Q_LAYOUT_CACHELINE));
+        Assert(x.slot_size() % Q_CACHELINE_SIZE, is_equal_to(0));
+        Assert(x.slot_size() >= 64 + sizeof(pfq_hdr));
+
+        x.enable();
+        AssertThrow(x.layout(Q_LAYOUT_DEFAULT));
+        x.disable();
+
+        x.layout(Q_LAYOUT_DEFAULT);
+        auto size = 64 + sizeof(pfq_hdr);
+        Assert(x.slot_size(), is_equal_to( size + (size % 8) ));
+    }
+
+
+    Test(layout_varlen)
+    {
+        pfq x;
+        x.open(group_policy::undefined, 1514, 0, 1024);
+
+        auto size = x.slot_size();
+
+        x.layout(Q_LAYOUT_VARLEN|Q_LAYOUT_CACHELINE);
+        Assert(x.layout(), is_equal_to(Q_LAYOUT_VARLEN|Q_LAYOUT_CACHELINE));
+        Assert(x.slot_size() >= size);
+
+        x.enable();
+
+        auto q = x.read(10);
+        Assert(q.varlen());
+        Assert(q.slot_size(), is_equal_to(Q_CACHELINE_SIZE));
+        Assert(q.begin() == q.end());
+
+        x.disable();
+    }
+
+
+    Test(hugepages)
+    {
+        pfq x;
+        AssertThrow(x.hugepages());
+
+        x.open(group_policy::undefined, 64, 0, 1024);
+        Assert(x.hugepages(), is_equal_to(0));
+
+        AssertThrow(x.hugepages(4096));
+
+        x.hugepages(Q_HUGEPAGE_2M);
+        Assert(x.hugepages(), is_equal_to(Q_HUGEPAGE_2M));
+
+        x.hugepages(0);
+        Assert(x.hugepages(), is_equal_to(0));
+
+        // memory that is not hugetlb backed is refused
+
+        pfq_hugepages hp { mmap(nullptr, Q_HUGEPAGE_2M, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0), Q_HUGEPAGE_2M };
+        Assert(hp.addr != MAP_FAILED);
+
+        Assert(::setsockopt(x.fd(), PF_Q, Q_SO_SET_HUGEPAGES, &hp, sizeof(hp)), is_equal_to(-1));
+        Assert(errno, is_equal_to(EINVAL));
+
+        munmap(hp.addr, Q_HUGEPAGE_2M);
+    }
+
+
+    Test(numa_node)
+    {
+        pfq x;
+        AssertThrow(x.numa_node(0));
+
+        x.open(group_policy::undefined, 64, 0, 1024);
+        Assert(x.numa_node(), is_equal_to(Q_NUMA_ANY));
+
+        AssertThrow(x.numa_node(-3));
+
+        x.numa_node(Q_NUMA_LOCAL);
+        Assert(x.numa_node(), is_equal_to(Q_NUMA_LOCAL));
+
+        x.enable();
+        Assert(x.numa_node() >= 0);
+        AssertThrow(x.numa_node(Q_NUMA_ANY));
+        x.disable();
+    }
+
+
+    Test(group_nodes)
+    {
+        pfq x(group_policy::shared, 64);
+
+        Assert(x.group_nodes(x.group_id()).empty());
+
+        x.bind_group(x.group_id(), "lo");
+
+        auto v = x.group_nodes(x.group_id());
+        Assert(v.empty(), is_equal_to(false));
+        Assert(v[0].if_index, is_equal_to(net::ifindex(x.fd(), "lo")));
+    }
+
+
     Test(bind_device)
     {
         pfq x;
@@ -320,6 +679,238 @@ Context(PFQ)
         Assert(s.drop, is_equal_to(0));
     }
 
+    Test(batch_stats)
+    {
+        pfq x;
+        AssertThrow(x.batch_stats());
+
+        x.open(group_policy::undefined, 64);
+
+        AssertNothrow(x.batch_stats());
+    }
+
+    Test(batch_len)
+    {
+        pfq x(group_policy::undefined, 64);
+
+        auto v = x.batch_len();
+        Assert(v.size(), is_equal_to(Q_MAX_CPU));
+        Assert(v[0] > 0, is_true());
+        Assert(v[0] <= 64, is_true());
+
+        AssertThrow(x.batch_len(Q_MAX_CPU + 1));
+    }
+
+    Test(batch_len_adapt)
+    {
+        module_param max("prefetch_max", "64");
+
+        pfq x(group_policy::priv, 64);
+        x.bind("lo");
+        x.enable();
+
+        // sustained traffic fills the batches well within the budget: they grow
+
+        std::vector<frame> frames;
+        for(int n = 0; n < 512; n++)
+        {
+            auto f = eth_frame(1, ETH_P_IP);
+            udp_hdr(ip4_hdr(f, 0x0a000001, 0x0a000002, IPPROTO_UDP), 1024, 1024);
+            frames.push_back(f);
+        }
+
+        inject("lo", frames);
+
+        auto v = x.batch_len();
+        Assert(*std::max_element(v.begin(), v.end()) > 1, is_true());
+    }
+
+    Test(group_weight)
+    {
+        pfq x(group_policy::undefined, 64);
+
+        AssertThrow(x.group_weight(0));
+
+        int gid = x.join_group(0);
+
+        Assert(x.group_weight(gid), is_equal_to(1));
+
+        x.set_group_weight(gid, 4);
+        Assert(x.group_weight(gid), is_equal_to(4));
+
+        AssertThrow(x.set_group_weight(gid, 0));
+        AssertThrow(x.set_group_weight(gid, Q_MAX_WEIGHT + 1));
+    }
+
+    Test(group_weight_leave)
+    {
+        pfq x(group_policy::shared, 64);
+        pfq y(group_policy::undefined, 64);
+
+        int gid = x.group_id();
+
+        y.join_group(gid, group_policy::shared);
+        y.set_group_weight(gid, Q_MAX_WEIGHT);
+
+        x.set_group_function(gid, "steer-ipv4", 0);
+
+        x.bind(DEV.c_str());
+        x.enable();
+        y.enable();
+
+        // the steering table is rebuilt without the socket that left,
+        // whatever its weight
+
+        y.leave_group(gid);
+        y.read(100000);  // packets steered before the leave
+
+        size_t nx = 0, ny = 0;
+
+        std::cout << "waiting for ipv4 packets from " << DEV << "..." << std::flush;
+        while (nx < 64)
+        {
+            nx += x.read(100000).size();
+            ny += y.read(100000).size();
+            std::cout << "." << std::flush;
+        }
+        std::cout << std::endl;
+
+        Assert(ny, is_equal_to(0));
+
+        // weights do not survive a leave
+
+        y.join_group(gid, group_policy::shared);
+        Assert(y.group_weight(gid), is_equal_to(1));
+    }
+
+    Test(group_elephant)
+    {
+        pfq x(group_policy::undefined, 64);
+
+        AssertThrow(x.set_group_elephant(0, Q_ELEPHANT_SPLIT, 1000));
+
+        int gid = x.join_group(0);
+
+        auto e = x.group_elephant(gid);
+        Assert(e.policy, is_equal_to(Q_ELEPHANT_PIN));
+        Assert(e.pps,    is_equal_to(0));
+
+        x.set_group_elephant(gid, Q_ELEPHANT_SPLIT, 1000);
+
+        e = x.group_elephant(gid);
+        Assert(e.policy, is_equal_to(Q_ELEPHANT_SPLIT));
+        Assert(e.pps,    is_equal_to(1000));
+
+        AssertThrow(x.set_group_elephant(gid, 3, 1000));
+        Assert(x.group_elephant(gid).policy, is_equal_to(Q_ELEPHANT_SPLIT));
+
+        // flows of balanced steering are inserted in the tables
+
+        x.set_group_elephant(gid, Q_ELEPHANT_REHOME, 1);
+        x.set_group_function(gid, "balance-flow", 0);
+        x.bind_group(gid, DEV.c_str());
+        x.enable();
+
+        auto s0 = x.flow_stats();
+
+        std::cout << "waiting for udp/tcp packets from " << DEV << "..." << std::flush;
+        for(size_t n = 0; n < 64;)
+        {
+            n += x.read(100000).size();
+            std::cout << "." << std::flush;
+        }
+        std::cout << std::endl;
+
+        auto s = x.flow_stats();
+        Assert(s.insert > s0.insert, is_true());
+        Assert(s.flows > 0, is_true());
+    }
+
+    Test(group_reta)
+    {
+        pfq x(group_policy::undefined, 64);
+
+        AssertThrow(x.set_group_reta(0, std::vector<int>(128, x.id())));
+
+        int gid = x.join_group(0);
+
+        Assert(x.group_reta(gid).empty(), is_true());
+
+        x.set_group_reta(gid, std::vector<int>(128, x.id()));
+
+        auto r = x.group_reta(gid);
+        Assert(r.size(), is_equal_to(128));
+        Assert(r[127], is_equal_to(x.id()));
+
+        AssertThrow(x.set_group_reta(gid, std::vector<int>(100, x.id())));
+        AssertThrow(x.set_group_reta(gid, std::vector<int>(128, Q_MAX_ID)));
+
+        x.set_group_reta(gid, std::vector<int>());
+        Assert(x.group_reta(gid).empty(), is_true());
+    }
+
+    Test(group_balance)
+    {
+        pfq x(group_policy::shared, 64);
+        pfq y(group_policy::undefined, 64);
+
+        y.join_group(x.group_id(), group_policy::shared);
+
+        x.set_group_function(x.group_id(), "balance", 0);
+
+        x.bind(DEV.c_str());
+        x.enable();
+        y.enable();
+
+        // packets without a flow go to the least loaded socket, one by one
+
+        size_t nx = 0, ny = 0;
+
+        std::cout << "waiting for packets from " << DEV << "..." << std::flush;
+        while (nx + ny < 256)
+        {
+            nx += x.read(100000).size();
+            ny += y.read(100000).size();
+            std::cout << "." << std::flush;
+        }
+        std::cout << std::endl;
+
+        Assert(nx > 0, is_true());
+        Assert(ny > 0, is_true());
+    }
+
+    Test(group_balance_flow)
+    {
+        pfq x(group_policy::shared, 64);
+        pfq y(group_policy::undefined, 64);
+
+        y.join_group(x.group_id(), group_policy::shared);
+
+        x.set_group_function(x.group_id(), "balance-flow", 0);
+
+        auto s0 = x.flow_stats();
+
+        x.bind(DEV.c_str());
+        x.enable();
+        y.enable();
+
+        size_t n = 0;
+
+        std::cout << "waiting for udp/tcp packets from " << DEV << "..." << std::flush;
+        while (n < 64)
+        {
+            n += x.read(100000).size();
+            n += y.read(100000).size();
+            std::cout << "." << std::flush;
+        }
+        std::cout << std::endl;
+
+        // the socket of each flow is recorded
+
+        auto s1 = x.flow_stats();
+        Assert(s1.insert > s0.insert, is_true());
+    }
+
     Test(groups_mask)
     {
         pfq x;
@@ -333,6 +924,21 @@ Context(PFQ)
         Assert(v.empty(), is_true());
     }
 
+    Test(groups_bitmap)
+    {
+        pfq x(group_policy::undefined, 64);
+
+        Assert(x.join_group(3),   is_equal_to(3));
+        Assert(x.join_group(200), is_equal_to(200));
+
+        Assert(x.groups_mask(), is_equal_to(1UL << 3));
+
+        auto v = x.groups();
+        Assert(v.size(), is_equal_to(2));
+        Assert(v[0], is_equal_to(3));
+        Assert(v[1], is_equal_to(200));
+    }
+
     Test(join_restricted)
     {
         pfq x(group_policy::restricted, 64);
@@ -504,6 +1110,21 @@ Context(PFQ)
         AssertNothrow(x.vlan_filters_enable(x.group_id(), false));
     }
 
+    Test(group_fprog)
+    {
+        pfq x(64);
+        Assert(x.group_fprog_mode(x.group_id()), is_equal_to(Q_FPROG_NONE));
+
+        struct sock_filter accept { 0x06, 0, 0, 0xffffffff };  // ret #-1
+        struct sock_fprog f { 1, &accept };
+
+        AssertNothrow(x.set_group_fprog(x.group_id(), f));
+        Assert(x.group_fprog_mode(x.group_id()), is_not_equal_to(Q_FPROG_NONE));
+
+        AssertNothrow(x.reset_group_fprog(x.group_id()));
+        Assert(x.group_fprog_mode(x.group_id()), is_equal_to(Q_FPROG_NONE));
+    }
+
     Test(vlan_filt)
     {
         pfq x(64);
@@ -556,6 +1177,416 @@ Context(PFQ)
         std::cout << std::endl;
     }
 
+    Test(group_percpu_context)
+    {
+        pfq x(group_policy::shared, 64);
+
+        x.set_group_function(x.group_id(), "counter", 0);
+
+        pfq_counter c { 1, 1 };
+        AssertNothrow(x.get_group_function_context(x.group_id(), c));
+
+        Assert(c.packets, is_equal_to(0));
+        Assert(c.bytes,   is_equal_to(0));
+
+        int bad = 0;
+        AssertThrow(x.get_group_function_context(x.group_id(), bad));
+    }
+
+
+    Test(group_steer_context)
+    {
+        pfq x(group_policy::shared, 64);
+
+        x.set_group_function(x.group_id(), "steer-flow", 0);
+
+        pfq_steer_context c { Q_HASH_JHASH, 42 };
+        AssertNothrow(x.set_group_function_context(x.group_id(), c, 0));
+
+        char bad = 0;
+        AssertThrow(x.set_group_function_context(x.group_id(), bad, 0));
+
+        // a context set before the function must fit it, too
+
+        AssertNothrow(x.reset_group(x.group_id()));
+        AssertNothrow(x.set_group_function_context(x.group_id(), bad, 0));
+        AssertThrow(x.set_group_function(x.group_id(), "steer-ipv4", 0));
+
+        // balance-flow reads the steering context, too
+
+        AssertNothrow(x.reset_group(x.group_id()));
+        AssertNothrow(x.set_group_function(x.group_id(), "balance-flow", 0));
+        AssertNothrow(x.set_group_function_context(x.group_id(), c, 0));
+        AssertThrow(x.set_group_function_context(x.group_id(), bad, 0));
+    }
+
+
+    Test(group_ipv6_functions)
+    {
+        pfq x(group_policy::shared, 64);
+        pfq y(group_policy::undefined, 64);
+
+        y.join_group(x.group_id(), group_policy::shared);
+
+        x.bind("lo");
+        x.enable();
+        y.enable();
+
+        pfq_steer_context c { Q_HASH_TOEPLITZ, 0 };
+
+        // udp6 drops ipv4 and tcp6, and finds udp past the extension headers
+
+        AssertNothrow(x.set_group_function(x.group_id(), "udp6", 0));
+        AssertNothrow(x.set_group_function(x.group_id(), "steer-flow6", 1));
+        AssertNothrow(x.set_group_function_context(x.group_id(), c, 1));
+
+        auto udp4 = eth_frame(1, ETH_P_IP);
+        udp_hdr(ip4_hdr(udp4, 0x0a000001, 0x0a000002, IPPROTO_UDP), 1024, 53);
+
+        auto tcp6 = eth_frame(2, ETH_P_IPV6);
+        tcp_hdr(ip6_hdr(tcp6, 1, 2, IPPROTO_TCP), 1024, 80);
+
+        auto udp6 = eth_frame(3, ETH_P_IPV6);
+        udp_hdr(ip6_hdr(udp6, 1, 2, IPPROTO_UDP), 1024, 53);
+
+        auto udp6_ext = eth_frame(4, ETH_P_IPV6);
+        udp_hdr(ip6_opts(ip6_opts(ip6_hdr(udp6_ext, 1, 2, IPPROTO_HOPOPTS), IPPROTO_DSTOPTS), IPPROTO_UDP), 1024, 53);
+
+        inject("lo", { udp4, tcp6, udp6, udp6_ext });
+
+        auto t = by_tag(read_tags({ &x, &y }, 2));
+        Assert(t.size(),   is_equal_to(2U));
+        Assert(t.count(3), is_equal_to(1U));
+        Assert(t.count(4), is_equal_to(1U));
+
+        // steer-flow6: the frames of a flow, with or without extension
+        // headers, are read from the same socket
+
+        AssertNothrow(x.reset_group(x.group_id()));
+        AssertNothrow(x.set_group_function(x.group_id(), "steer-flow6", 0));
+        AssertNothrow(x.set_group_function_context(x.group_id(), c, 0));
+
+        std::vector<frame> frames;
+
+        for(uint16_t tag = 1; tag <= 16; tag++)
+            for(int n = 0; n < 4; n++)
+            {
+                auto f = eth_frame(tag, ETH_P_IPV6);
+
+                if (n & 1)
+                    ip6_opts(ip6_hdr(f, 1, 2, IPPROTO_DSTOPTS), IPPROTO_UDP);
+                else
+                    ip6_hdr(f, 1, 2, IPPROTO_UDP);
+
+                frames.push_back(udp_hdr(f, 1024 + tag, 53));
+            }
+
+        inject("lo", frames);
+
+        auto tags = read_tags({ &x, &y }, frames.size());
+
+        t = by_tag(tags);
+        Assert(t.size(), is_equal_to(16U));
+        for(auto & e : t)
+        {
+            Assert(e.second.first,  is_equal_to(1));
+            Assert(e.second.second, is_equal_to(4));
+        }
+
+        Assert(tags[0].empty() || tags[1].empty(), is_false());
+    }
+
+
+    Test(group_vlan_mpls_functions)
+    {
+        pfq x(group_policy::shared, 64);
+        pfq y(group_policy::undefined, 64);
+
+        y.join_group(x.group_id(), group_policy::shared);
+
+        x.bind("lo");
+        x.enable();
+        y.enable();
+
+        pfq_steer_context c { Q_HASH_JHASH, 0 };
+
+        // the frames of a qinq inner vid, or of an mpls top label, with
+        // different flows inside, are read from one socket
+
+        for(auto name : { "steer-vlan-inner", "steer-mpls" })
+        {
+            bool mpls = std::string(name) == "steer-mpls";
+
+            AssertNothrow(x.reset_group(x.group_id()));
+            AssertNothrow(x.set_group_function(x.group_id(), name, 0));
+            AssertNothrow(x.set_group_function_context(x.group_id(), c, 0));
+
+            std::vector<frame> frames;
+
+            for(uint16_t tag = 1; tag <= 16; tag++)
+                for(uint16_t n = 0; n < 4; n++)
+                {
+                    auto f = eth_frame(tag, mpls ? ETH_P_MPLS_UC : ETH_P_8021AD);
+
+                    if (mpls)
+                        mpls_label(mpls_label(f, 1000 + tag, false), 16, true);
+                    else
+                        vlan_tag(vlan_tag(f, 100, ETH_P_8021Q), tag, ETH_P_IP);
+
+                    frames.push_back(udp_hdr(ip4_hdr(f, 0x0a000001 + n, 0x0a000002, IPPROTO_UDP), 1024 + n, 53));
+                }
+
+            inject("lo", frames);
+
+            auto tags = read_tags({ &x, &y }, frames.size());
+
+            auto t = by_tag(tags);
+            Assert(t.size(), is_equal_to(16U));
+            for(auto & e : t)
+            {
+                Assert(e.second.first,  is_equal_to(1));
+                Assert(e.second.second, is_equal_to(4));
+            }
+
+            Assert(tags[0].empty() || tags[1].empty(), is_false());
+        }
+
+        // qinq drops untagged and single tagged frames, mpls drops unlabeled ones
+
+        auto untagged = eth_frame(1, ETH_P_IP);
+        udp_hdr(ip4_hdr(untagged, 0x0a000001, 0x0a000002, IPPROTO_UDP), 1024, 53);
+
+        auto tagged = eth_frame(2, ETH_P_8021Q);
+        udp_hdr(ip4_hdr(vlan_tag(tagged, 5, ETH_P_IP), 0x0a000001, 0x0a000002, IPPROTO_UDP), 1024, 53);
+
+        auto qinq = eth_frame(3, ETH_P_8021AD);
+        udp_hdr(ip4_hdr(vlan_tag(vlan_tag(qinq, 100, ETH_P_8021Q), 5, ETH_P_IP), 0x0a000001, 0x0a000002, IPPROTO_UDP), 1024, 53);
+
+        auto labeled = eth_frame(4, ETH_P_MPLS_UC);
+        udp_hdr(ip4_hdr(mpls_label(labeled, 1000, true), 0x0a000001, 0x0a000002, IPPROTO_UDP), 1024, 53);
+
+        for(auto name : { "qinq", "mpls" })
+        {
+            bool mpls = std::string(name) == "mpls";
+
+            AssertNothrow(x.reset_group(x.group_id()));
+            AssertNothrow(x.set_group_function(x.group_id(), name, 0));
+            AssertNothrow(x.set_group_function(x.group_id(), mpls ? "steer-mpls" : "steer-vlan-inner", 1));
+            AssertNothrow(x.set_group_function_context(x.group_id(), c, 1));
+
+            inject("lo", { untagged, tagged, qinq, labeled });
+
+            auto t = by_tag(read_tags({ &x, &y }, 1));
+            Assert(t.size(),              is_equal_to(1U));
+            Assert(t.count(mpls ? 4 : 3), is_equal_to(1U));
+        }
+    }
+
+
+    Test(group_fragment_hash)
+    {
+        pfq x(group_policy::shared, 64);
+        pfq y(group_policy::undefined, 64);
+
+        y.join_group(x.group_id(), group_policy::shared);
+
+        x.bind("lo");
+        x.enable();
+        y.enable();
+
+        // the ports are in the first fragment only: all the fragments of a
+        // datagram are steered to the same socket, with every hash
+
+        for(auto name : { "steer-flow", "steer-flow6" })
+        {
+            bool ip6 = std::string(name) == "steer-flow6";
+
+            for(int hash : { Q_HASH_LEGACY, Q_HASH_JHASH, Q_HASH_TOEPLITZ })
+            {
+                pfq_steer_context c { hash, 42 };
+
+                AssertNothrow(x.reset_group(x.group_id()));
+                AssertNothrow(x.set_group_function(x.group_id(), name, 0));
+                AssertNothrow(x.set_group_function_context(x.group_id(), c, 0));
+
+                std::vector<frame> frames;
+
+                for(uint16_t tag = 1; tag <= 16; tag++)
+                    for(uint16_t off = 0; off < 3; off++)
+                    {
+                        auto f = eth_frame(tag, ip6 ? ETH_P_IPV6 : ETH_P_IP);
+
+                        if (ip6)
+                            ip6_frag(ip6_hdr(f, 1, 2, IPPROTO_FRAGMENT), IPPROTO_UDP, tag, off, off < 2);
+                        else
+                            ip4_hdr(f, 0x0a000001, 0x0a000002, IPPROTO_UDP, tag, (off < 2 ? IP_MF : 0) | off);
+
+                        if (off == 0)
+                            udp_hdr(f, 1024 + tag, 53);
+
+                        frames.push_back(f);
+                    }
+
+                inject("lo", frames);
+
+                auto tags = read_tags({ &x, &y }, frames.size());
+
+                auto t = by_tag(tags);
+                Assert(t.size(), is_equal_to(16U));
+                for(auto & e : t)
+                {
+                    Assert(e.second.first,  is_equal_to(1));
+                    Assert(e.second.second, is_equal_to(3));
+                }
+
+                Assert(tags[0].empty() || tags[1].empty(), is_false());
+            }
+        }
+    }
+
+
+    Test(group_tunnel_context)
+    {
+        pfq x(group_policy::shared, 64);
+
+        x.set_group_function(x.group_id(), "steer-tunnel", 0);
+
+        pfq_tunnel_context t { Q_HASH_TOEPLITZ, 0, 2 };
+        AssertNothrow(x.set_group_function_context(x.group_id(), t, 0));
+
+        pfq_steer_context c { Q_HASH_JHASH, 0 };
+        AssertThrow(x.set_group_function_context(x.group_id(), c, 0));
+    }
+
+
+    Test(group_tunnel_functions)
+    {
+        pfq x(group_policy::shared, 64);
+        pfq y(group_policy::undefined, 64);
+
+        y.join_group(x.group_id(), group_policy::shared);
+
+        x.bind("lo");
+        x.enable();
+        y.enable();
+
+        // inner flows with the same outer headers (up to depth gre tunnels):
+        // each one is read from a single socket, and they are spread
+
+        for(int depth = 1; depth <= Q_TUNNEL_MAX_DEPTH; depth++)
+        {
+            pfq_tunnel_context t { Q_HASH_JHASH, 0, depth };
+
+            AssertNothrow(x.reset_group(x.group_id()));
+            AssertNothrow(x.set_group_function(x.group_id(), "steer-tunnel", 0));
+            AssertNothrow(x.set_group_function_context(x.group_id(), t, 0));
+
+            std::vector<frame> frames;
+
+            for(uint16_t tag = 1; tag <= 16; tag++)
+                for(int n = 0; n < 4; n++)
+                {
+                    auto f = eth_frame(tag, ETH_P_IP);
+
+                    for(int d = 0; d < depth; d++)
+                        gre_hdr(ip4_hdr(f, 0x0a000001, 0x0a000002, IPPROTO_GRE), ETH_P_IP);
+
+                    frames.push_back(udp_hdr(ip4_hdr(f, 0xc0a80001, 0xc0a80002, IPPROTO_UDP), 1024 + tag, 53));
+                }
+
+            inject("lo", frames);
+
+            auto tags = read_tags({ &x, &y }, frames.size());
+
+            auto r = by_tag(tags);
+            Assert(r.size(), is_equal_to(16U));
+            for(auto & e : r)
+            {
+                Assert(e.second.first,  is_equal_to(1));
+                Assert(e.second.second, is_equal_to(4));
+            }
+
+            Assert(tags[0].empty() || tags[1].empty(), is_false());
+        }
+
+        // gre drops plain udp and ip-in-ip
+
+        pfq_tunnel_context t { Q_HASH_JHASH, 0, 1 };
+
+        AssertNothrow(x.reset_group(x.group_id()));
+        AssertNothrow(x.set_group_function(x.group_id(), "gre", 0));
+        AssertNothrow(x.set_group_function(x.group_id(), "steer-tunnel", 1));
+        AssertNothrow(x.set_group_function_context(x.group_id(), t, 1));
+
+        auto gre = eth_frame(1, ETH_P_IP);
+        gre_hdr(ip4_hdr(gre, 0x0a000001, 0x0a000002, IPPROTO_GRE), ETH_P_IP);
+        udp_hdr(ip4_hdr(gre, 0xc0a80001, 0xc0a80002, IPPROTO_UDP), 1024, 53);
+
+        auto udp = eth_frame(2, ETH_P_IP);
+        udp_hdr(ip4_hdr(udp, 0x0a000001, 0x0a000002, IPPROTO_UDP), 1024, 53);
+
+        auto ipip = eth_frame(3, ETH_P_IP);
+        ip4_hdr(ipip, 0x0a000001, 0x0a000002, IPPROTO_IPIP);
+        udp_hdr(ip4_hdr(ipip, 0xc0a80001, 0xc0a80002, IPPROTO_UDP), 1024, 53);
+
+        inject("lo", { udp, ipip, gre });
+
+        auto r = by_tag(read_tags({ &x, &y }, 1));
+        Assert(r.size(),   is_equal_to(1U));
+        Assert(r.count(1), is_equal_to(1U));
+    }
+
+
+    Test(group_sample)
+    {
+        pfq x(group_policy::shared, 64);
+
+        pfq_sample_context ctx { 100, 0 };
+
+        x.set_group_function(x.group_id(), "sample-flow", 0);
+        AssertNothrow(x.set_group_function_context(x.group_id(), ctx, 0));
+
+        pfq_sample_stats s { 1, 1 };
+        AssertNothrow(x.get_group_function_context(x.group_id(), s));
+
+        Assert(s.packets, is_equal_to(0));
+        Assert(s.sampled, is_equal_to(0));
+
+        int bad = 100;
+        AssertThrow(x.set_group_function_context(x.group_id(), bad, 0));
+    }
+
+
+    Test(group_sample_ratio)
+    {
+        pfq x(group_policy::shared, 64);
+
+        pfq_sample_context ctx { 4, 0 };
+
+        x.set_group_function(x.group_id(), "sample", 0);
+        x.set_group_function_context(x.group_id(), ctx, 0);
+        x.set_group_function(x.group_id(), "clone",  1);
+
+        x.bind(DEV.c_str());
+        x.enable();
+
+        pfq_sample_stats s { 0, 0 };
+
+        std::cout << "waiting for packets from " << DEV << "..." << std::flush;
+        while (s.packets < 256)
+        {
+            x.read(100000);
+            x.get_group_function_context(x.group_id(), s);
+            std::cout << "." << std::flush;
+        }
+        std::cout << std::endl;
+
+        // about 1 in 4 packets is sampled, the others are dropped
+
+        Assert(s.sampled > 0, is_true());
+        Assert(s.packets - s.sampled > s.sampled, is_true());
+    }
+
 }
 
 